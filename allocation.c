@@ -0,0 +1,94 @@
+#define ALLOCATION_COUNTER_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "allocation.h"
+
+/*
+ * Counts blocks rather than bytes: a block that is never freed shows up as
+ * a live count that keeps climbing, which is what a long-lived shell needs
+ * to notice, and counting needs no header in front of each block.
+ */
+static volatile LONG64 liveBlocks = 0;
+static volatile LONG64 peakLiveBlocks = 0;
+static volatile LONG64 totalAllocations = 0;
+
+static void countAllocation(void)
+{
+    LONG64 live = InterlockedIncrement64(&liveBlocks);
+    InterlockedIncrement64(&totalAllocations);
+
+    LONG64 peak = peakLiveBlocks;
+    while (live > peak)
+    {
+        LONG64 seen = InterlockedCompareExchange64(&peakLiveBlocks, live, peak);
+        if (seen == peak) break;
+        peak = seen;
+    }
+}
+
+void* countedMalloc(size_t size)
+{
+    void* block = malloc(size);
+    if (block) countAllocation();
+    return block;
+}
+
+void* countedCalloc(size_t count, size_t size)
+{
+    void* block = calloc(count, size);
+    if (block) countAllocation();
+    return block;
+}
+
+void* countedRealloc(void* block, size_t size)
+{
+    void* resized = realloc(block, size);
+    if (block == NULL && resized != NULL)
+    {
+        countAllocation();
+    }
+    else if (block != NULL && size == 0)
+    {
+        InterlockedDecrement64(&liveBlocks);
+    }
+    return resized;
+}
+
+char* countedStrdup(const char* text)
+{
+    char* copy = _strdup(text);
+    if (copy) countAllocation();
+    return copy;
+}
+
+void countedFree(void* block)
+{
+    if (block == NULL) return;
+
+    InterlockedDecrement64(&liveBlocks);
+    free(block);
+}
+
+void uncountedFree(void* block)
+{
+    free(block);
+}
+
+void getAllocationStats(AllocationStats* stats)
+{
+    stats->liveBlocks = liveBlocks;
+    stats->peakLiveBlocks = peakLiveBlocks;
+    stats->totalAllocations = totalAllocations;
+}
+
+void printAllocationStats(const char* label)
+{
+    AllocationStats stats;
+    getAllocationStats(&stats);
+    fprintf(stderr, "%s: %lld live blocks (peak %lld), %lld allocations\n",
+        label, stats.liveBlocks, stats.peakLiveBlocks, stats.totalAllocations);
+}
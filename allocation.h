@@ -0,0 +1,38 @@
+#ifndef ALLOCATION_H
+#define ALLOCATION_H
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct AllocationStats
+{
+    long long liveBlocks;
+    long long peakLiveBlocks;
+    long long totalAllocations;
+} AllocationStats;
+
+void* countedMalloc(size_t size);
+void* countedCalloc(size_t count, size_t size);
+void* countedRealloc(void* block, size_t size);
+char* countedStrdup(const char* text);
+void countedFree(void* block);
+
+/* For blocks the C runtime allocated itself, such as _dupenv_s results. */
+void uncountedFree(void* block);
+
+void getAllocationStats(AllocationStats* stats);
+void printAllocationStats(const char* label);
+
+/*
+ * Modules include this after the C library headers so their heap traffic
+ * goes through the counters; allocation.c itself opts out.
+ */
+#ifndef ALLOCATION_COUNTER_IMPLEMENTATION
+#define malloc(size) countedMalloc(size)
+#define calloc(count, size) countedCalloc(count, size)
+#define realloc(block, size) countedRealloc(block, size)
+#define _strdup(text) countedStrdup(text)
+#define free(block) countedFree(block)
+#endif
+
+#endif
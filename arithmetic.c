@@ -0,0 +1,630 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "arithmetic.h"
+#include "environment.h"
+#include "allocation.h"
+
+#ifndef MAX_ARITHMETIC_NAME_LENGTH
+#define MAX_ARITHMETIC_NAME_LENGTH 256
+#endif
+
+#ifndef MAX_ARITHMETIC_ERROR_LENGTH
+#define MAX_ARITHMETIC_ERROR_LENGTH 160
+#endif
+
+/* | is the loosest binary operator; && and || sit above the table. */
+#define LOWEST_BINARY_PRECEDENCE 3
+
+typedef enum ArithmeticOperator
+{
+    ARITH_ASSIGN,
+    ARITH_POWER,
+    ARITH_MULTIPLY,
+    ARITH_DIVIDE,
+    ARITH_REMAINDER,
+    ARITH_ADD,
+    ARITH_SUBTRACT,
+    ARITH_SHIFT_LEFT,
+    ARITH_SHIFT_RIGHT,
+    ARITH_LESS,
+    ARITH_LESS_EQUAL,
+    ARITH_GREATER,
+    ARITH_GREATER_EQUAL,
+    ARITH_EQUAL,
+    ARITH_NOT_EQUAL,
+    ARITH_BIT_AND,
+    ARITH_BIT_XOR,
+    ARITH_BIT_OR
+} ArithmeticOperator;
+
+typedef struct OperatorSpelling
+{
+    const char* text;
+    ArithmeticOperator op;
+    int precedence;
+    int rightAssociative;
+} OperatorSpelling;
+
+/* Longest spellings first so that "<<" is never read as "<". */
+static const OperatorSpelling binaryOperators[] =
+{
+    { "**", ARITH_POWER, 11, 1 },
+    { "<<", ARITH_SHIFT_LEFT, 8, 0 },
+    { ">>", ARITH_SHIFT_RIGHT, 8, 0 },
+    { "<=", ARITH_LESS_EQUAL, 7, 0 },
+    { ">=", ARITH_GREATER_EQUAL, 7, 0 },
+    { "==", ARITH_EQUAL, 6, 0 },
+    { "!=", ARITH_NOT_EQUAL, 6, 0 },
+    { "*", ARITH_MULTIPLY, 10, 0 },
+    { "/", ARITH_DIVIDE, 10, 0 },
+    { "%", ARITH_REMAINDER, 10, 0 },
+    { "+", ARITH_ADD, 9, 0 },
+    { "-", ARITH_SUBTRACT, 9, 0 },
+    { "<", ARITH_LESS, 7, 0 },
+    { ">", ARITH_GREATER, 7, 0 },
+    { "&", ARITH_BIT_AND, 5, 0 },
+    { "^", ARITH_BIT_XOR, 4, 0 },
+    { "|", ARITH_BIT_OR, 3, 0 }
+};
+
+static const OperatorSpelling assignmentOperators[] =
+{
+    { "<<=", ARITH_SHIFT_LEFT, 0, 1 },
+    { ">>=", ARITH_SHIFT_RIGHT, 0, 1 },
+    { "*=", ARITH_MULTIPLY, 0, 1 },
+    { "/=", ARITH_DIVIDE, 0, 1 },
+    { "%=", ARITH_REMAINDER, 0, 1 },
+    { "+=", ARITH_ADD, 0, 1 },
+    { "-=", ARITH_SUBTRACT, 0, 1 },
+    { "&=", ARITH_BIT_AND, 0, 1 },
+    { "^=", ARITH_BIT_XOR, 0, 1 },
+    { "|=", ARITH_BIT_OR, 0, 1 },
+    { "=", ARITH_ASSIGN, 0, 1 }
+};
+
+#define BINARY_OPERATOR_COUNT (sizeof(binaryOperators) / sizeof(binaryOperators[0]))
+#define ASSIGNMENT_OPERATOR_COUNT (sizeof(assignmentOperators) / sizeof(assignmentOperators[0]))
+
+/*
+ * evaluate is cleared while parsing the side of &&, || or ?: that is not
+ * taken, so that side is checked for syntax but assigns nothing and
+ * cannot divide by zero.
+ */
+typedef struct ArithmeticParser
+{
+    const char* pos;
+    int evaluate;
+    int failed;
+    char error[MAX_ARITHMETIC_ERROR_LENGTH];
+} ArithmeticParser;
+
+static long long parseComma(ArithmeticParser* parser);
+static long long parseAssignment(ArithmeticParser* parser);
+static long long parseConditional(ArithmeticParser* parser);
+static long long parseUnary(ArithmeticParser* parser);
+
+static long long failArithmetic(ArithmeticParser* parser, const char* message,
+    const char* detail)
+{
+    if (!parser->failed)
+    {
+        parser->failed = 1;
+        _snprintf_s(parser->error, sizeof(parser->error), _TRUNCATE, "%s%s",
+            message, detail);
+    }
+    return 0;
+}
+
+static void skipSpaces(ArithmeticParser* parser)
+{
+    while (isspace((unsigned char)*parser->pos))
+    {
+        parser->pos++;
+    }
+}
+
+/* Signed overflow wraps, as it does in other shells, instead of being undefined. */
+static long long wrapAdd(long long left, long long right)
+{
+    return (long long)((unsigned long long)left + (unsigned long long)right);
+}
+
+static long long wrapSubtract(long long left, long long right)
+{
+    return (long long)((unsigned long long)left - (unsigned long long)right);
+}
+
+static long long wrapMultiply(long long left, long long right)
+{
+    return (long long)((unsigned long long)left * (unsigned long long)right);
+}
+
+/* Decimal, 0x hexadecimal or leading-zero octal, like C. */
+static int parseNumber(const char* text, long long* value, const char** end)
+{
+    if (!isdigit((unsigned char)*text))
+    {
+        return 0;
+    }
+    char* stop = NULL;
+    unsigned long long magnitude = strtoull(text, &stop, 0);
+    if (isalnum((unsigned char)*stop) || *stop == '_')
+    {
+        return 0;
+    }
+    *value = (long long)magnitude;
+    *end = stop;
+    return 1;
+}
+
+static int readName(ArithmeticParser* parser, char* name)
+{
+    const char* c = parser->pos;
+    if (!isalpha((unsigned char)*c) && *c != '_')
+    {
+        return 0;
+    }
+
+    int nameI = 0;
+    while ((isalnum((unsigned char)*c) || *c == '_') &&
+        nameI < MAX_ARITHMETIC_NAME_LENGTH - 1)
+    {
+        name[nameI++] = *c++;
+    }
+    name[nameI] = '\0';
+    parser->pos = c;
+    return 1;
+}
+
+/* Unset and empty variables read as 0; anything else must be a whole number. */
+static long long readVariable(ArithmeticParser* parser, const char* name)
+{
+    const char* text = getEnvironmentVariableValue(name);
+    if (text == NULL || !parser->evaluate)
+    {
+        return 0;
+    }
+
+    while (isspace((unsigned char)*text))
+    {
+        text++;
+    }
+    if (*text == '\0')
+    {
+        return 0;
+    }
+
+    int negative = 0;
+    if (*text == '-' || *text == '+')
+    {
+        negative = *text == '-';
+        text++;
+    }
+
+    long long value = 0;
+    const char* end = NULL;
+    if (!parseNumber(text, &value, &end))
+    {
+        return failArithmetic(parser, "value is not a number: ", name);
+    }
+    while (isspace((unsigned char)*end))
+    {
+        end++;
+    }
+    if (*end != '\0')
+    {
+        return failArithmetic(parser, "value is not a number: ", name);
+    }
+    return negative ? wrapSubtract(0, value) : value;
+}
+
+static void assignVariable(ArithmeticParser* parser, const char* name, long long value)
+{
+    if (!parser->evaluate || parser->failed)
+    {
+        return;
+    }
+    char text[32];
+    _snprintf_s(text, sizeof(text), _TRUNCATE, "%lld", value);
+    addEnvironmentVariable(name, text);
+}
+
+static long long applyOperator(ArithmeticParser* parser, ArithmeticOperator op,
+    long long left, long long right)
+{
+    switch (op)
+    {
+    case ARITH_ASSIGN:
+        return right;
+    case ARITH_POWER:
+    {
+        if (right < 0)
+        {
+            return parser->evaluate ?
+                failArithmetic(parser, "negative exponent", "") : 0;
+        }
+        long long result = 1;
+        while (right > 0)
+        {
+            if (right & 1)
+            {
+                result = wrapMultiply(result, left);
+            }
+            left = wrapMultiply(left, left);
+            right >>= 1;
+        }
+        return result;
+    }
+    case ARITH_MULTIPLY:
+        return wrapMultiply(left, right);
+    case ARITH_DIVIDE:
+    case ARITH_REMAINDER:
+        if (right == 0)
+        {
+            return parser->evaluate ?
+                failArithmetic(parser, "division by zero", "") : 0;
+        }
+        if (left == LLONG_MIN && right == -1)
+        {
+            return op == ARITH_DIVIDE ? LLONG_MIN : 0;
+        }
+        return op == ARITH_DIVIDE ? left / right : left % right;
+    case ARITH_ADD:
+        return wrapAdd(left, right);
+    case ARITH_SUBTRACT:
+        return wrapSubtract(left, right);
+    case ARITH_SHIFT_LEFT:
+        return (long long)((unsigned long long)left << (right & 63));
+    case ARITH_SHIFT_RIGHT:
+        return left >> (right & 63);
+    case ARITH_LESS:
+        return left < right;
+    case ARITH_LESS_EQUAL:
+        return left <= right;
+    case ARITH_GREATER:
+        return left > right;
+    case ARITH_GREATER_EQUAL:
+        return left >= right;
+    case ARITH_EQUAL:
+        return left == right;
+    case ARITH_NOT_EQUAL:
+        return left != right;
+    case ARITH_BIT_AND:
+        return left & right;
+    case ARITH_BIT_XOR:
+        return left ^ right;
+    case ARITH_BIT_OR:
+        return left | right;
+    }
+    return 0;
+}
+
+/*
+ * Returns the binary operator at pos, or NULL when there is none. "+=",
+ * "&&" and the like are left for the assignment and logical levels.
+ */
+static const OperatorSpelling* matchBinaryOperator(const char* pos)
+{
+    for (size_t i = 0; i < BINARY_OPERATOR_COUNT; i++)
+    {
+        const OperatorSpelling* spelling = &binaryOperators[i];
+        size_t length = strlen(spelling->text);
+        if (strncmp(pos, spelling->text, length) != 0)
+        {
+            continue;
+        }
+        if (spelling->text[length - 1] != '=' && pos[length] == '=')
+        {
+            return NULL;
+        }
+        if ((spelling->op == ARITH_BIT_AND && pos[1] == '&') ||
+            (spelling->op == ARITH_BIT_OR && pos[1] == '|'))
+        {
+            return NULL;
+        }
+        return spelling;
+    }
+    return NULL;
+}
+
+static const OperatorSpelling* matchAssignmentOperator(const char* pos)
+{
+    for (size_t i = 0; i < ASSIGNMENT_OPERATOR_COUNT; i++)
+    {
+        const OperatorSpelling* spelling = &assignmentOperators[i];
+        size_t length = strlen(spelling->text);
+        if (strncmp(pos, spelling->text, length) == 0 &&
+            (spelling->op != ARITH_ASSIGN || pos[1] != '='))
+        {
+            return spelling;
+        }
+    }
+    return NULL;
+}
+
+static long long parsePrimary(ArithmeticParser* parser)
+{
+    skipSpaces(parser);
+
+    /* A nested $(( )) is just a pair of parentheses at this point. */
+    if (parser->pos[0] == '$' && parser->pos[1] == '(')
+    {
+        parser->pos++;
+    }
+    if (*parser->pos == '(')
+    {
+        parser->pos++;
+        long long value = parseComma(parser);
+        skipSpaces(parser);
+        if (*parser->pos != ')')
+        {
+            return failArithmetic(parser, "expected ')'", "");
+        }
+        parser->pos++;
+        return value;
+    }
+
+    long long number = 0;
+    const char* end = NULL;
+    if (parseNumber(parser->pos, &number, &end))
+    {
+        parser->pos = end;
+        return number;
+    }
+    if (isdigit((unsigned char)*parser->pos))
+    {
+        return failArithmetic(parser, "invalid number: ", parser->pos);
+    }
+
+    if (*parser->pos == '$')
+    {
+        parser->pos++;
+    }
+    char name[MAX_ARITHMETIC_NAME_LENGTH];
+    if (!readName(parser, name))
+    {
+        return *parser->pos == '\0' ?
+            failArithmetic(parser, "missing operand", "") :
+            failArithmetic(parser, "unexpected ", parser->pos);
+    }
+
+    const char* afterName = parser->pos;
+    skipSpaces(parser);
+    char c = parser->pos[0];
+    if ((c == '+' || c == '-') && parser->pos[1] == c)
+    {
+        parser->pos += 2;
+        long long value = readVariable(parser, name);
+        assignVariable(parser, name, wrapAdd(value, c == '+' ? 1 : -1));
+        return value;
+    }
+    parser->pos = afterName;
+    return readVariable(parser, name);
+}
+
+static long long parseUnary(ArithmeticParser* parser)
+{
+    skipSpaces(parser);
+    char c = parser->pos[0];
+
+    if ((c == '+' || c == '-') && parser->pos[1] == c)
+    {
+        const char* operatorPos = parser->pos;
+        parser->pos += 2;
+        skipSpaces(parser);
+        char name[MAX_ARITHMETIC_NAME_LENGTH];
+        if (readName(parser, name))
+        {
+            long long value = wrapAdd(readVariable(parser, name), c == '+' ? 1 : -1);
+            assignVariable(parser, name, value);
+            return value;
+        }
+        /* Not an increment after all: "--5" is minus minus five. */
+        parser->pos = operatorPos + 1;
+        long long operand = parseUnary(parser);
+        return c == '-' ? wrapSubtract(0, operand) : operand;
+    }
+
+    if (c == '+' || c == '-' || c == '!' || c == '~')
+    {
+        parser->pos++;
+        long long operand = parseUnary(parser);
+        switch (c)
+        {
+        case '-':
+            return wrapSubtract(0, operand);
+        case '!':
+            return !operand;
+        case '~':
+            return ~operand;
+        default:
+            return operand;
+        }
+    }
+    return parsePrimary(parser);
+}
+
+/* Precedence climbing over the binary operator table. */
+static long long parseBinary(ArithmeticParser* parser, int minPrecedence)
+{
+    long long left = parseUnary(parser);
+    while (!parser->failed)
+    {
+        skipSpaces(parser);
+        const OperatorSpelling* spelling = matchBinaryOperator(parser->pos);
+        if (spelling == NULL || spelling->precedence < minPrecedence)
+        {
+            break;
+        }
+        parser->pos += strlen(spelling->text);
+        long long right = parseBinary(parser, spelling->rightAssociative ?
+            spelling->precedence : spelling->precedence + 1);
+        left = applyOperator(parser, spelling->op, left, right);
+    }
+    return left;
+}
+
+static long long parseLogicalAnd(ArithmeticParser* parser)
+{
+    long long value = parseBinary(parser, LOWEST_BINARY_PRECEDENCE);
+    for (;;)
+    {
+        skipSpaces(parser);
+        if (parser->failed || parser->pos[0] != '&' || parser->pos[1] != '&')
+        {
+            return value;
+        }
+        parser->pos += 2;
+        int outerEvaluate = parser->evaluate;
+        parser->evaluate = outerEvaluate && value != 0;
+        long long right = parseBinary(parser, LOWEST_BINARY_PRECEDENCE);
+        parser->evaluate = outerEvaluate;
+        value = value != 0 && right != 0;
+    }
+}
+
+static long long parseLogicalOr(ArithmeticParser* parser)
+{
+    long long value = parseLogicalAnd(parser);
+    for (;;)
+    {
+        skipSpaces(parser);
+        if (parser->failed || parser->pos[0] != '|' || parser->pos[1] != '|')
+        {
+            return value;
+        }
+        parser->pos += 2;
+        int outerEvaluate = parser->evaluate;
+        parser->evaluate = outerEvaluate && value == 0;
+        long long right = parseLogicalAnd(parser);
+        parser->evaluate = outerEvaluate;
+        value = value != 0 || right != 0;
+    }
+}
+
+static long long parseConditional(ArithmeticParser* parser)
+{
+    long long condition = parseLogicalOr(parser);
+    skipSpaces(parser);
+    if (parser->failed || *parser->pos != '?')
+    {
+        return condition;
+    }
+    parser->pos++;
+
+    int outerEvaluate = parser->evaluate;
+    parser->evaluate = outerEvaluate && condition != 0;
+    long long whenTrue = parseComma(parser);
+    skipSpaces(parser);
+    if (*parser->pos != ':')
+    {
+        parser->evaluate = outerEvaluate;
+        return failArithmetic(parser, "expected ':'", "");
+    }
+    parser->pos++;
+    parser->evaluate = outerEvaluate && condition == 0;
+    long long whenFalse = parseConditional(parser);
+    parser->evaluate = outerEvaluate;
+    return condition != 0 ? whenTrue : whenFalse;
+}
+
+static long long parseAssignment(ArithmeticParser* parser)
+{
+    skipSpaces(parser);
+    const char* start = parser->pos;
+    char name[MAX_ARITHMETIC_NAME_LENGTH];
+    if (readName(parser, name))
+    {
+        skipSpaces(parser);
+        const OperatorSpelling* spelling = matchAssignmentOperator(parser->pos);
+        if (spelling != NULL)
+        {
+            parser->pos += strlen(spelling->text);
+            long long right = parseAssignment(parser);
+            long long value = spelling->op == ARITH_ASSIGN ? right :
+                applyOperator(parser, spelling->op, readVariable(parser, name), right);
+            assignVariable(parser, name, value);
+            return value;
+        }
+        parser->pos = start;
+    }
+    return parseConditional(parser);
+}
+
+static long long parseComma(ArithmeticParser* parser)
+{
+    long long value = parseAssignment(parser);
+    for (;;)
+    {
+        skipSpaces(parser);
+        if (parser->failed || *parser->pos != ',')
+        {
+            return value;
+        }
+        parser->pos++;
+        value = parseAssignment(parser);
+    }
+}
+
+/*
+ * Given the text just after "$((", returns the first ')' of the matching
+ * "))", or NULL when the expansion is not closed.
+ */
+const char* findArithmeticExpansionEnd(const char* expressionStart)
+{
+    int depth = 0;
+    for (const char* c = expressionStart; *c; c++)
+    {
+        if (*c == '(')
+        {
+            depth++;
+        }
+        else if (*c == ')')
+        {
+            if (depth == 0)
+            {
+                return c[1] == ')' ? c : NULL;
+            }
+            depth--;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Evaluates a $(( )) body with 64-bit signed integers, C operators and
+ * precedence, and assignment operators that write back through the
+ * variable store. An empty expression is 0.
+ */
+int evaluateArithmetic(const char* expression, long long* result)
+{
+    ArithmeticParser parser;
+    parser.pos = expression;
+    parser.evaluate = 1;
+    parser.failed = 0;
+    parser.error[0] = '\0';
+
+    skipSpaces(&parser);
+    long long value = 0;
+    if (*parser.pos != '\0')
+    {
+        value = parseComma(&parser);
+        skipSpaces(&parser);
+        if (!parser.failed && *parser.pos != '\0')
+        {
+            failArithmetic(&parser, "unexpected ", parser.pos);
+        }
+    }
+
+    if (parser.failed)
+    {
+        fprintf(stderr, "Arithmetic error: %s in \"%s\"\n", parser.error, expression);
+        return 0;
+    }
+    *result = value;
+    return 1;
+}
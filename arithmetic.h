@@ -0,0 +1,7 @@
+#ifndef ARITHMETIC_H
+#define ARITHMETIC_H
+
+const char* findArithmeticExpansionEnd(const char* expressionStart);
+int evaluateArithmetic(const char* expression, long long* result);
+
+#endif
@@ -0,0 +1,506 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <windows.h>
+#include <direct.h>
+
+#include "builtins.h"
+#include "plugin.h"
+#include "environment.h"
+#include "jobs.h"
+#include "resource.h"
+#include "reader.h"
+#include "condition.h"
+#include "joblog.h"
+#include "allocation.h"
+
+#ifndef BUILTIN_TABLE_SIZE
+#define BUILTIN_TABLE_SIZE 64
+#endif
+
+#ifndef MAX_BUILTIN_SYMBOL_LENGTH
+#define MAX_BUILTIN_SYMBOL_LENGTH 256
+#endif
+
+/*
+ * Core builtins live in a static table and are never freed; those with a
+ * streamHandler run after redirection is set up, like loaded ones; builtins
+ * loaded with "enable -f" own their name, module path and a reference on
+ * the module, which "enable -d" and cleanupBuiltinRegistry give back.
+ */
+struct BuiltinEntry
+{
+    const char* name;
+    int (*handler)(char** args);
+    int (*streamHandler)(char** args, HANDLE hIn, HANDLE hOut);
+    XshBuiltinFunction loadedFunction;
+    HMODULE module;
+    char* modulePath;
+    BuiltinEntry* next;
+};
+
+static BuiltinEntry* builtinTable[BUILTIN_TABLE_SIZE];
+static int coreBuiltinsRegistered = 0;
+
+/* Copies of the loaded builtins, chained through next. */
+struct BuiltinRegistrySnapshot
+{
+    BuiltinEntry* loaded;
+};
+
+static int runCdBuiltin(char** args)
+{
+    if (args[1] != NULL)
+    {
+        if (SetCurrentDirectoryA(args[1]) == 0)
+        {
+            fprintf(stderr, "cd: cannot change directory to %s\n", args[1]);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "cd: missing argument\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+static int runPwdBuiltin(char** args)
+{
+    (void)args;
+    char cwdBuf[1024];
+    if (_getcwd(cwdBuf, sizeof(cwdBuf)) != NULL)
+    {
+        printf("%s\n", cwdBuf);
+    }
+    else
+    {
+        fprintf(stderr, "pwd: error getting current directory\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+static int runSetBuiltin(char** args)
+{
+    if (args[1] != NULL && args[2] != NULL)
+    {
+        addEnvironmentVariable(args[1], args[2]);
+    }
+    else
+    {
+        fprintf(stderr, "set: usage: set NAME VALUE\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+static int runExportBuiltin(char** args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "export: usage: export NAME[=VALUE]...\n");
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        char* separator = strchr(args[i], '=');
+        if (separator == args[i])
+        {
+            fprintf(stderr, "export: invalid name: %s\n", args[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (separator != NULL)
+        {
+            *separator = '\0';
+            addEnvironmentVariable(args[i], separator + 1);
+        }
+        if (!exportEnvironmentVariable(args[i]))
+        {
+            status = EXIT_FAILURE;
+        }
+        if (separator != NULL)
+        {
+            *separator = '=';
+        }
+    }
+    return status;
+}
+
+static int runUnsetBuiltin(char** args)
+{
+    if (args[1] != NULL)
+    {
+        removeEnvironmentVariable(args[1]);
+    }
+    else
+    {
+        fprintf(stderr, "unset: usage: unset NAME\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+static int runEchoBuiltin(char** args)
+{
+    int i = 1;
+    while (args[i] != NULL)
+    {
+        if (i > 1)
+        {
+            printf(" ");
+        }
+        printf("%s", args[i]);
+        i++;
+    }
+    printf("\n");
+    return EXIT_SUCCESS;
+}
+
+static int runEnableBuiltin(char** args);
+
+static BuiltinEntry coreBuiltins[] =
+{
+    { "cd", runCdBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "pwd", runPwdBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "set", runSetBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "export", runExportBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "unset", runUnsetBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "echo", runEchoBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "jobs", runJobsBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "ulimit", runUlimitBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "enable", runEnableBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "read", NULL, runReadBuiltin, NULL, NULL, NULL, NULL },
+    { "test", runTestBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "[", runTestBuiltin, NULL, NULL, NULL, NULL, NULL },
+    { "joblog", NULL, runJoblogBuiltin, NULL, NULL, NULL, NULL }
+};
+
+#define CORE_BUILTIN_COUNT (sizeof(coreBuiltins) / sizeof(coreBuiltins[0]))
+
+static unsigned int hashBuiltinName(const char* name)
+{
+    unsigned int hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (unsigned char)tolower((unsigned char)*name++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static BuiltinEntry** findBuiltinSlot(const char* name)
+{
+    BuiltinEntry** slot = &builtinTable[hashBuiltinName(name) % BUILTIN_TABLE_SIZE];
+    while (*slot != NULL && _stricmp((*slot)->name, name) != 0)
+    {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void ensureCoreBuiltinsRegistered(void)
+{
+    if (coreBuiltinsRegistered)
+    {
+        return;
+    }
+    for (size_t i = 0; i < CORE_BUILTIN_COUNT; i++)
+    {
+        BuiltinEntry** slot = findBuiltinSlot(coreBuiltins[i].name);
+        coreBuiltins[i].next = NULL;
+        *slot = &coreBuiltins[i];
+    }
+    coreBuiltinsRegistered = 1;
+}
+
+static void releaseLoadedBuiltin(BuiltinEntry* builtin)
+{
+    FreeLibrary(builtin->module);
+    free((char*)builtin->name);
+    free(builtin->modulePath);
+    free(builtin);
+}
+
+const BuiltinEntry* findBuiltin(const char* name)
+{
+    ensureCoreBuiltinsRegistered();
+    return *findBuiltinSlot(name);
+}
+
+int isLoadedBuiltin(const BuiltinEntry* builtin)
+{
+    return builtin->loadedFunction != NULL;
+}
+
+int builtinTakesStreams(const BuiltinEntry* builtin)
+{
+    return builtin->handler == NULL;
+}
+
+int runCoreBuiltin(const BuiltinEntry* builtin, char** args)
+{
+    return builtin->handler(args);
+}
+
+int runStreamBuiltin(const BuiltinEntry* builtin, char** args,
+    HANDLE hIn, HANDLE hOut)
+{
+    if (builtin->streamHandler != NULL)
+    {
+        return builtin->streamHandler(args, hIn, hOut);
+    }
+
+    XshPluginContext context;
+    ZeroMemory(&context, sizeof(context));
+    context.abiVersion = XSH_PLUGIN_ABI_VERSION;
+    context.size = sizeof(context);
+    context.stdinHandle = hIn;
+    context.stdoutHandle = hOut;
+    context.stderrHandle = GetStdHandle(STD_ERROR_HANDLE);
+    context.getVariable = getEnvironmentVariableValue;
+    context.setVariable = addEnvironmentVariable;
+    context.unsetVariable = removeEnvironmentVariable;
+    context.exportVariable = exportEnvironmentVariable;
+
+    int argc = 0;
+    while (args[argc] != NULL)
+    {
+        argc++;
+    }
+
+    /* Anything the shell printed so far must land before the module's writes. */
+    fflush(stdout);
+    fflush(stderr);
+    return builtin->loadedFunction(argc, args, &context);
+}
+
+/*
+ * Each loaded builtin takes its own reference on the module, so removing
+ * one name never unloads code another name still points into.
+ */
+static int loadBuiltinFromModule(const char* modulePath, const char* name)
+{
+    BuiltinEntry** slot = findBuiltinSlot(name);
+    if (*slot != NULL && !isLoadedBuiltin(*slot))
+    {
+        fprintf(stderr, "enable: %s: cannot replace a core builtin\n", name);
+        return EXIT_FAILURE;
+    }
+
+    char symbol[MAX_BUILTIN_SYMBOL_LENGTH];
+    _snprintf_s(symbol, sizeof(symbol), _TRUNCATE, "%s%s",
+        XSH_BUILTIN_SYMBOL_PREFIX, name);
+
+    HMODULE module = LoadLibraryA(modulePath);
+    if (module == NULL)
+    {
+        fprintf(stderr, "enable: cannot load %s (error %lu)\n",
+            modulePath, GetLastError());
+        return EXIT_FAILURE;
+    }
+
+    XshBuiltinFunction function = (XshBuiltinFunction)(void (*)(void))
+        GetProcAddress(module, symbol);
+    if (function == NULL)
+    {
+        fprintf(stderr, "enable: %s: %s not exported\n", modulePath, symbol);
+        FreeLibrary(module);
+        return EXIT_FAILURE;
+    }
+
+    BuiltinEntry* builtin = (BuiltinEntry*)calloc(1, sizeof(BuiltinEntry));
+    char* ownedName = _strdup(name);
+    char* ownedPath = _strdup(modulePath);
+    if (builtin == NULL || ownedName == NULL || ownedPath == NULL)
+    {
+        fprintf(stderr, "enable: out of memory\n");
+        free(builtin);
+        free(ownedName);
+        free(ownedPath);
+        FreeLibrary(module);
+        return EXIT_FAILURE;
+    }
+    builtin->name = ownedName;
+    builtin->loadedFunction = function;
+    builtin->module = module;
+    builtin->modulePath = ownedPath;
+
+    if (*slot != NULL)
+    {
+        builtin->next = (*slot)->next;
+        releaseLoadedBuiltin(*slot);
+    }
+    *slot = builtin;
+    return EXIT_SUCCESS;
+}
+
+static int removeLoadedBuiltin(const char* name)
+{
+    BuiltinEntry** slot = findBuiltinSlot(name);
+    if (*slot == NULL || !isLoadedBuiltin(*slot))
+    {
+        fprintf(stderr, "enable: %s: not a loaded builtin\n", name);
+        return EXIT_FAILURE;
+    }
+    BuiltinEntry* builtin = *slot;
+    *slot = builtin->next;
+    releaseLoadedBuiltin(builtin);
+    return EXIT_SUCCESS;
+}
+
+static void listBuiltins(void)
+{
+    for (size_t i = 0; i < CORE_BUILTIN_COUNT; i++)
+    {
+        printf("enable %s\n", coreBuiltins[i].name);
+    }
+    for (int bucketI = 0; bucketI < BUILTIN_TABLE_SIZE; bucketI++)
+    {
+        for (BuiltinEntry* builtin = builtinTable[bucketI]; builtin != NULL;
+            builtin = builtin->next)
+        {
+            if (isLoadedBuiltin(builtin))
+            {
+                printf("enable -f %s %s\n", builtin->modulePath, builtin->name);
+            }
+        }
+    }
+}
+
+static int runEnableBuiltin(char** args)
+{
+    if (args[1] == NULL)
+    {
+        listBuiltins();
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_SUCCESS;
+    if (strcmp(args[1], "-f") == 0 && args[2] != NULL && args[3] != NULL)
+    {
+        for (int i = 3; args[i] != NULL; i++)
+        {
+            if (loadBuiltinFromModule(args[2], args[i]) != EXIT_SUCCESS)
+            {
+                status = EXIT_FAILURE;
+            }
+        }
+        return status;
+    }
+    if (strcmp(args[1], "-d") == 0 && args[2] != NULL)
+    {
+        for (int i = 2; args[i] != NULL; i++)
+        {
+            if (removeLoadedBuiltin(args[i]) != EXIT_SUCCESS)
+            {
+                status = EXIT_FAILURE;
+            }
+        }
+        return status;
+    }
+
+    fprintf(stderr, "enable: usage: enable [-f MODULE.dll NAME... | -d NAME...]\n");
+    return EXIT_FAILURE;
+}
+
+void cleanupBuiltinRegistry(void)
+{
+    for (int bucketI = 0; bucketI < BUILTIN_TABLE_SIZE; bucketI++)
+    {
+        BuiltinEntry* builtin = builtinTable[bucketI];
+        while (builtin != NULL)
+        {
+            BuiltinEntry* next = builtin->next;
+            if (isLoadedBuiltin(builtin))
+            {
+                releaseLoadedBuiltin(builtin);
+            }
+            builtin = next;
+        }
+        builtinTable[bucketI] = NULL;
+    }
+    coreBuiltinsRegistered = 0;
+}
+
+/*
+ * Copies every loaded builtin, each holding its own reference on its
+ * module, so whatever "enable -f" and "enable -d" do afterwards the
+ * snapshot's code stays mapped until it is restored.
+ */
+BuiltinRegistrySnapshot* saveBuiltinRegistry(void)
+{
+    BuiltinRegistrySnapshot* snapshot =
+        (BuiltinRegistrySnapshot*)calloc(1, sizeof(BuiltinRegistrySnapshot));
+    if (snapshot == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed in saveBuiltinRegistry.\n");
+        return NULL;
+    }
+
+    for (int bucketI = 0; bucketI < BUILTIN_TABLE_SIZE; bucketI++)
+    {
+        for (BuiltinEntry* builtin = builtinTable[bucketI]; builtin != NULL;
+            builtin = builtin->next)
+        {
+            if (!isLoadedBuiltin(builtin))
+            {
+                continue;
+            }
+
+            BuiltinEntry* copy = (BuiltinEntry*)calloc(1, sizeof(BuiltinEntry));
+            char* copiedName = _strdup(builtin->name);
+            char* copiedPath = _strdup(builtin->modulePath);
+            /* The module is already mapped, so this only adds a reference. */
+            HMODULE module = LoadLibraryA(builtin->modulePath);
+            if (copy == NULL || copiedName == NULL || copiedPath == NULL ||
+                module == NULL)
+            {
+                fprintf(stderr, "Failed to save builtin %s\n", builtin->name);
+                free(copy);
+                free(copiedName);
+                free(copiedPath);
+                if (module != NULL)
+                {
+                    FreeLibrary(module);
+                }
+                while (snapshot->loaded != NULL)
+                {
+                    BuiltinEntry* next = snapshot->loaded->next;
+                    releaseLoadedBuiltin(snapshot->loaded);
+                    snapshot->loaded = next;
+                }
+                free(snapshot);
+                return NULL;
+            }
+            copy->name = copiedName;
+            copy->loadedFunction = builtin->loadedFunction;
+            copy->module = module;
+            copy->modulePath = copiedPath;
+            copy->next = snapshot->loaded;
+            snapshot->loaded = copy;
+        }
+    }
+    return snapshot;
+}
+
+/* Drops every loaded builtin, reinstalls the snapshot's and frees the snapshot. */
+void restoreBuiltinRegistry(BuiltinRegistrySnapshot* snapshot)
+{
+    cleanupBuiltinRegistry();
+    ensureCoreBuiltinsRegistered();
+
+    BuiltinEntry* builtin = snapshot->loaded;
+    while (builtin != NULL)
+    {
+        BuiltinEntry* next = builtin->next;
+        builtin->next = NULL;
+        *findBuiltinSlot(builtin->name) = builtin;
+        builtin = next;
+    }
+    free(snapshot);
+}
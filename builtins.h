@@ -0,0 +1,21 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include <windows.h>
+
+typedef struct BuiltinEntry BuiltinEntry;
+
+const BuiltinEntry* findBuiltin(const char* name);
+int isLoadedBuiltin(const BuiltinEntry* builtin);
+int builtinTakesStreams(const BuiltinEntry* builtin);
+int runCoreBuiltin(const BuiltinEntry* builtin, char** args);
+int runStreamBuiltin(const BuiltinEntry* builtin, char** args,
+    HANDLE hIn, HANDLE hOut);
+void cleanupBuiltinRegistry(void);
+
+typedef struct BuiltinRegistrySnapshot BuiltinRegistrySnapshot;
+
+BuiltinRegistrySnapshot* saveBuiltinRegistry(void);
+void restoreBuiltinRegistry(BuiltinRegistrySnapshot* snapshot);
+
+#endif
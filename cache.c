@@ -0,0 +1,476 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include <bcrypt.h>
+
+#include "cache.h"
+#include "environment.h"
+#include "resource.h"
+#include "allocation.h"
+
+#ifndef CACHE_DIR_VARIABLE
+#define CACHE_DIR_VARIABLE "XSH_CACHE_DIR"
+#endif
+
+#ifndef CACHE_MAX_VARIABLE
+#define CACHE_MAX_VARIABLE "XSH_CACHE_MAX"
+#endif
+
+#ifndef CACHE_VARS_VARIABLE
+#define CACHE_VARS_VARIABLE "XSH_CACHE_VARS"
+#endif
+
+#ifndef CACHE_HASH_VARIABLE
+#define CACHE_HASH_VARIABLE "XSH_CACHE_HASH"
+#endif
+
+#ifndef DEFAULT_CACHE_MAX_BYTES
+#define DEFAULT_CACHE_MAX_BYTES (256ULL * 1024 * 1024)
+#endif
+
+#ifndef CACHE_COPY_CHUNK
+#define CACHE_COPY_CHUNK (64 * 1024)
+#endif
+
+#define CACHE_ENTRY_SUFFIX ".xshc"
+#define CACHE_ENTRY_MAGIC 0x31435358u
+#define SHA256_DIGEST_LENGTH 32
+
+/*
+ * An entry is this header followed by the command's stdout. Entries are
+ * written under a temporary name and renamed into place, so a reader never
+ * sees a half-written one, and the last-write time is bumped on every hit
+ * so eviction can drop the least recently used first.
+ */
+typedef struct CacheEntryHeader
+{
+    DWORD magic;
+    DWORD exitCode;
+} CacheEntryHeader;
+
+typedef struct CacheFileInfo
+{
+    FILETIME lastWrite;
+    unsigned long long size;
+    char name[MAX_PATH];
+} CacheFileInfo;
+
+static int hashBytes(BCRYPT_HASH_HANDLE hash, const void* data, size_t length)
+{
+    return BCRYPT_SUCCESS(BCryptHashData(hash, (PUCHAR)data, (ULONG)length, 0));
+}
+
+/* Strings go in with their terminator so "ab" "c" and "a" "bc" differ. */
+static int hashString(BCRYPT_HASH_HANDLE hash, const char* text)
+{
+    return hashBytes(hash, text, strlen(text) + 1);
+}
+
+/*
+ * Folds in whether path names a regular file and, if so, either its
+ * contents or its size and last-write time. Anything else is keyed by the
+ * argument text alone, which the caller already hashed.
+ */
+static int hashFileState(BCRYPT_HASH_HANDLE hash, const char* path, int byContent)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attributes) ||
+        (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        return hashBytes(hash, "-", 1);
+    }
+
+    if (!byContent)
+    {
+        return hashBytes(hash, "S", 1) &&
+            hashBytes(hash, &attributes.ftLastWriteTime, sizeof(attributes.ftLastWriteTime)) &&
+            hashBytes(hash, &attributes.nFileSizeHigh, sizeof(attributes.nFileSizeHigh)) &&
+            hashBytes(hash, &attributes.nFileSizeLow, sizeof(attributes.nFileSizeLow));
+    }
+
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    char* chunk = (char*)malloc(CACHE_COPY_CHUNK);
+    if (file == INVALID_HANDLE_VALUE || chunk == NULL)
+    {
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+        }
+        free(chunk);
+        return 0;
+    }
+
+    int ok = hashBytes(hash, "C", 1);
+    DWORD bytesRead = 0;
+    while (ok && ReadFile(file, chunk, CACHE_COPY_CHUNK, &bytesRead, NULL) && bytesRead > 0)
+    {
+        ok = hashBytes(hash, chunk, bytesRead);
+    }
+    CloseHandle(file);
+    free(chunk);
+    return ok && hashBytes(hash, "", 1);
+}
+
+/*
+ * Each name in XSH_CACHE_VARS contributes the value a child would see: the
+ * shell's own if the variable is exported, otherwise the inherited one.
+ */
+static int hashChosenVariables(BCRYPT_HASH_HANDLE hash)
+{
+    const char* chosen = getEnvironmentVariableValue(CACHE_VARS_VARIABLE);
+    if (chosen == NULL || chosen[0] == '\0')
+    {
+        return 1;
+    }
+
+    char* names = _strdup(chosen);
+    if (names == NULL)
+    {
+        return 0;
+    }
+
+    int ok = 1;
+    char* context = NULL;
+    for (char* name = strtok_s(names, " ,;", &context); ok && name != NULL;
+        name = strtok_s(NULL, " ,;", &context))
+    {
+        char inherited[1024];
+        const char* value = NULL;
+        if (isEnvironmentVariableExported(name))
+        {
+            value = getEnvironmentVariableValue(name);
+        }
+        else
+        {
+            DWORD length = GetEnvironmentVariableA(name, inherited, sizeof(inherited));
+            if (length > 0 && length < sizeof(inherited))
+            {
+                value = inherited;
+            }
+        }
+        ok = hashString(hash, name) &&
+            (value ? hashBytes(hash, "=", 1) && hashString(hash, value) :
+                hashBytes(hash, "!", 1));
+    }
+    free(names);
+    return ok;
+}
+
+static void formatDigest(const unsigned char* digest, char* keyHex)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+    {
+        keyHex[i * 2] = hexDigits[digest[i] >> 4];
+        keyHex[i * 2 + 1] = hexDigits[digest[i] & 0x0f];
+    }
+    keyHex[SHA256_DIGEST_LENGTH * 2] = '\0';
+}
+
+/*
+ * The key covers what the command is (its resolved path, size and
+ * timestamp, or the in-process utility name when cmdPath is NULL), how it
+ * is called (argv and the working directory), the chosen variables, and
+ * every '<' file or argument that names an existing file. Files are keyed
+ * by size and last-write time unless XSH_CACHE_HASH is "content".
+ */
+int computeOutputCacheKey(const char* cmdPath, char** args,
+    const char* inputFile, char* keyHex)
+{
+    const char* hashMode = getEnvironmentVariableValue(CACHE_HASH_VARIABLE);
+    int byContent = hashMode != NULL && _stricmp(hashMode, "content") == 0;
+
+    BCRYPT_ALG_HANDLE algorithm = NULL;
+    BCRYPT_HASH_HANDLE hash = NULL;
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&algorithm,
+        BCRYPT_SHA256_ALGORITHM, NULL, 0)))
+    {
+        return 0;
+    }
+    if (!BCRYPT_SUCCESS(BCryptCreateHash(algorithm, &hash, NULL, 0, NULL, 0, 0)))
+    {
+        BCryptCloseAlgorithmProvider(algorithm, 0);
+        return 0;
+    }
+
+    char cwdBuf[MAX_PATH];
+    DWORD cwdLength = GetCurrentDirectoryA(sizeof(cwdBuf), cwdBuf);
+    int ok = hashString(hash, "xsh-cache-1") &&
+        cwdLength > 0 && cwdLength < sizeof(cwdBuf) && hashString(hash, cwdBuf);
+
+    if (ok && cmdPath != NULL)
+    {
+        ok = hashString(hash, cmdPath) && hashFileState(hash, cmdPath, 0);
+    }
+    else if (ok)
+    {
+        ok = hashString(hash, "utility") && hashString(hash, args[0]);
+    }
+
+    for (int i = 1; ok && args[i] != NULL; i++)
+    {
+        ok = hashString(hash, args[i]) && hashFileState(hash, args[i], byContent);
+    }
+    ok = ok && hashBytes(hash, "<", 1);
+    if (ok && inputFile != NULL)
+    {
+        ok = hashString(hash, inputFile) && hashFileState(hash, inputFile, byContent);
+    }
+    ok = ok && hashChosenVariables(hash);
+
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    ok = ok && BCRYPT_SUCCESS(BCryptFinishHash(hash, digest, sizeof(digest), 0));
+    BCryptDestroyHash(hash);
+    BCryptCloseAlgorithmProvider(algorithm, 0);
+
+    if (ok)
+    {
+        formatDigest(digest, keyHex);
+    }
+    return ok;
+}
+
+/* XSH_CACHE_DIR, or %LOCALAPPDATA%\xsh\cache, created on first use. */
+static int resolveCacheDirectory(char* directory, size_t directorySize)
+{
+    const char* configured = getEnvironmentVariableValue(CACHE_DIR_VARIABLE);
+    if (configured != NULL && configured[0] != '\0')
+    {
+        strcpy_s(directory, directorySize, configured);
+    }
+    else
+    {
+        char localAppData[MAX_PATH];
+        DWORD length = GetEnvironmentVariableA("LOCALAPPDATA", localAppData,
+            sizeof(localAppData));
+        if (length == 0 || length >= sizeof(localAppData))
+        {
+            return 0;
+        }
+        _snprintf_s(directory, directorySize, _TRUNCATE, "%s\\xsh", localAppData);
+        CreateDirectoryA(directory, NULL);
+        _snprintf_s(directory, directorySize, _TRUNCATE, "%s\\xsh\\cache", localAppData);
+    }
+
+    if (!CreateDirectoryA(directory, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        return 0;
+    }
+    return 1;
+}
+
+static int copyFileToHandle(HANDLE source, HANDLE destination)
+{
+    char* chunk = (char*)malloc(CACHE_COPY_CHUNK);
+    if (chunk == NULL)
+    {
+        return 0;
+    }
+
+    int ok = 1;
+    DWORD bytesRead = 0;
+    while (ok && ReadFile(source, chunk, CACHE_COPY_CHUNK, &bytesRead, NULL) && bytesRead > 0)
+    {
+        DWORD offset = 0;
+        while (offset < bytesRead)
+        {
+            DWORD written = 0;
+            if (!WriteFile(destination, chunk + offset, bytesRead - offset, &written, NULL))
+            {
+                ok = 0;
+                break;
+            }
+            offset += written;
+        }
+    }
+    free(chunk);
+    return ok;
+}
+
+int replayCachedOutput(const char* keyHex, HANDLE hOut, DWORD* exitCode)
+{
+    char directory[MAX_PATH];
+    char entryPath[MAX_PATH];
+    if (!resolveCacheDirectory(directory, sizeof(directory)))
+    {
+        return 0;
+    }
+    _snprintf_s(entryPath, sizeof(entryPath), _TRUNCATE, "%s\\%s%s",
+        directory, keyHex, CACHE_ENTRY_SUFFIX);
+
+    HANDLE entry = CreateFileA(entryPath, GENERIC_READ | FILE_WRITE_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (entry == INVALID_HANDLE_VALUE)
+    {
+        return 0;
+    }
+
+    CacheEntryHeader header;
+    DWORD bytesRead = 0;
+    if (!ReadFile(entry, &header, sizeof(header), &bytesRead, NULL) ||
+        bytesRead != sizeof(header) || header.magic != CACHE_ENTRY_MAGIC)
+    {
+        CloseHandle(entry);
+        return 0;
+    }
+
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(entry, NULL, NULL, &now);
+
+    copyFileToHandle(entry, hOut);
+    CloseHandle(entry);
+    *exitCode = header.exitCode;
+    return 1;
+}
+
+int beginOutputCapture(const char* keyHex, OutputCapture* capture)
+{
+    if (!resolveCacheDirectory(capture->directory, sizeof(capture->directory)))
+    {
+        return 0;
+    }
+    _snprintf_s(capture->entryPath, sizeof(capture->entryPath), _TRUNCATE,
+        "%s\\%s%s", capture->directory, keyHex, CACHE_ENTRY_SUFFIX);
+    _snprintf_s(capture->tempPath, sizeof(capture->tempPath), _TRUNCATE,
+        "%s\\%s.%lu.tmp", capture->directory, keyHex, GetCurrentProcessId());
+
+    capture->file = CreateFileA(capture->tempPath, GENERIC_READ | GENERIC_WRITE,
+        0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+    if (capture->file == INVALID_HANDLE_VALUE)
+    {
+        return 0;
+    }
+
+    /* Written now so the command's output lands after it; filled in at the end. */
+    CacheEntryHeader header = { 0, 0 };
+    DWORD written = 0;
+    if (!WriteFile(capture->file, &header, sizeof(header), &written, NULL) ||
+        written != sizeof(header))
+    {
+        CloseHandle(capture->file);
+        DeleteFileA(capture->tempPath);
+        return 0;
+    }
+    return 1;
+}
+
+static int compareCacheFilesByAge(const void* left, const void* right)
+{
+    return CompareFileTime(&((const CacheFileInfo*)left)->lastWrite,
+        &((const CacheFileInfo*)right)->lastWrite);
+}
+
+/* Drops least recently used entries until the store fits XSH_CACHE_MAX. */
+static void evictCacheEntries(const char* directory)
+{
+    unsigned long long limit = DEFAULT_CACHE_MAX_BYTES;
+    const char* limitText = getEnvironmentVariableValue(CACHE_MAX_VARIABLE);
+    if (limitText != NULL && !parseSizeWithSuffix(limitText, &limit))
+    {
+        fprintf(stderr, "%s: invalid size: %s\n", CACHE_MAX_VARIABLE, limitText);
+        return;
+    }
+
+    char pattern[MAX_PATH];
+    _snprintf_s(pattern, sizeof(pattern), _TRUNCATE, "%s\\*%s",
+        directory, CACHE_ENTRY_SUFFIX);
+
+    WIN32_FIND_DATAA findData;
+    HANDLE search = FindFirstFileA(pattern, &findData);
+    if (search == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    CacheFileInfo* files = NULL;
+    size_t fileCount = 0;
+    size_t fileCapacity = 0;
+    unsigned long long totalSize = 0;
+    do
+    {
+        if (fileCount == fileCapacity)
+        {
+            size_t newCapacity = fileCapacity ? fileCapacity * 2 : 64;
+            CacheFileInfo* grown = (CacheFileInfo*)realloc(files,
+                newCapacity * sizeof(CacheFileInfo));
+            if (grown == NULL)
+            {
+                break;
+            }
+            files = grown;
+            fileCapacity = newCapacity;
+        }
+        CacheFileInfo* info = &files[fileCount++];
+        info->lastWrite = findData.ftLastWriteTime;
+        info->size = ((unsigned long long)findData.nFileSizeHigh << 32) |
+            findData.nFileSizeLow;
+        strcpy_s(info->name, sizeof(info->name), findData.cFileName);
+        totalSize += info->size;
+    } while (FindNextFileA(search, &findData));
+    FindClose(search);
+
+    if (totalSize > limit)
+    {
+        qsort(files, fileCount, sizeof(CacheFileInfo), compareCacheFilesByAge);
+        for (size_t i = 0; i < fileCount && totalSize > limit; i++)
+        {
+            char path[MAX_PATH];
+            _snprintf_s(path, sizeof(path), _TRUNCATE, "%s\\%s",
+                directory, files[i].name);
+            if (DeleteFileA(path))
+            {
+                totalSize -= files[i].size;
+            }
+        }
+    }
+    free(files);
+}
+
+/*
+ * Sends the captured output on to hOut, then stores it unless the header
+ * cannot be completed; either way the capture handle is closed.
+ */
+int finishOutputCapture(OutputCapture* capture, DWORD exitCode, HANDLE hOut)
+{
+    CacheEntryHeader header = { CACHE_ENTRY_MAGIC, exitCode };
+    LARGE_INTEGER offset;
+    offset.QuadPart = 0;
+    DWORD written = 0;
+    int stored = SetFilePointerEx(capture->file, offset, NULL, FILE_BEGIN) &&
+        WriteFile(capture->file, &header, sizeof(header), &written, NULL) &&
+        written == sizeof(header);
+
+    offset.QuadPart = sizeof(header);
+    if (SetFilePointerEx(capture->file, offset, NULL, FILE_BEGIN))
+    {
+        copyFileToHandle(capture->file, hOut);
+    }
+    CloseHandle(capture->file);
+    capture->file = INVALID_HANDLE_VALUE;
+
+    stored = stored && MoveFileExA(capture->tempPath, capture->entryPath,
+        MOVEFILE_REPLACE_EXISTING);
+    if (!stored)
+    {
+        DeleteFileA(capture->tempPath);
+        return 0;
+    }
+    evictCacheEntries(capture->directory);
+    return 1;
+}
+
+/* Drops a capture whose output must not be stored, such as an interrupted run. */
+void abandonOutputCapture(OutputCapture* capture)
+{
+    CloseHandle(capture->file);
+    capture->file = INVALID_HANDLE_VALUE;
+    DeleteFileA(capture->tempPath);
+}
@@ -0,0 +1,24 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <windows.h>
+
+/* SHA-256 as lowercase hex plus the terminator. */
+#define CACHE_KEY_HEX_SIZE 65
+
+typedef struct OutputCapture
+{
+    HANDLE file;
+    char directory[MAX_PATH];
+    char tempPath[MAX_PATH];
+    char entryPath[MAX_PATH];
+} OutputCapture;
+
+int computeOutputCacheKey(const char* cmdPath, char** args,
+    const char* inputFile, char* keyHex);
+int replayCachedOutput(const char* keyHex, HANDLE hOut, DWORD* exitCode);
+int beginOutputCapture(const char* keyHex, OutputCapture* capture);
+int finishOutputCapture(OutputCapture* capture, DWORD exitCode, HANDLE hOut);
+void abandonOutputCapture(OutputCapture* capture);
+
+#endif
@@ -1,3 +1,7 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,10 +9,21 @@
 #include <io.h>
 #include <fcntl.h>
 #include <ctype.h>
-#include <direct.h>
 
 #include "command.h"
 #include "environment.h"
+#include "resource.h"
+#include "jobs.h"
+#include "joblog.h"
+#include "meter.h"
+#include "utilities.h"
+#include "substitution.h"
+#include "fanout.h"
+#include "builtins.h"
+#include "cache.h"
+#include "arithmetic.h"
+#include "condition.h"
+#include "allocation.h"
 
 #ifndef MAX_ARGUMENTS
 #define MAX_ARGUMENTS 128
@@ -18,6 +33,10 @@
 #define MAX_PIPELINE_COMMANDS 20
 #endif
 
+#ifndef RESOLVED_COMMAND_CACHE_SIZE
+#define RESOLVED_COMMAND_CACHE_SIZE 256
+#endif
+
 #ifndef INVALID_FILE_ATTRIBUTES_VALUE
 #define INVALID_FILE_ATTRIBUTES_VALUE ((DWORD)-1)
 #endif
@@ -42,11 +61,19 @@
 #define CREATE_ALWAYS_FILE CREATE_ALWAYS
 #endif
 
+typedef enum PipeLinkKind
+{
+    PIPE_LINK_PLAIN,
+    PIPE_LINK_METERED,
+    PIPE_LINK_FANOUT
+} PipeLinkKind;
+
 typedef struct CommandExecutionOptions
 {
     char* inputFile;
     char* outputFile;
     int runInBackground;
+    StagePlacement placement;
 } CommandExecutionOptions;
 
 typedef struct ProcessInfo
@@ -84,7 +111,7 @@ char** retrieveSystemPathList(void)
     char** paths = (char**)malloc(sizeof(char*) * 128);
     if (!paths)
     {
-        free(fetchedPath);
+        uncountedFree(fetchedPath);
         return NULL;
     }
 
@@ -102,7 +129,7 @@ char** retrieveSystemPathList(void)
                     free(paths[i]);
                 }
                 free(paths);
-                free(fetchedPath);
+                uncountedFree(fetchedPath);
                 return NULL;
             }
             countPaths++;
@@ -111,7 +138,7 @@ char** retrieveSystemPathList(void)
         paths[countPaths] = NULL;
     }
 
-    free(fetchedPath);
+    uncountedFree(fetchedPath);
     return paths;
 }
 
@@ -127,6 +154,287 @@ void freePathList(char** paths)
     free(paths);
 }
 
+/*
+ * Collects the distinct, valid stdio handles a child should inherit and
+ * makes sure each is inheritable, as PROC_THREAD_ATTRIBUTE_HANDLE_LIST
+ * requires.
+ */
+static int collectInheritedHandles(const STARTUPINFOA* si, HANDLE* handles)
+{
+    HANDLE candidates[3] = { si->hStdInput, si->hStdOutput, si->hStdError };
+    int count = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (candidates[i] == NULL || candidates[i] == INVALID_HANDLE_VALUE)
+        {
+            continue;
+        }
+
+        int duplicate = 0;
+        for (int j = 0; j < count; j++)
+        {
+            if (handles[j] == candidates[i])
+            {
+                duplicate = 1;
+            }
+        }
+        if (!duplicate)
+        {
+            SetHandleInformation(candidates[i], HANDLE_FLAG_INHERIT,
+                HANDLE_FLAG_INHERIT);
+            handles[count++] = candidates[i];
+        }
+    }
+    return count;
+}
+
+/*
+ * Children inherit only their three stdio handles rather than every
+ * inheritable handle the shell holds. Otherwise each spawn gets slower as
+ * the shell accumulates pipes, meters and background jobs, and a stage
+ * could keep another link's write end open so its reader never sees EOF.
+ *
+ * Children are created suspended so they can be placed in their job object
+ * and given their affinity and priority before running a single
+ * instruction; otherwise a fast child could escape its limits by finishing
+ * (or forking) before the assignment.
+ */
+static int spawnCommandProcess(const char* cmdPath, char* cmdline,
+    HANDLE hIn, HANDLE hOut, HANDLE hErr, HANDLE job, const StagePlacement* placement,
+    const char* environmentBlock, int runInBackground, PROCESS_INFORMATION* pi)
+{
+    STARTUPINFOA si;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    si.hStdInput = hIn;
+    si.hStdOutput = hOut;
+    si.hStdError = hErr;
+    si.dwFlags |= STARTF_USESTDHANDLES;
+
+    ZeroMemory(pi, sizeof(*pi));
+
+    /* Background jobs get their own process group so Ctrl-C skips them. */
+    DWORD creationFlags = CREATE_SUSPENDED;
+    if (runInBackground)
+    {
+        creationFlags |= CREATE_NEW_PROCESS_GROUP;
+    }
+
+    HANDLE inheritedHandles[3];
+    int inheritedCount = collectInheritedHandles(&si, inheritedHandles);
+
+    SIZE_T attributeSize = 0;
+    InitializeProcThreadAttributeList(NULL, 1, 0, &attributeSize);
+    LPPROC_THREAD_ATTRIBUTE_LIST attributes =
+        (LPPROC_THREAD_ATTRIBUTE_LIST)malloc(attributeSize);
+    if (!attributes)
+    {
+        return 0;
+    }
+
+    STARTUPINFOEXA siEx;
+    ZeroMemory(&siEx, sizeof(siEx));
+    siEx.StartupInfo = si;
+
+    if (inheritedCount > 0 &&
+        InitializeProcThreadAttributeList(attributes, 1, 0, &attributeSize))
+    {
+        if (UpdateProcThreadAttribute(attributes, 0,
+            PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inheritedHandles,
+            inheritedCount * sizeof(HANDLE), NULL, NULL))
+        {
+            siEx.StartupInfo.cb = sizeof(siEx);
+            siEx.lpAttributeList = attributes;
+            creationFlags |= EXTENDED_STARTUPINFO_PRESENT;
+        }
+        else
+        {
+            DeleteProcThreadAttributeList(attributes);
+        }
+    }
+
+    BOOL created = CreateProcessA(cmdPath, cmdline, NULL, NULL,
+        inheritedCount > 0, creationFlags, (LPVOID)environmentBlock, NULL,
+        &siEx.StartupInfo, pi);
+
+    if (siEx.lpAttributeList != NULL)
+    {
+        DeleteProcThreadAttributeList(attributes);
+    }
+    free(attributes);
+
+    if (!created)
+    {
+        return 0;
+    }
+
+    if (!placeProcessInJob(job, pi->hProcess) ||
+        !applyStagePlacement(pi->hProcess, placement))
+    {
+        TerminateProcess(pi->hProcess, EXIT_FAILURE);
+        CloseHandle(pi->hThread);
+        CloseHandle(pi->hProcess);
+        return 0;
+    }
+
+    ResumeThread(pi->hThread);
+    return 1;
+}
+
+/*
+ * Runs commandText in a child copy of this shell ("xsh -c"), so a process
+ * substitution can hold a full pipeline and still be started with one spawn.
+ * Returns -1 when the quoted command line would not fit.
+ */
+int spawnShellSubcommand(const char* commandText, HANDLE hIn, HANDLE hOut,
+    const char* environmentBlock, HANDLE* process)
+{
+    char shellPath[MAX_PATH];
+    DWORD pathLength = GetModuleFileNameA(NULL, shellPath, sizeof(shellPath));
+    if (pathLength == 0 || pathLength == sizeof(shellPath))
+    {
+        return 0;
+    }
+
+    char cmdline[MAX_SUBCOMMAND_LINE_LENGTH];
+    int length = snprintf(cmdline, sizeof(cmdline), "\"%s\" -c \"", shellPath);
+    if (length < 0 || length >= (int)sizeof(cmdline))
+    {
+        return -1;
+    }
+
+    /*
+     * Quoted the way the child's argv parser undoes it: an embedded quote
+     * becomes \", and backslashes are doubled only where they precede a
+     * quote, including the closing one.
+     */
+    const char* text = commandText;
+    while (1)
+    {
+        int backslashes = 0;
+        while (*text == '\\')
+        {
+            backslashes++;
+            text++;
+        }
+
+        int copies = (*text == '"' || *text == '\0') ? backslashes * 2 : backslashes;
+        int needed = copies + (*text == '"' ? 2 : 1);
+        if (length + needed + 1 > (int)sizeof(cmdline))
+        {
+            return -1;
+        }
+        memset(cmdline + length, '\\', copies);
+        length += copies;
+
+        if (*text == '\0')
+        {
+            break;
+        }
+        if (*text == '"')
+        {
+            cmdline[length++] = '\\';
+        }
+        cmdline[length++] = *text++;
+    }
+    cmdline[length++] = '"';
+    cmdline[length] = '\0';
+
+    PROCESS_INFORMATION pi;
+    if (!spawnCommandProcess(shellPath, cmdline, hIn, hOut,
+        GetStdHandle(STD_ERROR_HANDLE), NULL, NULL, environmentBlock, 0, &pi))
+    {
+        return 0;
+    }
+    CloseHandle(pi.hThread);
+    *process = pi.hProcess;
+    return 1;
+}
+
+/*
+ * Remembers where each bare command name was found so repeated lookups cost
+ * one attribute probe instead of a walk over every PATH entry. Entries whose
+ * file has disappeared are dropped and looked up again, and the whole cache
+ * is flushed when PATH is set, exported or unset. Otherwise PATH is not
+ * walked again: a program that appears earlier in PATH than the cached one
+ * is not noticed until the cache is flushed, as with bash's "hash -r".
+ */
+typedef struct ResolvedCommandEntry
+{
+    char* commandName;
+    char* resolvedPath;
+} ResolvedCommandEntry;
+
+static ResolvedCommandEntry resolvedCommandCache[RESOLVED_COMMAND_CACHE_SIZE];
+static unsigned long resolvedCachePathGeneration = 0;
+
+static unsigned int hashCommandName(const char* cmdName)
+{
+    unsigned int hash = 2166136261u;
+    while (*cmdName)
+    {
+        hash ^= (unsigned char)tolower((unsigned char)*cmdName++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static char* lookupResolvedCommand(const char* cmdName)
+{
+    if (resolvedCachePathGeneration != getPathGeneration())
+    {
+        clearResolvedCommandCache();
+        resolvedCachePathGeneration = getPathGeneration();
+        return NULL;
+    }
+
+    ResolvedCommandEntry* entry =
+        &resolvedCommandCache[hashCommandName(cmdName) % RESOLVED_COMMAND_CACHE_SIZE];
+    if (entry->commandName == NULL || _stricmp(entry->commandName, cmdName) != 0)
+    {
+        return NULL;
+    }
+    if (!verifyFileExecutable(entry->resolvedPath))
+    {
+        free(entry->commandName);
+        free(entry->resolvedPath);
+        entry->commandName = NULL;
+        entry->resolvedPath = NULL;
+        return NULL;
+    }
+    return _strdup(entry->resolvedPath);
+}
+
+static void rememberResolvedCommand(const char* cmdName, const char* resolvedPath)
+{
+    ResolvedCommandEntry* entry =
+        &resolvedCommandCache[hashCommandName(cmdName) % RESOLVED_COMMAND_CACHE_SIZE];
+    char* nameCopy = _strdup(cmdName);
+    char* pathCopy = _strdup(resolvedPath);
+    if (!nameCopy || !pathCopy)
+    {
+        free(nameCopy);
+        free(pathCopy);
+        return;
+    }
+    free(entry->commandName);
+    free(entry->resolvedPath);
+    entry->commandName = nameCopy;
+    entry->resolvedPath = pathCopy;
+}
+
+void clearResolvedCommandCache(void)
+{
+    for (int i = 0; i < RESOLVED_COMMAND_CACHE_SIZE; i++)
+    {
+        free(resolvedCommandCache[i].commandName);
+        free(resolvedCommandCache[i].resolvedPath);
+        resolvedCommandCache[i].commandName = NULL;
+        resolvedCommandCache[i].resolvedPath = NULL;
+    }
+}
+
 static char* locateCommandPath(const char* cmdName, char** pathList)
 {
     if (!pathList || !cmdName) return NULL;
@@ -143,6 +451,12 @@ static char* locateCommandPath(const char* cmdName, char** pathList)
         }
     }
 
+    char* cachedPath = lookupResolvedCommand(cmdName);
+    if (cachedPath != NULL)
+    {
+        return cachedPath;
+    }
+
     int hasExt = (strrchr(cmdName, '.') != NULL) ? 1 : 0;
 
     char candidatePath[1024];
@@ -153,6 +467,7 @@ static char* locateCommandPath(const char* cmdName, char** pathList)
             "%s\\%s", pathList[i], cmdName);
         if (verifyFileExecutable(candidatePath))
         {
+            rememberResolvedCommand(cmdName, candidatePath);
             return _strdup(candidatePath);
         }
         if (!hasExt)
@@ -161,6 +476,7 @@ static char* locateCommandPath(const char* cmdName, char** pathList)
                 "%s\\%s.exe", pathList[i], cmdName);
             if (verifyFileExecutable(candidatePath))
             {
+                rememberResolvedCommand(cmdName, candidatePath);
                 return _strdup(candidatePath);
             }
         }
@@ -170,9 +486,48 @@ static char* locateCommandPath(const char* cmdName, char** pathList)
     return NULL;
 }
 
-static void performVariableExpansion(char** args)
+/*
+ * Appends the value of the "$(( ))" whose body starts at expressionStart
+ * and points resumePos just past the closing parentheses.
+ */
+static int appendArithmeticExpansion(const char* expressionStart, char* buffer,
+    size_t bufferSize, char** resumePos)
 {
-    if (!args) return;
+    const char* expressionEnd = findArithmeticExpansionEnd(expressionStart);
+    if (expressionEnd == NULL)
+    {
+        fprintf(stderr, "Unterminated arithmetic expansion: $((%s\n", expressionStart);
+        return 0;
+    }
+
+    size_t length = (size_t)(expressionEnd - expressionStart);
+    char* expression = (char*)malloc(length + 1);
+    if (!expression)
+    {
+        fprintf(stderr, "Memory allocation failed in appendArithmeticExpansion\n");
+        return 0;
+    }
+    memcpy(expression, expressionStart, length);
+    expression[length] = '\0';
+
+    long long value = 0;
+    int evaluated = evaluateArithmetic(expression, &value);
+    free(expression);
+    if (!evaluated)
+    {
+        return 0;
+    }
+
+    char number[32];
+    _snprintf_s(number, sizeof(number), _TRUNCATE, "%lld", value);
+    strncat_s(buffer, bufferSize, number, _TRUNCATE);
+    *resumePos = (char*)expressionEnd + 2;
+    return 1;
+}
+
+static int performVariableExpansion(char** args)
+{
+    if (!args) return 1;
 
     int i = 0;
     while (args[i] != NULL)
@@ -190,6 +545,15 @@ static void performVariableExpansion(char** args)
                 strncat_s(rebuildBuf, sizeof(rebuildBuf),
                     parsePos, (dollarPos - parsePos));
                 dollarPos++;
+                if (dollarPos[0] == '(' && dollarPos[1] == '(')
+                {
+                    if (!appendArithmeticExpansion(dollarPos + 2, rebuildBuf,
+                        sizeof(rebuildBuf), &parsePos))
+                    {
+                        return 0;
+                    }
+                    continue;
+                }
                 char varName[256];
                 int varI = 0;
                 while (*dollarPos && (isalnum((unsigned char)*dollarPos) ||
@@ -215,11 +579,12 @@ static void performVariableExpansion(char** args)
             if (!args[i])
             {
                 fprintf(stderr, "Memory allocation failed in performVariableExpansion\n");
-                return; 
+                return 0;
             }
         }
         i++;
     }
+    return 1;
 }
 
 static char** splitLineIntoTokens(const char* line)
@@ -262,15 +627,159 @@ static char** splitLineIntoTokens(const char* line)
     return tokens;
 }
 
-static void freeTokens(char** tokens)
+/*
+ * The tokenizer splits on whitespace, so "<(sort a.txt)" arrives as
+ * "<(sort" and "a.txt)". Rejoin each such group into one token, with
+ * variables expanded, before pipes are split so that a "|" inside the
+ * parentheses stays with the inner command.
+ */
+static int collapseProcessSubstitutions(char** tokens)
+{
+    int readI = 0;
+    int writeI = 0;
+    while (tokens[readI] != NULL)
+    {
+        char* token = tokens[readI];
+        if ((token[0] != '<' && token[0] != '>') || token[1] != '(')
+        {
+            tokens[writeI++] = tokens[readI++];
+            continue;
+        }
+
+        char joined[4096];
+        joined[0] = '\0';
+        int depth = 0;
+        int groupStart = readI;
+        do
+        {
+            if (tokens[readI] == NULL)
+            {
+                fprintf(stderr, "Unterminated process substitution: %s\n", token);
+                break;
+            }
+            for (const char* c = tokens[readI]; *c; c++)
+            {
+                if (*c == '(') depth++;
+                else if (*c == ')') depth--;
+            }
+            if (readI > groupStart)
+            {
+                strncat_s(joined, sizeof(joined), " ", _TRUNCATE);
+            }
+            strncat_s(joined, sizeof(joined), tokens[readI], _TRUNCATE);
+            readI++;
+        } while (depth > 0);
+
+        char* expanded[2] = { depth == 0 ? _strdup(joined) : NULL, NULL };
+        if (!expanded[0])
+        {
+            if (depth == 0)
+            {
+                fprintf(stderr, "Memory allocation failed in collapseProcessSubstitutions\n");
+            }
+            else if (depth < 0)
+            {
+                fprintf(stderr, "Unbalanced parentheses in process substitution: %s\n",
+                    joined);
+            }
+            for (int i = groupStart; tokens[i] != NULL; i++) free(tokens[i]);
+            tokens[writeI] = NULL;
+            return 0;
+        }
+        if (!performVariableExpansion(expanded))
+        {
+            free(expanded[0]);
+            for (int i = groupStart; tokens[i] != NULL; i++) free(tokens[i]);
+            tokens[writeI] = NULL;
+            return 0;
+        }
+        for (int i = groupStart; i < readI; i++) free(tokens[i]);
+        tokens[writeI++] = expanded[0];
+    }
+    tokens[writeI] = NULL;
+    return 1;
+}
+
+/* Tracks how many '(' of an open "$((" are still unmatched after text. */
+static int updateArithmeticDepth(const char* text, int depth)
+{
+    for (const char* c = text; *c; c++)
+    {
+        if (depth == 0)
+        {
+            if (c[0] == '$' && c[1] == '(' && c[2] == '(')
+            {
+                depth = 2;
+                c += 2;
+            }
+        }
+        else if (*c == '(')
+        {
+            depth++;
+        }
+        else if (*c == ')')
+        {
+            depth--;
+        }
+    }
+    return depth;
+}
+
+/*
+ * "$(( i + 1 ))" also arrives split on whitespace. Rejoin it so that a
+ * "|", "<" or "&" inside the expression is not read as shell syntax; an
+ * unclosed expansion is reported when it is evaluated.
+ */
+static int collapseArithmeticExpansions(char** tokens)
+{
+    int readI = 0;
+    int writeI = 0;
+    while (tokens[readI] != NULL)
+    {
+        int depth = updateArithmeticDepth(tokens[readI], 0);
+        if (depth <= 0 || tokens[readI + 1] == NULL)
+        {
+            tokens[writeI++] = tokens[readI++];
+            continue;
+        }
+
+        char joined[4096];
+        strcpy_s(joined, sizeof(joined), tokens[readI]);
+        int groupStart = readI++;
+        while (depth > 0 && tokens[readI] != NULL)
+        {
+            depth = updateArithmeticDepth(tokens[readI], depth);
+            strncat_s(joined, sizeof(joined), " ", _TRUNCATE);
+            strncat_s(joined, sizeof(joined), tokens[readI], _TRUNCATE);
+            readI++;
+        }
+
+        char* merged = _strdup(joined);
+        if (!merged)
+        {
+            fprintf(stderr, "Memory allocation failed in collapseArithmeticExpansions\n");
+            for (int i = groupStart; tokens[i] != NULL; i++) free(tokens[i]);
+            tokens[writeI] = NULL;
+            return 0;
+        }
+        for (int i = groupStart; i < readI; i++) free(tokens[i]);
+        tokens[writeI++] = merged;
+    }
+    tokens[writeI] = NULL;
+    return 1;
+}
+
+/*
+ * Splitting and redirection parsing leave NULL holes in the token list, so
+ * the original count is needed to reach every token that is still owned.
+ */
+static void freeTokens(char** tokens, int tokenCount)
 {
     if (!tokens) return;
 
-    int i = 0;
-    while (tokens[i] != NULL)
+    for (int i = 0; i < tokenCount; i++)
     {
         free(tokens[i]);
-        i++;
     }
     free(tokens);
 }
@@ -347,7 +856,12 @@ static void analyzeRedirectionAndBackground(char** args,
     }
 }
 
-static char*** splitByPipe(char** tokens)
+/*
+ * linkKinds[i] describes the link between cmds[i] and cmds[i + 1]: "|" is a
+ * plain pipe, "|%" routes the bytes through a throughput meter and "|+"
+ * adds cmds[i + 1] as one more consumer of the stage that starts a fan-out.
+ */
+static char*** splitByPipe(char** tokens, PipeLinkKind* linkKinds)
 {
     if (!tokens) return NULL;
 
@@ -360,8 +874,19 @@ static char*** splitByPipe(char** tokens)
     int i = 0;
     while (tokens[i] != NULL)
     {
-        if (strcmp(tokens[i], "|") == 0)
+        if (strcmp(tokens[i], "|") == 0 || strcmp(tokens[i], "|%") == 0 ||
+            strcmp(tokens[i], "|+") == 0)
         {
+            if (cmdCount == MAX_PIPELINE_COMMANDS - 1)
+            {
+                fprintf(stderr, "Pipeline too long (max %d commands)\n",
+                    MAX_PIPELINE_COMMANDS);
+                free(cmds);
+                return NULL;
+            }
+            linkKinds[cmdCount] = tokens[i][1] == '%' ? PIPE_LINK_METERED :
+                tokens[i][1] == '+' ? PIPE_LINK_FANOUT : PIPE_LINK_PLAIN;
+            free(tokens[i]);
             tokens[i] = NULL;
             cmds[cmdCount] = &tokens[startPos];
             cmdCount++;
@@ -375,91 +900,183 @@ static char*** splitByPipe(char** tokens)
     return cmds;
 }
 
-static int runSingleCommand(char** args,
-    CommandExecutionOptions* opts,
-    char** pathList)
+/*
+ * Runs a command whose target is already known: an in-process utility when
+ * one was prepared, otherwise the program at cmdPath. Background commands
+ * are registered as jobs and report success straight away.
+ */
+static int runResolvedCommand(char** args, const char* cmdPath,
+    UtilityStage* utility, CommandExecutionOptions* opts,
+    HANDLE hIn, HANDLE hOut)
 {
-    if (!args || !args[0]) return EXIT_SUCCESS;
-
-    if (_stricmp(args[0], "cd") == 0)
-    {
-        if (args[1] != NULL)
-        {
-            if (SetCurrentDirectoryA(args[1]) == 0)
-            {
-                fprintf(stderr, "cd: cannot change directory to %s\n", args[1]);
-            }
-        }
-        else
-        {
-            fprintf(stderr, "cd: missing argument\n");
-        }
-        return EXIT_SUCCESS;
-    }
-    else if (_stricmp(args[0], "pwd") == 0)
-    {
-        char cwdBuf[1024];
-        if (_getcwd(cwdBuf, sizeof(cwdBuf)) != NULL)
-        {
-            printf("%s\n", cwdBuf);
-        }
-        else
-        {
-            fprintf(stderr, "pwd: error getting current directory\n");
-        }
-        return EXIT_SUCCESS;
-    }
-    else if (_stricmp(args[0], "set") == 0)
+    if (utility != NULL)
     {
-        if (args[1] != NULL && args[2] != NULL)
-        {
-            addEnvironmentVariable(args[1], args[2]);
-        }
-        else
-        {
-            fprintf(stderr, "set: usage: set NAME VALUE\n");
-        }
-        return EXIT_SUCCESS;
-    }
-    else if (_stricmp(args[0], "unset") == 0)
-    {
-        if (args[1] != NULL)
-        {
-            removeEnvironmentVariable(args[1]);
-        }
-        else
+        DWORD utilityStatus = EXIT_FAILURE;
+        HANDLE utilityThread = startUtilityStage(utility, hIn, hOut);
+        if (utilityThread != NULL)
         {
-            fprintf(stderr, "unset: usage: unset NAME\n");
+            waitForForegroundProcesses(&utilityThread, 1, &utilityStatus);
+            CloseHandle(utilityThread);
         }
-        return EXIT_SUCCESS;
+        return (int)utilityStatus;
     }
-    else if (_stricmp(args[0], "echo") == 0)
+
+    char cmdline[4096];
+    cmdline[0] = '\0';
     {
-        int i = 1;
+        int i = 0;
         while (args[i] != NULL)
         {
-            if (i > 1)
+            if (i > 0)
             {
-                printf(" ");
+                strncat_s(cmdline, sizeof(cmdline), " ", _TRUNCATE);
             }
-            printf("%s", args[i]);
+            strncat_s(cmdline, sizeof(cmdline), args[i], _TRUNCATE);
             i++;
         }
-        printf("\n");
-        return EXIT_SUCCESS;
     }
 
-    char* cmdPath = locateCommandPath(args[0], pathList);
-    if (!cmdPath)
+    HANDLE hErr = GetStdHandle(STD_ERROR_HANDLE);
+    JobOutputLog* outputLog = opts->runInBackground ? startJobOutputLog() : NULL;
+    if (outputLog != NULL)
     {
-        fprintf(stderr, "%s: command not found\n", args[0]);
-        return EXIT_FAILURE;
+        hErr = getJobOutputLogWriter(outputLog);
+        if (opts->outputFile == NULL)
+        {
+            hOut = hErr;
+        }
     }
 
-    HANDLE inFileHandle = INVALID_HANDLE_VALUE;
-    HANDLE outFileHandle = INVALID_HANDLE_VALUE;
+    HANDLE job = createJobContainer();
+    PROCESS_INFORMATION pi;
 
-    HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE);
+    int spawned = spawnCommandProcess(cmdPath, cmdline, hIn, hOut, hErr, job,
+        &opts->placement, getChildEnvironmentBlock(), opts->runInBackground, &pi);
+    closeJobOutputLogWriter(outputLog);
+    if (!spawned)
+    {
+        fprintf(stderr, "Failed to run command: %s\n", cmdline);
+        discardJobOutputLog(outputLog);
+        releaseJobContainer(job);
+        return EXIT_FAILURE;
+    }
+    CloseHandle(pi.hThread);
+
+    DWORD exitCode = EXIT_SUCCESS;
+    if (!opts->runInBackground)
+    {
+        waitForForegroundProcesses(&pi.hProcess, 1, &exitCode);
+        CloseHandle(pi.hProcess);
+    }
+    else
+    {
+        registerBackgroundJob(&pi.hProcess, 1, cmdline, outputLog);
+    }
+    releaseJobContainer(job);
+
+    return (int)exitCode;
+}
+
+/*
+ * "cache [--] COMMAND ...": replays the stored stdout and exit status when
+ * the key matches, otherwise runs COMMAND into a capture file, passes the
+ * output on and stores it. The command reads NUL unless '<' names a file,
+ * because no other input can be part of the key. stderr is not cached.
+ */
+static int runThroughOutputCache(char** args, const char* cmdPath,
+    UtilityStage* utility, CommandExecutionOptions* opts,
+    HANDLE hIn, HANDLE hOut)
+{
+    char cacheKey[CACHE_KEY_HEX_SIZE];
+    if (!computeOutputCacheKey(cmdPath, args, opts->inputFile, cacheKey))
+    {
+        fprintf(stderr, "cache: cannot compute key; running uncached\n");
+        return runResolvedCommand(args, cmdPath, utility, opts, hIn, hOut);
+    }
+
+    DWORD cachedStatus = EXIT_FAILURE;
+    if (replayCachedOutput(cacheKey, hOut, &cachedStatus))
+    {
+        discardUtilityStage(utility);
+        return (int)cachedStatus;
+    }
+
+    OutputCapture capture;
+    if (!beginOutputCapture(cacheKey, &capture))
+    {
+        fprintf(stderr, "cache: store unavailable; running uncached\n");
+        return runResolvedCommand(args, cmdPath, utility, opts, hIn, hOut);
+    }
+
+    HANDLE nullInput = INVALID_HANDLE_VALUE;
+    if (opts->inputFile == NULL)
+    {
+        nullInput = CreateFileA("NUL", READ_MODE, FILE_SHARE_FOR_READ, NULL,
+            OPEN_EXISTING_FILE, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (nullInput != INVALID_HANDLE_VALUE)
+        {
+            hIn = nullInput;
+        }
+    }
+
+    int status = runResolvedCommand(args, cmdPath, utility, opts, hIn, capture.file);
+    if (nullInput != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(nullInput);
+    }
+    /* Output cut short by Ctrl-C would be replayed as if it were complete. */
+    if (status == INTERRUPTED_EXIT_CODE || isForegroundInterrupted())
+    {
+        abandonOutputCapture(&capture);
+    }
+    else if (!finishOutputCapture(&capture, (DWORD)status, hOut))
+    {
+        fprintf(stderr, "cache: could not store the result\n");
+    }
+    return status;
+}
+
+static int runSingleCommand(char** args,
+    CommandExecutionOptions* opts,
+    char** pathList)
+{
+    if (!args || !args[0]) return EXIT_SUCCESS;
+
+    int cacheOutput = 0;
+    if (_stricmp(args[0], "cache") == 0)
+    {
+        args += (args[1] != NULL && strcmp(args[1], "--") == 0) ? 2 : 1;
+        if (args[0] == NULL || opts->runInBackground || findBuiltin(args[0]) != NULL)
+        {
+            fprintf(stderr, "cache: usage: cache [--] COMMAND [ARGS...] (foreground, not a builtin)\n");
+            return EXIT_FAILURE;
+        }
+        cacheOutput = 1;
+    }
+
+    const BuiltinEntry* builtin = findBuiltin(args[0]);
+    if (builtin != NULL && !builtinTakesStreams(builtin))
+    {
+        return runCoreBuiltin(builtin, args);
+    }
+
+    UtilityStage* utility = (builtin != NULL || opts->runInBackground ||
+        requiresSeparateProcess(&opts->placement)) ? NULL : prepareUtilityStage(args);
+    char* cmdPath = NULL;
+    if (utility == NULL && builtin == NULL)
+    {
+        cmdPath = locateCommandPath(args[0], pathList);
+        if (!cmdPath)
+        {
+            fprintf(stderr, "%s: command not found\n", args[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    HANDLE inFileHandle = INVALID_HANDLE_VALUE;
+    HANDLE outFileHandle = INVALID_HANDLE_VALUE;
+
+    HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE);
     HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
 
     if (opts->inputFile != NULL)
@@ -471,6 +1088,7 @@ static int runSingleCommand(char** args,
         if (inFileHandle == INVALID_HANDLE_VALUE)
         {
             fprintf(stderr, "Failed to open input file: %s\n", opts->inputFile);
+            discardUtilityStage(utility);
             free(cmdPath);
             return EXIT_FAILURE;
         }
@@ -490,52 +1108,25 @@ static int runSingleCommand(char** args,
             {
                 CloseHandle(inFileHandle);
             }
+            discardUtilityStage(utility);
             free(cmdPath);
             return EXIT_FAILURE;
         }
         hOut = outFileHandle;
     }
 
-    char cmdline[4096];
-    cmdline[0] = '\0';
+    int status;
+    if (builtin != NULL)
     {
-        int i = 0;
-        while (args[i] != NULL)
-        {
-            if (i > 0)
-            {
-                strncat_s(cmdline, sizeof(cmdline), " ", _TRUNCATE);
-            }
-            strncat_s(cmdline, sizeof(cmdline), args[i], _TRUNCATE);
-            i++;
-        }
+        status = runStreamBuiltin(builtin, args, hIn, hOut);
     }
-
-    STARTUPINFOA si;
-    PROCESS_INFORMATION pi;
-    ZeroMemory(&si, sizeof(si));
-    si.cb = sizeof(si);
-    si.hStdInput = hIn;
-    si.hStdOutput = hOut;
-    si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
-    si.dwFlags |= STARTF_USESTDHANDLES;
-
-    ZeroMemory(&pi, sizeof(pi));
-
-    if (!CreateProcessA(cmdPath, cmdline, NULL, NULL, TRUE, 0, NULL, NULL,
-        &si, &pi))
+    else if (cacheOutput)
     {
-        fprintf(stderr, "Failed to run command: %s\n", cmdline);
-        if (inFileHandle != INVALID_HANDLE_VALUE)
-        {
-            CloseHandle(inFileHandle);
-        }
-        if (outFileHandle != INVALID_HANDLE_VALUE)
-        {
-            CloseHandle(outFileHandle);
-        }
-        free(cmdPath);
-        return EXIT_FAILURE;
+        status = runThroughOutputCache(args, cmdPath, utility, opts, hIn, hOut);
+    }
+    else
+    {
+        status = runResolvedCommand(args, cmdPath, utility, opts, hIn, hOut);
     }
 
     if (inFileHandle != INVALID_HANDLE_VALUE)
@@ -546,215 +1137,392 @@ static int runSingleCommand(char** args,
     {
         CloseHandle(outFileHandle);
     }
-
     free(cmdPath);
+    return status;
+}
 
-    if (!opts->runInBackground)
+static void abandonPipelineMeters(ThroughputMeter** linkMeters, int linkCount)
+{
+    for (int linkI = 0; linkI < linkCount; linkI++)
     {
-        WaitForSingleObject(pi.hProcess, INFINITE);
+        abandonThroughputMeter(linkMeters[linkI]);
+        linkMeters[linkI] = NULL;
     }
+}
 
-    CloseHandle(pi.hThread);
-    CloseHandle(pi.hProcess);
+/*
+ * Splices a meter into pipe link pipeI: the producer keeps writing into the
+ * original pipe, the meter relays into a second pipe, and the consumer's
+ * read end is swapped for the second pipe's. The meter's own ends must not
+ * be inherited or the consumer would never see EOF.
+ */
+static ThroughputMeter* insertLinkMeter(HANDLE* pipeHandles, int pipeI,
+    SECURITY_ATTRIBUTES* sa, DWORD pipeBufferSize,
+    const char* upstreamName, const char* downstreamName)
+{
+    HANDLE meterRead;
+    HANDLE meterWrite;
+    if (!CreatePipe(&meterRead, &meterWrite, sa, pipeBufferSize))
+    {
+        return NULL;
+    }
 
-    return EXIT_SUCCESS;
+    SetHandleInformation(pipeHandles[2 * pipeI], HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation(meterWrite, HANDLE_FLAG_INHERIT, 0);
+
+    ThroughputMeter* meter = startThroughputMeter(pipeHandles[2 * pipeI],
+        meterWrite, upstreamName, downstreamName);
+    if (!meter)
+    {
+        CloseHandle(meterRead);
+        CloseHandle(meterWrite);
+        return NULL;
+    }
+
+    pipeHandles[2 * pipeI] = meterRead;
+    return meter;
 }
 
-static int executePipeline(char*** cmds, char** pathList)
+/*
+ * Wires up a fan-out whose producer is cmds[producerI] and whose consumers
+ * are every later stage. The relay takes the producer's read end of link
+ * producerI and the write end of each later link; the first consumer gets
+ * a fresh pipe because link producerI's read end now belongs to the relay.
+ */
+static FanoutRelay* insertFanoutRelay(HANDLE* pipeHandles, int producerI,
+    int linkCount, SECURITY_ATTRIBUTES* sa, DWORD pipeBufferSize)
 {
-    if (!cmds) return EXIT_SUCCESS;
+    HANDLE firstRead;
+    HANDLE firstWrite;
+    if (!CreatePipe(&firstRead, &firstWrite, sa, pipeBufferSize))
+    {
+        return NULL;
+    }
 
-    int cmdCount = 0;
-    while (cmds[cmdCount] != NULL)
+    HANDLE sinks[MAX_PIPELINE_COMMANDS];
+    int sinkCount = 0;
+    sinks[sinkCount++] = firstWrite;
+    for (int linkI = producerI + 1; linkI < linkCount; linkI++)
     {
-        cmdCount++;
+        sinks[sinkCount++] = pipeHandles[2 * linkI + 1];
+    }
+    for (int sinkI = 0; sinkI < sinkCount; sinkI++)
+    {
+        SetHandleInformation(sinks[sinkI], HANDLE_FLAG_INHERIT, 0);
     }
+    SetHandleInformation(pipeHandles[2 * producerI], HANDLE_FLAG_INHERIT, 0);
 
-    if (cmdCount == 0) return EXIT_SUCCESS;
+    FanoutRelay* relay = startFanoutRelay(pipeHandles[2 * producerI],
+        sinks, sinkCount);
+    if (!relay)
+    {
+        CloseHandle(firstRead);
+        CloseHandle(firstWrite);
+        return NULL;
+    }
 
-    if (cmdCount == 1)
+    pipeHandles[2 * producerI] = firstRead;
+    for (int linkI = producerI + 1; linkI < linkCount; linkI++)
     {
-        CommandExecutionOptions opts;
-        analyzeRedirectionAndBackground(cmds[0], &opts);
-        performVariableExpansion(cmds[0]);
-        return runSingleCommand(cmds[0], &opts, pathList);
+        pipeHandles[2 * linkI + 1] = INVALID_HANDLE_VALUE;
     }
+    return relay;
+}
 
-    int lastIdx = cmdCount - 1;
+/* Frees the redirection targets analyzeRedirectionAndBackground took from args. */
+static void releaseExecutionOptions(CommandExecutionOptions* opts)
+{
+    free(opts->inputFile);
+    free(opts->outputFile);
+    opts->inputFile = NULL;
+    opts->outputFile = NULL;
+}
+
+static void closePipelinePipes(HANDLE* pipeHandles, int linkCount)
+{
+    if (pipeHandles == NULL) return;
 
-    int argCount = 0;
-    while (cmds[lastIdx][argCount] != NULL)
+    for (int closeI = 0; closeI < 2 * linkCount; closeI++)
     {
-        argCount++;
+        if (pipeHandles[closeI] != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(pipeHandles[closeI]);
+        }
     }
+    free(pipeHandles);
+}
+
+/*
+ * Undoes a partly launched pipeline. Stages that already started are
+ * stopped and reaped instead of being left blocked on pipes nobody will
+ * ever feed or drain. The pipes go first so in-process stages see a broken
+ * pipe and return; they must be gone before the tokens they point into are
+ * freed.
+ */
+static void abortPipelineLaunch(ProcessInfo* procData, int startedCount,
+    HANDLE* pipeHandles, int linkCount, ThroughputMeter** linkMeters,
+    FanoutRelay* fanout, JobOutputLog* outputLog, HANDLE job)
+{
+    closePipelinePipes(pipeHandles, linkCount);
 
-    char** lastCmdArgs = (char**)malloc(sizeof(char*) * (argCount + 1));
-    if (!lastCmdArgs) return EXIT_FAILURE;
+    for (int stageI = 0; stageI < startedCount; stageI++)
     {
-        int i;
-        for (i = 0; i < argCount; i++)
+        HANDLE stage = procData[stageI].pi.hProcess;
+        if (!TerminateProcess(stage, EXIT_FAILURE))
         {
-            lastCmdArgs[i] = cmds[lastIdx][i];
+            /* Not a process: an in-process utility thread. */
+            CancelSynchronousIo(stage);
+        }
+    }
+    for (int stageI = 0; stageI < startedCount; stageI++)
+    {
+        WaitForSingleObject(procData[stageI].pi.hProcess, INFINITE);
+        CloseHandle(procData[stageI].pi.hProcess);
+        if (procData[stageI].pi.hThread != NULL)
+        {
+            CloseHandle(procData[stageI].pi.hThread);
         }
-        lastCmdArgs[argCount] = NULL;
     }
 
-    CommandExecutionOptions finalOpts;
-    analyzeRedirectionAndBackground(lastCmdArgs, &finalOpts);
+    abandonPipelineMeters(linkMeters, linkCount);
+    abandonFanoutRelay(fanout);
+    discardJobOutputLog(outputLog);
+    free(procData);
+    releaseJobContainer(job);
+}
 
+/*
+ * Everything analyzeRedirectionAndBackground takes out of the token list
+ * lands in stageOpts, which executePipeline releases whichever way this
+ * returns.
+ */
+static int launchPipeline(char*** cmds, int cmdCount, char** pathList,
+    const PipeLinkKind* linkKinds, const char* jobLabel,
+    CommandExecutionOptions* stageOpts)
+{
+    if (cmdCount == 1)
     {
-        int i;
-        for (i = 0; i < cmdCount; i++)
+        analyzeRedirectionAndBackground(cmds[0], &stageOpts[0]);
+        DWORD unusedPipeSize = 0;
+        if (!performVariableExpansion(cmds[0]) ||
+            !consumePipeSizePrefix(cmds[0], &unusedPipeSize) ||
+            !consumePlacementPrefixes(cmds[0], &stageOpts[0].placement))
         {
-            if (i == lastIdx)
-            {
-                performVariableExpansion(lastCmdArgs);
-                cmds[i] = lastCmdArgs;
-            }
-            else
-            {
-                performVariableExpansion(cmds[i]);
-            }
+            return EXIT_FAILURE;
         }
+        return runSingleCommand(cmds[0], &stageOpts[0], pathList);
     }
 
-    ProcessInfo* procData = (ProcessInfo*)malloc(sizeof(ProcessInfo) * cmdCount);
-    if (!procData) return EXIT_FAILURE;
-    ZeroMemory(procData, sizeof(ProcessInfo) * cmdCount);
+    int lastIdx = cmdCount - 1;
+    CommandExecutionOptions* finalOpts = &stageOpts[lastIdx];
+    analyzeRedirectionAndBackground(cmds[lastIdx], finalOpts);
 
-    HANDLE* pipeHandles = NULL;
-    if (cmdCount > 1)
+    /* A fan-out ends the pipeline: once "|+" appears every later link is one. */
+    int fanoutStart = -1;
+    for (int linkI = 0; linkI < cmdCount - 1; linkI++)
     {
-        pipeHandles = (HANDLE*)malloc(sizeof(HANDLE) * 2 * (cmdCount - 1));
-        if (!pipeHandles)
+        if (linkKinds[linkI] == PIPE_LINK_FANOUT && fanoutStart < 0)
         {
-            free(procData);
+            fanoutStart = linkI;
+        }
+        else if (linkKinds[linkI] != PIPE_LINK_FANOUT && fanoutStart >= 0)
+        {
+            fprintf(stderr, "Only '|+' may follow a '|+' fan-out\n");
             return EXIT_FAILURE;
         }
+    }
 
-        for (int px = 0; px < 2 * (cmdCount - 1); px++)
+    /* Fan-out consumers each write to the terminal or their own '>' file. */
+    for (int consumerI = fanoutStart + 1;
+        fanoutStart >= 0 && consumerI < lastIdx; consumerI++)
+    {
+        analyzeRedirectionAndBackground(cmds[consumerI], &stageOpts[consumerI]);
+        if (stageOpts[consumerI].runInBackground)
         {
-            pipeHandles[px] = INVALID_HANDLE_VALUE;
+            fprintf(stderr, "'&' is only allowed at the end of a pipeline\n");
+            return EXIT_FAILURE;
         }
+    }
+
+    StagePlacement stagePlacements[MAX_PIPELINE_COMMANDS];
+    DWORD pipeBufferSize = getConfiguredPipeSize();
+    for (int i = 0; i < cmdCount; i++)
+    {
+        if (!performVariableExpansion(cmds[i]))
+        {
+            return EXIT_FAILURE;
+        }
+
+        if ((i == 0 && !consumePipeSizePrefix(cmds[i], &pipeBufferSize)) ||
+            !consumePlacementPrefixes(cmds[i], &stagePlacements[i]))
+        {
+            return EXIT_FAILURE;
+        }
+        if (cmds[i][0] == NULL)
+        {
+            fprintf(stderr, "Empty command in pipeline\n");
+            return EXIT_FAILURE;
+        }
+    }
+    assignAutomaticPlacement(stagePlacements, cmdCount);
+
+    ProcessInfo* procData = (ProcessInfo*)malloc(sizeof(ProcessInfo) * cmdCount);
+    if (!procData) return EXIT_FAILURE;
+    ZeroMemory(procData, sizeof(ProcessInfo) * cmdCount);
+
+    ThroughputMeter* linkMeters[MAX_PIPELINE_COMMANDS] = { NULL };
+    HANDLE* pipeHandles = (HANDLE*)malloc(sizeof(HANDLE) * 2 * (cmdCount - 1));
+    if (!pipeHandles)
+    {
+        free(procData);
+        return EXIT_FAILURE;
+    }
+
+    for (int px = 0; px < 2 * (cmdCount - 1); px++)
+    {
+        pipeHandles[px] = INVALID_HANDLE_VALUE;
+    }
 
-        SECURITY_ATTRIBUTES sa;
-        sa.nLength = sizeof(sa);
-        sa.lpSecurityDescriptor = NULL;
-        sa.bInheritHandle = TRUE;
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.lpSecurityDescriptor = NULL;
+    sa.bInheritHandle = TRUE;
 
-        for (int pipeI = 0; pipeI < cmdCount - 1; pipeI++)
+    for (int pipeI = 0; pipeI < cmdCount - 1; pipeI++)
+    {
+        if (!CreatePipe(&pipeHandles[2 * pipeI],
+            &pipeHandles[2 * pipeI + 1], &sa, pipeBufferSize))
+        {
+            fprintf(stderr, "CreatePipe failed\n");
+            abortPipelineLaunch(procData, 0, pipeHandles, cmdCount - 1,
+                linkMeters, NULL, NULL, NULL);
+            return EXIT_FAILURE;
+        }
+        SetHandleInformation(pipeHandles[2 * pipeI + 1],
+            HANDLE_FLAG_INHERIT,
+            HANDLE_FLAG_INHERIT);
+
+        if (linkKinds[pipeI] == PIPE_LINK_METERED)
         {
-            if (!CreatePipe(&pipeHandles[2 * pipeI],
-                &pipeHandles[2 * pipeI + 1], &sa, 0))
+            linkMeters[pipeI] = insertLinkMeter(pipeHandles, pipeI, &sa,
+                pipeBufferSize, cmds[pipeI][0], cmds[pipeI + 1][0]);
+            if (!linkMeters[pipeI])
             {
-                fprintf(stderr, "CreatePipe failed\n");
-                free(procData);
-                free(pipeHandles);
+                fprintf(stderr, "Failed to insert meter after %s\n",
+                    cmds[pipeI][0]);
+                abortPipelineLaunch(procData, 0, pipeHandles, cmdCount - 1,
+                    linkMeters, NULL, NULL, NULL);
                 return EXIT_FAILURE;
             }
-            SetHandleInformation(pipeHandles[2 * pipeI + 1],
-                HANDLE_FLAG_INHERIT,
-                HANDLE_FLAG_INHERIT);
         }
     }
 
-    for (int commandI = 0; commandI < cmdCount; commandI++)
+    FanoutRelay* fanout = NULL;
+    if (fanoutStart >= 0)
     {
-        char* cmdPath = locateCommandPath(cmds[commandI][0], pathList);
-        if (!cmdPath)
+        fanout = insertFanoutRelay(pipeHandles, fanoutStart, cmdCount - 1,
+            &sa, pipeBufferSize);
+        if (!fanout)
         {
-            fprintf(stderr, "%s: command not found\n", cmds[commandI][0]);
+            fprintf(stderr, "Failed to set up fan-out after %s\n",
+                cmds[fanoutStart][0]);
+            abortPipelineLaunch(procData, 0, pipeHandles, cmdCount - 1,
+                linkMeters, NULL, NULL, NULL);
+            return EXIT_FAILURE;
+        }
+    }
 
-            if (pipeHandles != NULL)
-            {
-                for (int closeI = 0; closeI < 2 * (cmdCount - 1); closeI++)
-                {
-                    if (pipeHandles[closeI] != INVALID_HANDLE_VALUE)
-                    {
-                        CloseHandle(pipeHandles[closeI]);
-                    }
-                }
-                free(pipeHandles);
-            }
+    /* A captured background job writes to its log wherever it would reach the terminal. */
+    JobOutputLog* outputLog = finalOpts->runInBackground ? startJobOutputLog() : NULL;
+    HANDLE terminalOut = GetStdHandle(STD_OUTPUT_HANDLE);
+    HANDLE stageErr = GetStdHandle(STD_ERROR_HANDLE);
+    if (outputLog != NULL)
+    {
+        terminalOut = getJobOutputLogWriter(outputLog);
+        stageErr = terminalOut;
+    }
+
+    HANDLE job = createJobContainer();
+
+    /* Fetched once so every stage starts from the same environment. */
+    const char* childEnvironment = getChildEnvironmentBlock();
 
-            free(procData);
+    for (int commandI = 0; commandI < cmdCount; commandI++)
+    {
+        UtilityStage* utility = (finalOpts->runInBackground ||
+            requiresSeparateProcess(&stagePlacements[commandI])) ?
+            NULL : prepareUtilityStage(cmds[commandI]);
+        char* cmdPath = NULL;
+        if (utility == NULL)
+        {
+            cmdPath = locateCommandPath(cmds[commandI][0], pathList);
+        }
+        if (!utility && !cmdPath)
+        {
+            fprintf(stderr, "%s: command not found\n", cmds[commandI][0]);
+            abortPipelineLaunch(procData, commandI, pipeHandles, cmdCount - 1,
+                linkMeters, fanout, outputLog, job);
             return EXIT_FAILURE;
         }
 
         HANDLE chosenIn = GetStdHandle(STD_INPUT_HANDLE);
-        HANDLE chosenOut = GetStdHandle(STD_OUTPUT_HANDLE);
+        HANDLE chosenOut = terminalOut;
+        HANDLE stageInFile = INVALID_HANDLE_VALUE;
+        HANDLE stageOutFile = INVALID_HANDLE_VALUE;
 
         if (commandI > 0)
         {
             chosenIn = pipeHandles[2 * (commandI - 1)];
         }
 
-        if (commandI < cmdCount - 1)
+        int fanoutConsumer = fanoutStart >= 0 && commandI > fanoutStart;
+        if (commandI < cmdCount - 1 && !fanoutConsumer)
         {
             chosenOut = pipeHandles[2 * commandI + 1];
         }
         else
         {
-            if (finalOpts.inputFile != NULL)
+            CommandExecutionOptions* opts = &stageOpts[commandI];
+            if (opts->inputFile != NULL)
             {
-                HANDLE customInFile = CreateFileA(
-                    finalOpts.inputFile, READ_MODE, FILE_SHARE_FOR_READ,
+                stageInFile = CreateFileA(
+                    opts->inputFile, READ_MODE, FILE_SHARE_FOR_READ,
                     NULL, OPEN_EXISTING_FILE, FILE_ATTRIBUTE_NORMAL, NULL
                 );
-                if (customInFile == INVALID_HANDLE_VALUE)
+                if (stageInFile == INVALID_HANDLE_VALUE)
                 {
                     fprintf(stderr, "Failed to open input file: %s\n",
-                        finalOpts.inputFile);
+                        opts->inputFile);
+                    discardUtilityStage(utility);
                     free(cmdPath);
-
-                    if (pipeHandles != NULL)
-                    {
-                        for (int pipeCloseI = 0; pipeCloseI < 2 * (cmdCount - 1);
-                            pipeCloseI++)
-                        {
-                            if (pipeHandles[pipeCloseI]
-                                != INVALID_HANDLE_VALUE)
-                            {
-                                CloseHandle(pipeHandles[pipeCloseI]);
-                            }
-                        }
-                        free(pipeHandles);
-                    }
-                    free(procData);
+                    abortPipelineLaunch(procData, commandI, pipeHandles,
+                        cmdCount - 1, linkMeters, fanout, outputLog, job);
                     return EXIT_FAILURE;
                 }
-                chosenIn = customInFile;
+                chosenIn = stageInFile;
             }
 
-            if (finalOpts.outputFile != NULL)
+            if (opts->outputFile != NULL)
             {
-                HANDLE customOutFile = CreateFileA(
-                    finalOpts.outputFile, WRITE_MODE, 0, NULL,
+                stageOutFile = CreateFileA(
+                    opts->outputFile, WRITE_MODE, 0, NULL,
                     CREATE_ALWAYS_FILE, FILE_ATTRIBUTE_NORMAL, NULL
                 );
-                if (customOutFile == INVALID_HANDLE_VALUE)
+                if (stageOutFile == INVALID_HANDLE_VALUE)
                 {
                     fprintf(stderr, "Failed to open output file: %s\n",
-                        finalOpts.outputFile);
-                    free(cmdPath);
-
-                    if (pipeHandles != NULL)
+                        opts->outputFile);
+                    if (stageInFile != INVALID_HANDLE_VALUE)
                     {
-                        for (int pipeCloseI = 0; pipeCloseI < 2 * (cmdCount - 1);
-                            pipeCloseI++)
-                        {
-                            if (pipeHandles[pipeCloseI]
-                                != INVALID_HANDLE_VALUE)
-                            {
-                                CloseHandle(pipeHandles[pipeCloseI]);
-                            }
-                        }
-                        free(pipeHandles);
+                        CloseHandle(stageInFile);
                     }
-                    free(procData);
+                    discardUtilityStage(utility);
+                    free(cmdPath);
+                    abortPipelineLaunch(procData, commandI, pipeHandles,
+                        cmdCount - 1, linkMeters, fanout, outputLog, job);
                     return EXIT_FAILURE;
                 }
-                chosenOut = customOutFile;
+                chosenOut = stageOutFile;
             }
         }
 
@@ -773,104 +1541,169 @@ static int executePipeline(char*** cmds, char** pathList)
             }
         }
 
-        STARTUPINFOA si;
         PROCESS_INFORMATION pi;
-        ZeroMemory(&si, sizeof(si));
-        si.cb = sizeof(si);
-        si.hStdInput = chosenIn;
-        si.hStdOutput = chosenOut;
-        si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
-        si.dwFlags |= STARTF_USESTDHANDLES;
-        ZeroMemory(&pi, sizeof(pi));
+        int spawned = 0;
 
-        if (!CreateProcessA(cmdPath, assembledLine, NULL, NULL, TRUE, 0,
-            NULL, NULL, &si, &pi))
+        if (utility != NULL)
         {
-            fprintf(stderr, "Failed to run command: %s\n", assembledLine);
-            free(cmdPath);
+            ZeroMemory(&pi, sizeof(pi));
+            pi.hProcess = startUtilityStage(utility, chosenIn, chosenOut);
+            spawned = pi.hProcess != NULL;
+        }
+        else
+        {
+            spawned = spawnCommandProcess(cmdPath, assembledLine, chosenIn,
+                chosenOut, stageErr, job, &stagePlacements[commandI],
+                childEnvironment, finalOpts->runInBackground, &pi);
+        }
 
-            if (pipeHandles != NULL)
-            {
-                for (int pipeCloseI = 0; pipeCloseI < 2 * (cmdCount - 1);
-                    pipeCloseI++)
-                {
-                    if (pipeHandles[pipeCloseI] != INVALID_HANDLE_VALUE)
-                    {
-                        CloseHandle(pipeHandles[pipeCloseI]);
-                    }
-                }
-                free(pipeHandles);
-            }
-            free(procData);
+        /* The stage holds its own copies of everything it was handed. */
+        if (stageInFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(stageInFile);
+        }
+        if (stageOutFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(stageOutFile);
+        }
+        free(cmdPath);
+
+        if (!spawned)
+        {
+            fprintf(stderr, "Failed to run command: %s\n", assembledLine);
+            abortPipelineLaunch(procData, commandI, pipeHandles, cmdCount - 1,
+                linkMeters, fanout, outputLog, job);
             return EXIT_FAILURE;
         }
 
-        free(cmdPath);
         procData[commandI].pi = pi;
 
-        if (commandI > 0 && chosenIn != GetStdHandle(STD_INPUT_HANDLE))
+        if (commandI > 0)
         {
-            CloseHandle(chosenIn);
+            CloseHandle(pipeHandles[2 * (commandI - 1)]);
+            pipeHandles[2 * (commandI - 1)] = INVALID_HANDLE_VALUE;
         }
         if (commandI < cmdCount - 1 &&
-            chosenOut != GetStdHandle(STD_OUTPUT_HANDLE))
+            pipeHandles[2 * commandI + 1] != INVALID_HANDLE_VALUE)
         {
-            CloseHandle(chosenOut);
+            CloseHandle(pipeHandles[2 * commandI + 1]);
+            pipeHandles[2 * commandI + 1] = INVALID_HANDLE_VALUE;
         }
     }
 
-    if (pipeHandles != NULL)
+    closePipelinePipes(pipeHandles, cmdCount - 1);
+    closeJobOutputLogWriter(outputLog);
+
+    HANDLE stageProcesses[MAX_PIPELINE_COMMANDS];
+    for (int handleI = 0; handleI < cmdCount; handleI++)
     {
-        for (int pipeCloseI = 0; pipeCloseI < 2 * (cmdCount - 1); pipeCloseI++)
+        if (procData[handleI].pi.hThread != NULL)
         {
-            if (pipeHandles[pipeCloseI] != INVALID_HANDLE_VALUE)
-            {
-                CloseHandle(pipeHandles[pipeCloseI]);
-            }
+            CloseHandle(procData[handleI].pi.hThread);
         }
-        free(pipeHandles);
+        stageProcesses[handleI] = procData[handleI].pi.hProcess;
     }
 
-    if (!finalOpts.runInBackground)
+    DWORD exitCode = EXIT_SUCCESS;
+    if (!finalOpts->runInBackground)
     {
-        for (int waitI = 0; waitI < cmdCount; waitI++)
+        waitForForegroundProcesses(stageProcesses, cmdCount, &exitCode);
+        for (int handleCloseI = 0; handleCloseI < cmdCount; handleCloseI++)
+        {
+            CloseHandle(stageProcesses[handleCloseI]);
+        }
+        for (int linkI = 0; linkI < cmdCount - 1; linkI++)
         {
-            WaitForSingleObject(procData[waitI].pi.hProcess, INFINITE);
-            CloseHandle(procData[waitI].pi.hThread);
-            CloseHandle(procData[waitI].pi.hProcess);
+            finishThroughputMeter(linkMeters[linkI]);
         }
+        finishFanoutRelay(fanout);
     }
     else
     {
-        for (int handleCloseI = 0; handleCloseI < cmdCount; handleCloseI++)
+        registerBackgroundJob(stageProcesses, cmdCount, jobLabel, outputLog);
+        for (int linkI = 0; linkI < cmdCount - 1; linkI++)
         {
-            CloseHandle(procData[handleCloseI].pi.hThread);
-            CloseHandle(procData[handleCloseI].pi.hProcess);
+            detachThroughputMeter(linkMeters[linkI]);
         }
+        detachFanoutRelay(fanout);
     }
 
     free(procData);
-    return EXIT_SUCCESS;
+    releaseJobContainer(job);
+    return (int)exitCode;
 }
 
-void parseAndExecuteCommandPipeline(const char* inputLine, char** pathList)
+static int executePipeline(char*** cmds, char** pathList,
+    const PipeLinkKind* linkKinds, const char* jobLabel)
 {
-    if (!inputLine) return;
+    if (!cmds) return EXIT_SUCCESS;
+
+    int cmdCount = 0;
+    while (cmds[cmdCount] != NULL)
+    {
+        cmdCount++;
+    }
 
+    if (cmdCount == 0) return EXIT_SUCCESS;
+
+    CommandExecutionOptions stageOpts[MAX_PIPELINE_COMMANDS];
+    ZeroMemory(stageOpts, sizeof(stageOpts));
+
+    int status = launchPipeline(cmds, cmdCount, pathList, linkKinds,
+        jobLabel, stageOpts);
+
+    for (int stageI = 0; stageI < cmdCount; stageI++)
+    {
+        releaseExecutionOptions(&stageOpts[stageI]);
+    }
+    return status;
+}
+
+int parseAndExecuteCommandPipeline(const char* inputLine, char** pathList)
+{
+    if (!inputLine) return EXIT_SUCCESS;
+
+    resetConditionStatCache();
+    beginForegroundLine();
     char** tokens = splitLineIntoTokens(inputLine);
-    if (!tokens) return;
+    if (!tokens) return EXIT_FAILURE;
+
+    int collapsed = collapseArithmeticExpansions(tokens) &&
+        collapseProcessSubstitutions(tokens);
 
-    if (tokens[0] == NULL)
+    int tokenCount = 0;
+    while (tokens[tokenCount] != NULL)
     {
-        freeTokens(tokens);
-        return;
+        tokenCount++;
     }
 
-    char*** cmdPipeline = splitByPipe(tokens);
+    if (!collapsed || tokenCount == 0)
+    {
+        freeTokens(tokens, tokenCount);
+        return collapsed ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    SubstitutionSet* substitutions = NULL;
+    if (!startProcessSubstitutions(tokens, &substitutions))
+    {
+        freeTokens(tokens, tokenCount);
+        return EXIT_FAILURE;
+    }
+    if (substitutions != NULL && strcmp(tokens[tokenCount - 1], "&") == 0)
+    {
+        fprintf(stderr, "Process substitution is not supported in background jobs\n");
+        finishProcessSubstitutions(substitutions);
+        freeTokens(tokens, tokenCount);
+        return EXIT_FAILURE;
+    }
+
+    PipeLinkKind linkKinds[MAX_PIPELINE_COMMANDS];
+    char*** cmdPipeline = splitByPipe(tokens, linkKinds);
     if (!cmdPipeline)
     {
-        freeTokens(tokens);
-        return;
+        finishProcessSubstitutions(substitutions);
+        freeTokens(tokens, tokenCount);
+        return EXIT_FAILURE;
     }
 
     int cmdCount = 0;
@@ -879,8 +1712,10 @@ void parseAndExecuteCommandPipeline(const char* inputLine, char** pathList)
         cmdCount++;
     }
 
-    executePipeline(cmdPipeline, pathList);
+    int status = executePipeline(cmdPipeline, pathList, linkKinds, inputLine);
+    finishProcessSubstitutions(substitutions);
 
-    freeTokens(tokens);
+    freeTokens(tokens, tokenCount);
     free(cmdPipeline);
+    return status;
 }
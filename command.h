@@ -1,9 +1,19 @@
 #ifndef COMMAND_H
 #define COMMAND_H
 
+#include <windows.h>
+
 char** retrieveSystemPathList(void);
 void freePathList(char** paths);
 
-void parseAndExecuteCommandPipeline(const char* inputLine, char** pathList);
+int parseAndExecuteCommandPipeline(const char* inputLine, char** pathList);
+void clearResolvedCommandCache(void);
+
+#ifndef MAX_SUBCOMMAND_LINE_LENGTH
+#define MAX_SUBCOMMAND_LINE_LENGTH 4096
+#endif
+
+int spawnShellSubcommand(const char* commandText, HANDLE hIn, HANDLE hOut,
+    const char* environmentBlock, HANDLE* process);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,424 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "condition.h"
+#include "allocation.h"
+
+#ifndef CONDITION_STAT_CACHE_SIZE
+#define CONDITION_STAT_CACHE_SIZE 16
+#endif
+
+/* Exit status for a malformed expression, distinct from plain false. */
+#define TEST_SYNTAX_ERROR 2
+
+/*
+ * Attributes of the paths looked at since the current line started, so
+ * "[ -e f -a -f f -a -w f ]" asks the file system once. The cache only
+ * lives for one line: anything the line runs may change the files.
+ */
+typedef struct StatCacheEntry
+{
+    char path[MAX_PATH];
+    BOOL found;
+    WIN32_FILE_ATTRIBUTE_DATA data;
+} StatCacheEntry;
+
+static StatCacheEntry statCache[CONDITION_STAT_CACHE_SIZE];
+static int statCacheCount = 0;
+static int statCacheNext = 0;
+
+typedef struct TestParser
+{
+    char** args;
+    int pos;
+    int end;
+    int failed;
+} TestParser;
+
+static const char* unaryOperators[] =
+{
+    "-e", "-f", "-d", "-x", "-r", "-w", "-s", "-L", "-h", "-z", "-n", NULL
+};
+
+static const char* binaryOperators[] =
+{
+    "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", NULL
+};
+
+static const char* executableExtensions[] = { ".exe", ".com", ".bat", ".cmd", NULL };
+
+static int parseOrExpression(TestParser* parser);
+
+void resetConditionStatCache(void)
+{
+    statCacheCount = 0;
+    statCacheNext = 0;
+}
+
+static BOOL statPath(const char* path, WIN32_FILE_ATTRIBUTE_DATA* data)
+{
+    for (int i = 0; i < statCacheCount; i++)
+    {
+        if (_stricmp(statCache[i].path, path) == 0)
+        {
+            *data = statCache[i].data;
+            return statCache[i].found;
+        }
+    }
+
+    BOOL found = GetFileAttributesExA(path, GetFileExInfoStandard, data);
+    if (strlen(path) < MAX_PATH)
+    {
+        StatCacheEntry* entry = &statCache[statCacheNext];
+        strcpy_s(entry->path, sizeof(entry->path), path);
+        entry->found = found;
+        entry->data = *data;
+        statCacheNext = (statCacheNext + 1) % CONDITION_STAT_CACHE_SIZE;
+        if (statCacheCount < CONDITION_STAT_CACHE_SIZE)
+        {
+            statCacheCount++;
+        }
+    }
+    return found;
+}
+
+static int isListedOperator(const char* const* operators, const char* text)
+{
+    for (int i = 0; operators[i] != NULL; i++)
+    {
+        if (strcmp(operators[i], text) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int failTest(TestParser* parser, const char* message, const char* detail)
+{
+    if (!parser->failed)
+    {
+        fprintf(stderr, "%s: %s%s\n", parser->args[0], message, detail);
+        parser->failed = 1;
+    }
+    return 0;
+}
+
+static unsigned long long fileTimeValue(const FILETIME* time)
+{
+    return ((unsigned long long)time->dwHighDateTime << 32) | time->dwLowDateTime;
+}
+
+/* Windows has no execute bit: directories and the usual launchable extensions pass. */
+static int hasExecutableExtension(const char* path)
+{
+    const char* extension = strrchr(path, '.');
+    if (extension == NULL || strpbrk(extension, "\\/") != NULL)
+    {
+        return 0;
+    }
+    for (int i = 0; executableExtensions[i] != NULL; i++)
+    {
+        if (_stricmp(extension, executableExtensions[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int evaluateUnary(TestParser* parser, const char* op, const char* operand)
+{
+    if (strcmp(op, "-z") == 0)
+    {
+        return operand[0] == '\0';
+    }
+    if (strcmp(op, "-n") == 0)
+    {
+        return operand[0] != '\0';
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!statPath(operand, &data))
+    {
+        return 0;
+    }
+    DWORD attributes = data.dwFileAttributes;
+    int isDirectory = (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    switch (op[1])
+    {
+    case 'e':
+    case 'r':
+        return 1;
+    case 'f':
+        return !isDirectory;
+    case 'd':
+        return isDirectory;
+    case 'w':
+        return (attributes & FILE_ATTRIBUTE_READONLY) == 0;
+    case 'x':
+        return isDirectory || hasExecutableExtension(operand);
+    case 's':
+        return !isDirectory && (data.nFileSizeHigh != 0 || data.nFileSizeLow != 0);
+    case 'L':
+    case 'h':
+        return (attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+    }
+    return failTest(parser, "unknown unary operator: ", op);
+}
+
+static int parseTestInteger(TestParser* parser, const char* text, long long* value)
+{
+    char* end = NULL;
+    *value = _strtoi64(text, &end, 10);
+    if (end == text || *end != '\0')
+    {
+        return failTest(parser, "integer expression expected: ", text);
+    }
+    return 1;
+}
+
+static int evaluateBinary(TestParser* parser, const char* left, const char* op,
+    const char* right)
+{
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+    {
+        return strcmp(left, right) == 0;
+    }
+    if (strcmp(op, "!=") == 0)
+    {
+        return strcmp(left, right) != 0;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA leftData;
+        WIN32_FILE_ATTRIBUTE_DATA rightData;
+        BOOL leftFound = statPath(left, &leftData);
+        BOOL rightFound = statPath(right, &rightData);
+        if (strcmp(op, "-ot") == 0)
+        {
+            BOOL swappedFound = leftFound;
+            leftFound = rightFound;
+            rightFound = swappedFound;
+            WIN32_FILE_ATTRIBUTE_DATA swappedData = leftData;
+            leftData = rightData;
+            rightData = swappedData;
+        }
+        /* Like other shells, an existing file is newer than a missing one. */
+        return leftFound && (!rightFound ||
+            fileTimeValue(&leftData.ftLastWriteTime) >
+            fileTimeValue(&rightData.ftLastWriteTime));
+    }
+
+    long long leftValue = 0;
+    long long rightValue = 0;
+    if (!parseTestInteger(parser, left, &leftValue) ||
+        !parseTestInteger(parser, right, &rightValue))
+    {
+        return 0;
+    }
+    if (strcmp(op, "-eq") == 0)
+    {
+        return leftValue == rightValue;
+    }
+    if (strcmp(op, "-ne") == 0)
+    {
+        return leftValue != rightValue;
+    }
+    if (strcmp(op, "-lt") == 0)
+    {
+        return leftValue < rightValue;
+    }
+    if (strcmp(op, "-le") == 0)
+    {
+        return leftValue <= rightValue;
+    }
+    if (strcmp(op, "-gt") == 0)
+    {
+        return leftValue > rightValue;
+    }
+    return leftValue >= rightValue;
+}
+
+static int parsePrimary(TestParser* parser)
+{
+    if (parser->pos >= parser->end)
+    {
+        return failTest(parser, "argument expected", "");
+    }
+
+    char** args = parser->args;
+    int pos = parser->pos;
+    if (strcmp(args[pos], "(") == 0)
+    {
+        parser->pos++;
+        int value = parseOrExpression(parser);
+        if (parser->pos >= parser->end || strcmp(args[parser->pos], ")") != 0)
+        {
+            return failTest(parser, "missing ')'", "");
+        }
+        parser->pos++;
+        return value;
+    }
+    if (pos + 2 < parser->end && isListedOperator(binaryOperators, args[pos + 1]))
+    {
+        parser->pos += 3;
+        return evaluateBinary(parser, args[pos], args[pos + 1], args[pos + 2]);
+    }
+    if (pos + 1 < parser->end && isListedOperator(unaryOperators, args[pos]))
+    {
+        parser->pos += 2;
+        return evaluateUnary(parser, args[pos], args[pos + 1]);
+    }
+    parser->pos++;
+    return args[pos][0] != '\0';
+}
+
+static int parseNotExpression(TestParser* parser)
+{
+    if (parser->pos + 1 < parser->end && strcmp(parser->args[parser->pos], "!") == 0)
+    {
+        parser->pos++;
+        return !parseNotExpression(parser);
+    }
+    return parsePrimary(parser);
+}
+
+static int parseAndExpression(TestParser* parser)
+{
+    int value = parseNotExpression(parser);
+    while (!parser->failed && parser->pos < parser->end &&
+        strcmp(parser->args[parser->pos], "-a") == 0)
+    {
+        parser->pos++;
+        int right = parseNotExpression(parser);
+        value = value && right;
+    }
+    return value;
+}
+
+static int parseOrExpression(TestParser* parser)
+{
+    int value = parseAndExpression(parser);
+    while (!parser->failed && parser->pos < parser->end &&
+        strcmp(parser->args[parser->pos], "-o") == 0)
+    {
+        parser->pos++;
+        int right = parseAndExpression(parser);
+        value = value || right;
+    }
+    return value;
+}
+
+/*
+ * POSIX decides up to four arguments by their count, so "[ -f ]" and
+ * "[ ! = x ]" mean what they look like; longer expressions go through
+ * the -o / -a / ! / ( ) grammar.
+ */
+static int evaluateByCount(TestParser* parser, int count)
+{
+    char** args = parser->args + parser->pos;
+    switch (count)
+    {
+    case 0:
+        return 0;
+    case 1:
+        parser->pos++;
+        return args[0][0] != '\0';
+    case 2:
+        if (strcmp(args[0], "!") == 0)
+        {
+            parser->pos++;
+            return !evaluateByCount(parser, 1);
+        }
+        if (isListedOperator(unaryOperators, args[0]))
+        {
+            parser->pos += 2;
+            return evaluateUnary(parser, args[0], args[1]);
+        }
+        return failTest(parser, "unary operator expected: ", args[0]);
+    case 3:
+        if (isListedOperator(binaryOperators, args[1]))
+        {
+            parser->pos += 3;
+            return evaluateBinary(parser, args[0], args[1], args[2]);
+        }
+        if (strcmp(args[0], "!") == 0)
+        {
+            parser->pos++;
+            return !evaluateByCount(parser, 2);
+        }
+        if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0)
+        {
+            parser->pos++;
+            int value = evaluateByCount(parser, 1);
+            parser->pos++;
+            return value;
+        }
+        break;
+    case 4:
+        if (strcmp(args[0], "!") == 0)
+        {
+            parser->pos++;
+            return !evaluateByCount(parser, 3);
+        }
+        if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0)
+        {
+            parser->pos++;
+            int value = evaluateByCount(parser, 2);
+            parser->pos++;
+            return value;
+        }
+        break;
+    }
+
+    int value = parseOrExpression(parser);
+    if (!parser->failed && parser->pos < parser->end)
+    {
+        return failTest(parser, "unexpected argument: ", parser->args[parser->pos]);
+    }
+    return value;
+}
+
+/*
+ * "test EXPR" and "[ EXPR ]": file, string and integer checks. File
+ * checks share one attribute lookup per path for the rest of the line.
+ */
+int runTestBuiltin(char** args)
+{
+    int end = 0;
+    while (args[end] != NULL)
+    {
+        end++;
+    }
+
+    if (strcmp(args[0], "[") == 0)
+    {
+        if (end < 2 || strcmp(args[end - 1], "]") != 0)
+        {
+            fprintf(stderr, "[: missing ']'\n");
+            return TEST_SYNTAX_ERROR;
+        }
+        end--;
+    }
+
+    TestParser parser;
+    parser.args = args;
+    parser.pos = 1;
+    parser.end = end;
+    parser.failed = 0;
+
+    int value = evaluateByCount(&parser, end - 1);
+    if (parser.failed)
+    {
+        return TEST_SYNTAX_ERROR;
+    }
+    return value ? EXIT_SUCCESS : EXIT_FAILURE;
+}
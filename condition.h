@@ -0,0 +1,7 @@
+#ifndef CONDITION_H
+#define CONDITION_H
+
+int runTestBuiltin(char** args);
+void resetConditionStatCache(void);
+
+#endif
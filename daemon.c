@@ -0,0 +1,622 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0A00
+#endif
+
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#include <aclapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <io.h>
+#include <fcntl.h>
+
+#include "daemon.h"
+#include "command.h"
+#include "environment.h"
+#include "resource.h"
+#include "builtins.h"
+#include "jobs.h"
+#include "allocation.h"
+
+#ifndef SIO_AF_UNIX_GETPEERPID
+#define SIO_AF_UNIX_GETPEERPID _WSAIOR(IOC_VENDOR, 256)
+#endif
+
+#ifndef MAX_REQUEST_LENGTH
+#define MAX_REQUEST_LENGTH 65536
+#endif
+
+#ifndef MAX_SESSION_VARIABLES
+#define MAX_SESSION_VARIABLES 64
+#endif
+
+#ifndef STANDARD_STREAM_COUNT
+#define STANDARD_STREAM_COUNT 3
+#endif
+
+/*
+ * One submitted command line. The client's stdio handles have already been
+ * duplicated into this process; the string fields point into the request
+ * buffer.
+ */
+typedef struct SessionRequest
+{
+    HANDLE stdHandles[STANDARD_STREAM_COUNT];
+    char* workingDirectory;
+    char* variableNames[MAX_SESSION_VARIABLES];
+    char* variableValues[MAX_SESSION_VARIABLES];
+    int variableCount;
+    char* commandLine;
+} SessionRequest;
+
+typedef struct SessionContext
+{
+    SOCKET connection;
+    char** pathList;
+} SessionContext;
+
+static const DWORD standardHandleIds[STANDARD_STREAM_COUNT] =
+{
+    STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE
+};
+
+static const char* standardStreamNames[STANDARD_STREAM_COUNT] =
+{
+    "stdin", "stdout", "stderr"
+};
+
+/*
+ * The working directory, the standard handles and the variable store are
+ * process-wide, so sessions run their command lines one at a time; the
+ * session semaphore only bounds how many connections wait for a turn.
+ */
+static CRITICAL_SECTION shellStateLock;
+static HANDLE sessionSlots = NULL;
+
+/* Only processes running as this user may submit command lines. */
+static TOKEN_USER* daemonUser = NULL;
+
+/* The user a process runs as, or NULL. The caller frees the result. */
+static TOKEN_USER* readProcessUser(HANDLE process)
+{
+    HANDLE token = NULL;
+    if (!OpenProcessToken(process, TOKEN_QUERY, &token))
+    {
+        return NULL;
+    }
+
+    DWORD size = 0;
+    GetTokenInformation(token, TokenUser, NULL, 0, &size);
+    TOKEN_USER* user = size ? (TOKEN_USER*)malloc(size) : NULL;
+    if (user != NULL && !GetTokenInformation(token, TokenUser, user, size, &size))
+    {
+        free(user);
+        user = NULL;
+    }
+    CloseHandle(token);
+    return user;
+}
+
+static int isDaemonUser(HANDLE clientProcess)
+{
+    TOKEN_USER* clientUser = readProcessUser(clientProcess);
+    int same = clientUser != NULL && EqualSid(clientUser->User.Sid, daemonUser->User.Sid);
+    free(clientUser);
+    return same;
+}
+
+/*
+ * Replaces the socket file's inherited ACL with one that lets only the
+ * daemon's user open it. Done between bind and listen, so no client can
+ * connect before the ACL is in place.
+ */
+static int restrictSocketToOwner(const char* socketPath)
+{
+    EXPLICIT_ACCESS_A access;
+    ZeroMemory(&access, sizeof(access));
+    access.grfAccessPermissions = GENERIC_ALL;
+    access.grfAccessMode = SET_ACCESS;
+    access.grfInheritance = NO_INHERITANCE;
+    access.Trustee.TrusteeForm = TRUSTEE_IS_SID;
+    access.Trustee.TrusteeType = TRUSTEE_IS_USER;
+    access.Trustee.ptstrName = (LPSTR)daemonUser->User.Sid;
+
+    PACL ownerOnly = NULL;
+    if (SetEntriesInAclA(1, &access, NULL, &ownerOnly) != ERROR_SUCCESS)
+    {
+        return 0;
+    }
+    DWORD result = SetNamedSecurityInfoA((LPSTR)socketPath, SE_FILE_OBJECT,
+        DACL_SECURITY_INFORMATION | PROTECTED_DACL_SECURITY_INFORMATION,
+        NULL, NULL, ownerOnly, NULL);
+    LocalFree(ownerOnly);
+    return result == ERROR_SUCCESS;
+}
+
+static int receiveRequest(SOCKET connection, char* buffer, int capacity)
+{
+    int received = 0;
+    while (received < capacity)
+    {
+        int chunk = recv(connection, buffer + received, capacity - received, 0);
+        if (chunk == 0) break;
+        if (chunk == SOCKET_ERROR) return -1;
+        received += chunk;
+    }
+    buffer[received] = '\0';
+    return received;
+}
+
+static HANDLE duplicateClientHandle(HANDLE clientProcess, const char* valueText)
+{
+    HANDLE clientHandle = (HANDLE)(ULONG_PTR)strtoull(valueText, NULL, 10);
+    HANDLE localHandle = NULL;
+    if (clientHandle == NULL ||
+        !DuplicateHandle(clientProcess, clientHandle, GetCurrentProcess(),
+            &localHandle, 0, FALSE, DUPLICATE_SAME_ACCESS))
+    {
+        return NULL;
+    }
+    return localHandle;
+}
+
+static void closeRequestHandles(SessionRequest* request)
+{
+    for (int i = 0; i < STANDARD_STREAM_COUNT; i++)
+    {
+        if (request->stdHandles[i] != NULL)
+        {
+            CloseHandle(request->stdHandles[i]);
+            request->stdHandles[i] = NULL;
+        }
+    }
+}
+
+/*
+ * Request lines are "stdin|stdout|stderr HANDLE", "cwd PATH",
+ * "var NAME VALUE" and a final "run COMMAND LINE".
+ */
+static int parseSessionRequest(char* requestText, HANDLE clientProcess,
+    SessionRequest* request)
+{
+    ZeroMemory(request, sizeof(*request));
+
+    char* lineStart = requestText;
+    while (lineStart != NULL && *lineStart != '\0')
+    {
+        char* lineEnd = strchr(lineStart, '\n');
+        if (lineEnd != NULL)
+        {
+            *lineEnd = '\0';
+        }
+
+        char* value = strchr(lineStart, ' ');
+        if (value != NULL)
+        {
+            *value++ = '\0';
+
+            for (int i = 0; i < STANDARD_STREAM_COUNT; i++)
+            {
+                if (strcmp(lineStart, standardStreamNames[i]) == 0)
+                {
+                    request->stdHandles[i] = duplicateClientHandle(clientProcess, value);
+                }
+            }
+
+            if (strcmp(lineStart, "cwd") == 0)
+            {
+                request->workingDirectory = value;
+            }
+            else if (strcmp(lineStart, "var") == 0 &&
+                request->variableCount < MAX_SESSION_VARIABLES)
+            {
+                char* variableValue = strchr(value, ' ');
+                if (variableValue != NULL)
+                {
+                    *variableValue++ = '\0';
+                    request->variableNames[request->variableCount] = value;
+                    request->variableValues[request->variableCount] = variableValue;
+                    request->variableCount++;
+                }
+            }
+            else if (strcmp(lineStart, "run") == 0)
+            {
+                request->commandLine = value;
+            }
+        }
+
+        lineStart = lineEnd ? lineEnd + 1 : NULL;
+    }
+
+    return request->commandLine != NULL;
+}
+
+/*
+ * Points fds 0-2 (and the Win32 standard handles the spawn path reads)
+ * at the client's streams. Takes ownership of the request's handles.
+ */
+static void redirectStandardStreams(SessionRequest* request, int* savedFds)
+{
+    fflush(stdout);
+    fflush(stderr);
+
+    for (int i = 0; i < STANDARD_STREAM_COUNT; i++)
+    {
+        savedFds[i] = _dup(i);
+        if (request->stdHandles[i] == NULL) continue;
+
+        int sessionFd = _open_osfhandle((intptr_t)request->stdHandles[i],
+            i == 0 ? _O_RDONLY : _O_WRONLY);
+        if (sessionFd >= 0)
+        {
+            _dup2(sessionFd, i);
+            _close(sessionFd);
+        }
+        else
+        {
+            CloseHandle(request->stdHandles[i]);
+        }
+        request->stdHandles[i] = NULL;
+        SetStdHandle(standardHandleIds[i], (HANDLE)_get_osfhandle(i));
+    }
+    clearerr(stdin);
+}
+
+static void restoreStandardStreams(int* savedFds)
+{
+    fflush(stdout);
+    fflush(stderr);
+
+    for (int i = 0; i < STANDARD_STREAM_COUNT; i++)
+    {
+        if (savedFds[i] >= 0)
+        {
+            _dup2(savedFds[i], i);
+            _close(savedFds[i]);
+        }
+        SetStdHandle(standardHandleIds[i], (HANDLE)_get_osfhandle(i));
+    }
+    clearerr(stdin);
+}
+
+/*
+ * Everything a command line can change for later ones (variables and
+ * their export flags, ulimit values, "enable" modules, the working
+ * directory) is saved first and put back afterwards, so each session
+ * starts from the daemon's own state.
+ */
+static int runSessionRequest(SessionRequest* request, char** pathList)
+{
+    char savedDirectory[MAX_PATH];
+    int savedFds[STANDARD_STREAM_COUNT];
+    ResourceLimits savedLimits;
+    int status = EXIT_FAILURE;
+
+    EnterCriticalSection(&shellStateLock);
+
+    GetCurrentDirectoryA(sizeof(savedDirectory), savedDirectory);
+    saveResourceLimits(&savedLimits);
+    EnvironmentSnapshot* savedVariables = saveEnvironmentVariables();
+    BuiltinRegistrySnapshot* savedBuiltins = saveBuiltinRegistry();
+    redirectStandardStreams(request, savedFds);
+
+    if (savedVariables == NULL || savedBuiltins == NULL)
+    {
+        fprintf(stderr, "xsh: cannot save shell state for this session\n");
+    }
+    else if (request->workingDirectory != NULL &&
+        !SetCurrentDirectoryA(request->workingDirectory))
+    {
+        fprintf(stderr, "xsh: cannot change directory to %s\n",
+            request->workingDirectory);
+    }
+    else
+    {
+        for (int i = 0; i < request->variableCount; i++)
+        {
+            addEnvironmentVariable(request->variableNames[i],
+                request->variableValues[i]);
+        }
+
+        status = parseAndExecuteCommandPipeline(request->commandLine, pathList);
+    }
+
+    restoreStandardStreams(savedFds);
+    if (savedBuiltins != NULL)
+    {
+        restoreBuiltinRegistry(savedBuiltins);
+    }
+    if (savedVariables != NULL)
+    {
+        restoreEnvironmentVariables(savedVariables);
+    }
+    restoreResourceLimits(&savedLimits);
+    SetCurrentDirectoryA(savedDirectory);
+
+    LeaveCriticalSection(&shellStateLock);
+    return status;
+}
+
+static DWORD WINAPI serveSession(LPVOID param)
+{
+    SessionContext* context = (SessionContext*)param;
+    char* requestText = (char*)malloc(MAX_REQUEST_LENGTH + 1);
+    int status = EXIT_FAILURE;
+
+    /* The peer pid comes from the kernel, not from anything the client says. */
+    ULONG clientPid = 0;
+    DWORD returnedBytes = 0;
+    if (requestText != NULL &&
+        WSAIoctl(context->connection, SIO_AF_UNIX_GETPEERPID, NULL, 0,
+            &clientPid, sizeof(clientPid), &returnedBytes, NULL, NULL) == 0)
+    {
+        HANDLE clientProcess = OpenProcess(
+            PROCESS_DUP_HANDLE | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, clientPid);
+        if (clientProcess != NULL && !isDaemonUser(clientProcess))
+        {
+            fprintf(stderr, "xsh daemon: rejected client %lu running as another user\n",
+                clientPid);
+            CloseHandle(clientProcess);
+        }
+        else if (clientProcess != NULL)
+        {
+            SessionRequest request;
+            ZeroMemory(&request, sizeof(request));
+            if (receiveRequest(context->connection, requestText,
+                MAX_REQUEST_LENGTH) > 0 &&
+                parseSessionRequest(requestText, clientProcess, &request))
+            {
+                status = runSessionRequest(&request, context->pathList);
+            }
+            closeRequestHandles(&request);
+            CloseHandle(clientProcess);
+        }
+    }
+
+    char reply[32];
+    _snprintf_s(reply, sizeof(reply), _TRUNCATE, "status %d\n", status);
+    send(context->connection, reply, (int)strlen(reply), 0);
+
+    closesocket(context->connection);
+    free(requestText);
+    free(context);
+    ReleaseSemaphore(sessionSlots, 1, NULL);
+    return 0;
+}
+
+/*
+ * Serves command lines from thin clients ("xsh --submit") over an AF_UNIX
+ * socket, reusing this process's PATH list, command cache and variables.
+ * Command lines run one at a time. At most maxSessions connections are
+ * accepted and waiting for their turn; further clients wait in the listen
+ * backlog.
+ */
+int runShellDaemon(const char* socketPath, int maxSessions, char** pathList)
+{
+    daemonUser = readProcessUser(GetCurrentProcess());
+    if (daemonUser == NULL)
+    {
+        fprintf(stderr, "Failed to read the daemon's user\n");
+        return EXIT_FAILURE;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        fprintf(stderr, "WSAStartup failed\n");
+        free(daemonUser);
+        return EXIT_FAILURE;
+    }
+
+    SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET)
+    {
+        fprintf(stderr, "Failed to create daemon socket\n");
+        WSACleanup();
+        free(daemonUser);
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_un address;
+    ZeroMemory(&address, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy_s(address.sun_path, sizeof(address.sun_path), socketPath, _TRUNCATE);
+
+    DeleteFileA(socketPath);
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+        !restrictSocketToOwner(socketPath) ||
+        listen(listener, SOMAXCONN) == SOCKET_ERROR)
+    {
+        fprintf(stderr, "Failed to listen on %s\n", socketPath);
+        closesocket(listener);
+        DeleteFileA(socketPath);
+        WSACleanup();
+        free(daemonUser);
+        return EXIT_FAILURE;
+    }
+
+    InitializeCriticalSection(&shellStateLock);
+    sessionSlots = CreateSemaphoreA(NULL, maxSessions, maxSessions, NULL);
+    if (sessionSlots == NULL)
+    {
+        fprintf(stderr, "Failed to create session semaphore\n");
+        closesocket(listener);
+        WSACleanup();
+        free(daemonUser);
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * Background jobs outlive the session that started them and are reaped
+     * during some later one, when fds 0-2 belong to another client. Their
+     * "[N] Done" lines go to a private copy of the daemon's own stderr.
+     */
+    int daemonLogFd = _dup(2);
+    FILE* daemonLog = daemonLogFd >= 0 ? _fdopen(daemonLogFd, "w") : NULL;
+    if (daemonLog == NULL)
+    {
+        fprintf(stderr, "Failed to open the daemon's job log\n");
+        if (daemonLogFd >= 0)
+        {
+            _close(daemonLogFd);
+        }
+        CloseHandle(sessionSlots);
+        closesocket(listener);
+        DeleteFileA(socketPath);
+        WSACleanup();
+        free(daemonUser);
+        return EXIT_FAILURE;
+    }
+    setJobNotificationStream(daemonLog);
+
+    printf("xsh daemon listening on %s (%d sessions)\n", socketPath, maxSessions);
+    fflush(stdout);
+
+    while (1)
+    {
+        WaitForSingleObject(sessionSlots, INFINITE);
+
+        SOCKET connection = accept(listener, NULL, NULL);
+        if (connection == INVALID_SOCKET)
+        {
+            fprintf(stderr, "accept failed on %s\n", socketPath);
+            ReleaseSemaphore(sessionSlots, 1, NULL);
+            break;
+        }
+
+        SessionContext* context = (SessionContext*)malloc(sizeof(SessionContext));
+        if (!context)
+        {
+            closesocket(connection);
+            ReleaseSemaphore(sessionSlots, 1, NULL);
+            continue;
+        }
+        context->connection = connection;
+        context->pathList = pathList;
+
+        HANDLE sessionThread = CreateThread(NULL, 0, serveSession, context, 0, NULL);
+        if (sessionThread == NULL)
+        {
+            serveSession(context);
+        }
+        else
+        {
+            CloseHandle(sessionThread);
+        }
+    }
+
+    closesocket(listener);
+    DeleteFileA(socketPath);
+    WSACleanup();
+    return EXIT_FAILURE;
+}
+
+/*
+ * Thin client: argv holds optional "-v NAME=VALUE" pairs followed by the
+ * command words. Our own stdio handles are named in the request and the
+ * daemon duplicates them out of this process. Exits with the remote status.
+ */
+int submitToShellDaemon(const char* socketPath, int argc, char** argv)
+{
+    char* requestText = (char*)malloc(MAX_REQUEST_LENGTH);
+    if (!requestText)
+    {
+        fprintf(stderr, "Memory allocation failed in submitToShellDaemon.\n");
+        return EXIT_FAILURE;
+    }
+    requestText[0] = '\0';
+
+    char line[4096];
+    for (int i = 0; i < STANDARD_STREAM_COUNT; i++)
+    {
+        _snprintf_s(line, sizeof(line), _TRUNCATE, "%s %llu\n",
+            standardStreamNames[i],
+            (unsigned long long)(ULONG_PTR)GetStdHandle(standardHandleIds[i]));
+        strncat_s(requestText, MAX_REQUEST_LENGTH, line, _TRUNCATE);
+    }
+
+    char cwdBuf[MAX_PATH];
+    if (GetCurrentDirectoryA(sizeof(cwdBuf), cwdBuf) > 0)
+    {
+        _snprintf_s(line, sizeof(line), _TRUNCATE, "cwd %s\n", cwdBuf);
+        strncat_s(requestText, MAX_REQUEST_LENGTH, line, _TRUNCATE);
+    }
+
+    int argI = 0;
+    while (argI + 1 < argc && strcmp(argv[argI], "-v") == 0)
+    {
+        char* separator = strchr(argv[argI + 1], '=');
+        if (separator != NULL)
+        {
+            _snprintf_s(line, sizeof(line), _TRUNCATE, "var %.*s %s\n",
+                (int)(separator - argv[argI + 1]), argv[argI + 1], separator + 1);
+            strncat_s(requestText, MAX_REQUEST_LENGTH, line, _TRUNCATE);
+        }
+        argI += 2;
+    }
+
+    if (argI >= argc)
+    {
+        fprintf(stderr, "xsh --submit: missing command\n");
+        free(requestText);
+        return EXIT_FAILURE;
+    }
+
+    strncat_s(requestText, MAX_REQUEST_LENGTH, "run", _TRUNCATE);
+    for (; argI < argc; argI++)
+    {
+        strncat_s(requestText, MAX_REQUEST_LENGTH, " ", _TRUNCATE);
+        strncat_s(requestText, MAX_REQUEST_LENGTH, argv[argI], _TRUNCATE);
+    }
+    strncat_s(requestText, MAX_REQUEST_LENGTH, "\n", _TRUNCATE);
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        fprintf(stderr, "WSAStartup failed\n");
+        free(requestText);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_FAILURE;
+    SOCKET connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    ZeroMemory(&address, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy_s(address.sun_path, sizeof(address.sun_path), socketPath, _TRUNCATE);
+
+    if (connection == INVALID_SOCKET ||
+        connect(connection, (struct sockaddr*)&address, sizeof(address)) == SOCKET_ERROR)
+    {
+        fprintf(stderr, "xsh: cannot connect to daemon at %s\n", socketPath);
+    }
+    else
+    {
+        int requestLength = (int)strlen(requestText);
+        int sent = 0;
+        while (sent < requestLength)
+        {
+            int chunk = send(connection, requestText + sent, requestLength - sent, 0);
+            if (chunk == SOCKET_ERROR) break;
+            sent += chunk;
+        }
+        shutdown(connection, SD_SEND);
+
+        char reply[64];
+        if (receiveRequest(connection, reply, sizeof(reply) - 1) > 0 &&
+            strncmp(reply, "status ", 7) == 0)
+        {
+            status = atoi(reply + 7);
+        }
+    }
+
+    if (connection != INVALID_SOCKET)
+    {
+        closesocket(connection);
+    }
+    WSACleanup();
+    free(requestText);
+    return status;
+}
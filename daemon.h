@@ -0,0 +1,7 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+int runShellDaemon(const char* socketPath, int maxSessions, char** pathList);
+int submitToShellDaemon(const char* socketPath, int argc, char** argv);
+
+#endif
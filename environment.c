@@ -2,8 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <windows.h>
 
 #include "environment.h"
+#include "allocation.h"
 
 #ifndef MAX_VARIABLE_NAME_LENGTH
 #define MAX_VARIABLE_NAME_LENGTH 256
@@ -13,19 +15,49 @@ typedef struct EnvironmentVariableEntry
 {
     char* variableName;
     char* variableValue;
+    int exported;
     struct EnvironmentVariableEntry* nextEntry;
 } EnvironmentVariableEntry;
 
 static EnvironmentVariableEntry* globalEnvironmentList = NULL;
 
+struct EnvironmentSnapshot
+{
+    EnvironmentVariableEntry* savedList;
+};
+
+/*
+ * Bumped whenever an exported variable is created, changed or removed, so
+ * the environment block handed to children is only rebuilt when it would
+ * actually differ from the cached one.
+ */
+static unsigned long exportGeneration = 1;
+static unsigned long childBlockGeneration = 0;
+static char* childEnvironmentBlock = NULL;
+
+/* Bumped whenever PATH may have changed; see getPathGeneration. */
+static unsigned long pathGeneration = 1;
+
+static void notePathChange(const char* name)
+{
+    if (_stricmp(name, "PATH") == 0)
+    {
+        pathGeneration++;
+    }
+}
+
+unsigned long getPathGeneration(void)
+{
+    return pathGeneration;
+}
+
 void initializeEnvironmentVariables(void)
 {
     globalEnvironmentList = NULL;
 }
 
-void cleanupEnvironmentVariables(void)
+static void freeEnvironmentList(EnvironmentVariableEntry* currentEntry)
 {
-    EnvironmentVariableEntry* currentEntry = globalEnvironmentList;
     while (currentEntry != NULL)
     {
         EnvironmentVariableEntry* nextEntry = currentEntry->nextEntry;
@@ -34,12 +66,54 @@ void cleanupEnvironmentVariables(void)
         free(currentEntry);
         currentEntry = nextEntry;
     }
+}
+
+void cleanupEnvironmentVariables(void)
+{
+    freeEnvironmentList(globalEnvironmentList);
     globalEnvironmentList = NULL;
+
+    free(childEnvironmentBlock);
+    childEnvironmentBlock = NULL;
+    childBlockGeneration = 0;
+    exportGeneration++;
+}
+
+static EnvironmentVariableEntry* findEnvironmentEntry(const char* name)
+{
+    EnvironmentVariableEntry* currentEntry = globalEnvironmentList;
+    while (currentEntry != NULL)
+    {
+        if (_stricmp(currentEntry->variableName, name) == 0)
+        {
+            return currentEntry;
+        }
+        currentEntry = currentEntry->nextEntry;
+    }
+    return NULL;
 }
 
+/* Existing variables are updated in place so they keep their export flag. */
 void addEnvironmentVariable(const char* name, const char* value)
 {
-    removeEnvironmentVariable(name);
+    notePathChange(name);
+    EnvironmentVariableEntry* existingEntry = findEnvironmentEntry(name);
+    if (existingEntry != NULL)
+    {
+        char* newValue = _strdup(value);
+        if (!newValue)
+        {
+            fprintf(stderr, "Memory allocation failed in addEnvironmentVariable.\n");
+            return;
+        }
+        free(existingEntry->variableValue);
+        existingEntry->variableValue = newValue;
+        if (existingEntry->exported)
+        {
+            exportGeneration++;
+        }
+        return;
+    }
 
     EnvironmentVariableEntry* newEntry;
     newEntry = (EnvironmentVariableEntry*)malloc(sizeof(EnvironmentVariableEntry));
@@ -51,12 +125,14 @@ void addEnvironmentVariable(const char* name, const char* value)
 
     newEntry->variableName = _strdup(name);
     newEntry->variableValue = _strdup(value);
+    newEntry->exported = 0;
     newEntry->nextEntry = globalEnvironmentList;
     globalEnvironmentList = newEntry;
 }
 
 void removeEnvironmentVariable(const char* name)
 {
+    notePathChange(name);
     EnvironmentVariableEntry* prevEntry = NULL;
     EnvironmentVariableEntry* currentEntry = globalEnvironmentList;
     while (currentEntry != NULL)
@@ -71,6 +147,10 @@ void removeEnvironmentVariable(const char* name)
             {
                 globalEnvironmentList = currentEntry->nextEntry;
             }
+            if (currentEntry->exported)
+            {
+                exportGeneration++;
+            }
             free(currentEntry->variableName);
             free(currentEntry->variableValue);
             free(currentEntry);
@@ -83,14 +163,233 @@ void removeEnvironmentVariable(const char* name)
 
 const char* getEnvironmentVariableValue(const char* name)
 {
-    EnvironmentVariableEntry* currentEntry = globalEnvironmentList;
-    while (currentEntry != NULL)
+    EnvironmentVariableEntry* entry = findEnvironmentEntry(name);
+    return entry ? entry->variableValue : NULL;
+}
+
+/* Exporting a name that was never set creates it with an empty value. */
+int exportEnvironmentVariable(const char* name)
+{
+    EnvironmentVariableEntry* entry = findEnvironmentEntry(name);
+    if (entry == NULL)
     {
-        if (_stricmp(currentEntry->variableName, name) == 0)
+        addEnvironmentVariable(name, "");
+        entry = findEnvironmentEntry(name);
+        if (entry == NULL)
         {
-            return currentEntry->variableValue;
+            return 0;
         }
-        currentEntry = currentEntry->nextEntry;
     }
-    return NULL;
+
+    if (!entry->exported)
+    {
+        entry->exported = 1;
+        exportGeneration++;
+        notePathChange(name);
+    }
+    return 1;
+}
+
+int isEnvironmentVariableExported(const char* name)
+{
+    EnvironmentVariableEntry* entry = findEnvironmentEntry(name);
+    return entry ? entry->exported : 0;
+}
+
+/*
+ * Copies every variable with its export flag, so a daemon session can
+ * run "set", "export" and "unset" and leave no trace for the next one.
+ */
+EnvironmentSnapshot* saveEnvironmentVariables(void)
+{
+    EnvironmentSnapshot* snapshot = (EnvironmentSnapshot*)malloc(sizeof(EnvironmentSnapshot));
+    if (!snapshot)
+    {
+        fprintf(stderr, "Memory allocation failed in saveEnvironmentVariables.\n");
+        return NULL;
+    }
+    snapshot->savedList = NULL;
+
+    EnvironmentVariableEntry** tail = &snapshot->savedList;
+    for (EnvironmentVariableEntry* entry = globalEnvironmentList; entry; entry = entry->nextEntry)
+    {
+        EnvironmentVariableEntry* copy = (EnvironmentVariableEntry*)malloc(sizeof(EnvironmentVariableEntry));
+        char* copiedName = _strdup(entry->variableName);
+        char* copiedValue = _strdup(entry->variableValue);
+        if (!copy || !copiedName || !copiedValue)
+        {
+            fprintf(stderr, "Memory allocation failed in saveEnvironmentVariables.\n");
+            free(copy);
+            free(copiedName);
+            free(copiedValue);
+            freeEnvironmentList(snapshot->savedList);
+            free(snapshot);
+            return NULL;
+        }
+        copy->variableName = copiedName;
+        copy->variableValue = copiedValue;
+        copy->exported = entry->exported;
+        copy->nextEntry = NULL;
+        *tail = copy;
+        tail = &copy->nextEntry;
+    }
+    return snapshot;
+}
+
+/* Replaces the whole store with the snapshot and frees the snapshot. */
+void restoreEnvironmentVariables(EnvironmentSnapshot* snapshot)
+{
+    freeEnvironmentList(globalEnvironmentList);
+    globalEnvironmentList = snapshot->savedList;
+    exportGeneration++;
+    pathGeneration++;
+    free(snapshot);
+}
+
+static int compareEnvironmentStrings(const void* left, const void* right)
+{
+    const char* leftText = *(const char* const*)left;
+    const char* rightText = *(const char* const*)right;
+    return _stricmp(leftText, rightText);
+}
+
+/* Length of the name in NAME=VALUE; per-drive entries ("=C:=...") keep the leading '='. */
+static size_t environmentNameLength(const char* entryText)
+{
+    const char* separator = strchr(entryText + 1, '=');
+    return separator ? (size_t)(separator - entryText) : strlen(entryText);
+}
+
+static char* buildChildEnvironmentBlock(void)
+{
+    char* inherited = GetEnvironmentStringsA();
+    if (!inherited)
+    {
+        return NULL;
+    }
+
+    int inheritedCount = 0;
+    for (const char* cursor = inherited; *cursor; cursor += strlen(cursor) + 1)
+    {
+        inheritedCount++;
+    }
+    int exportedCount = 0;
+    for (EnvironmentVariableEntry* entry = globalEnvironmentList; entry; entry = entry->nextEntry)
+    {
+        if (entry->exported) exportedCount++;
+    }
+
+    char** entries = (char**)malloc((inheritedCount + exportedCount + 1) * sizeof(char*));
+    if (!entries)
+    {
+        FreeEnvironmentStringsA(inherited);
+        return NULL;
+    }
+
+    int entryCount = 0;
+    size_t blockSize = 1;
+    for (const char* cursor = inherited; *cursor; cursor += strlen(cursor) + 1)
+    {
+        size_t nameLength = environmentNameLength(cursor);
+        char name[MAX_VARIABLE_NAME_LENGTH];
+        if (cursor[0] != '=' && nameLength < sizeof(name))
+        {
+            memcpy(name, cursor, nameLength);
+            name[nameLength] = '\0';
+            EnvironmentVariableEntry* override = findEnvironmentEntry(name);
+            if (override != NULL && override->exported)
+            {
+                continue;
+            }
+        }
+        entries[entryCount++] = (char*)cursor;
+        blockSize += strlen(cursor) + 1;
+    }
+
+    char* exportedText = NULL;
+    size_t exportedSize = 0;
+    for (EnvironmentVariableEntry* entry = globalEnvironmentList; entry; entry = entry->nextEntry)
+    {
+        if (entry->exported)
+        {
+            exportedSize += strlen(entry->variableName) + strlen(entry->variableValue) + 2;
+        }
+    }
+    if (exportedSize > 0)
+    {
+        exportedText = (char*)malloc(exportedSize);
+        if (!exportedText)
+        {
+            free(entries);
+            FreeEnvironmentStringsA(inherited);
+            return NULL;
+        }
+        char* writeCursor = exportedText;
+        for (EnvironmentVariableEntry* entry = globalEnvironmentList; entry; entry = entry->nextEntry)
+        {
+            if (!entry->exported) continue;
+            size_t written = (size_t)sprintf(writeCursor, "%s=%s",
+                entry->variableName, entry->variableValue);
+            entries[entryCount++] = writeCursor;
+            blockSize += written + 1;
+            writeCursor += written + 1;
+        }
+    }
+
+    /* CreateProcess expects the block sorted by name, case-insensitively. */
+    qsort(entries, entryCount, sizeof(char*), compareEnvironmentStrings);
+
+    char* block = (char*)malloc(blockSize);
+    if (block)
+    {
+        char* writeCursor = block;
+        for (int i = 0; i < entryCount; i++)
+        {
+            size_t length = strlen(entries[i]) + 1;
+            memcpy(writeCursor, entries[i], length);
+            writeCursor += length;
+        }
+        *writeCursor = '\0';
+    }
+
+    free(exportedText);
+    free(entries);
+    FreeEnvironmentStringsA(inherited);
+    return block;
+}
+
+/*
+ * Returns the environment block for child processes, or NULL when nothing
+ * is exported and children can simply inherit ours. The block stays owned
+ * by this module and is valid until the next exported change.
+ */
+const char* getChildEnvironmentBlock(void)
+{
+    int anyExported = 0;
+    for (EnvironmentVariableEntry* entry = globalEnvironmentList; entry; entry = entry->nextEntry)
+    {
+        if (entry->exported)
+        {
+            anyExported = 1;
+            break;
+        }
+    }
+    if (!anyExported)
+    {
+        return NULL;
+    }
+
+    if (childEnvironmentBlock == NULL || childBlockGeneration != exportGeneration)
+    {
+        char* rebuilt = buildChildEnvironmentBlock();
+        if (!rebuilt)
+        {
+            fprintf(stderr, "Memory allocation failed in getChildEnvironmentBlock.\n");
+            return childEnvironmentBlock;
+        }
+        free(childEnvironmentBlock);
+        childEnvironmentBlock = rebuilt;
+        childBlockGeneration = exportGeneration;
+    }
+    return childEnvironmentBlock;
 }
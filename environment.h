@@ -9,4 +9,16 @@ void addEnvironmentVariable(const char* name, const char* value);
 void removeEnvironmentVariable(const char* name);
 const char* getEnvironmentVariableValue(const char* name);
 
+int exportEnvironmentVariable(const char* name);
+int isEnvironmentVariableExported(const char* name);
+const char* getChildEnvironmentBlock(void);
+
+/* Changes whenever PATH is set, exported, unset or restored. */
+unsigned long getPathGeneration(void);
+
+typedef struct EnvironmentSnapshot EnvironmentSnapshot;
+
+EnvironmentSnapshot* saveEnvironmentVariables(void);
+void restoreEnvironmentVariables(EnvironmentSnapshot* snapshot);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,158 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "fanout.h"
+#include "allocation.h"
+
+#ifndef FANOUT_BUFFER_SIZE
+#define FANOUT_BUFFER_SIZE (64 * 1024)
+#endif
+
+#ifndef MAX_FANOUT_SINKS
+#define MAX_FANOUT_SINKS 19
+#endif
+
+/*
+ * Copies one producer's output to every consumer of a "|+" fan-out. Like
+ * the throughput meter it is shared by its thread and the shell, and
+ * whichever lets go last frees it.
+ */
+struct FanoutRelay
+{
+    HANDLE source;
+    HANDLE sinks[MAX_FANOUT_SINKS];
+    int sinkCount;
+    HANDLE thread;
+    volatile LONG references;
+};
+
+static void releaseFanoutRelay(FanoutRelay* relay)
+{
+    if (InterlockedDecrement(&relay->references) == 0)
+    {
+        free(relay);
+    }
+}
+
+/*
+ * Each chunk is written to every sink before the next one is read, so the
+ * slowest consumer sets the pace: its full pipe blocks us, and our full
+ * source pipe in turn blocks the producer. Memory use stays at one buffer
+ * however far apart the consumers drift. A consumer that exits is dropped
+ * and the rest carry on; once none are left the producer sees a broken
+ * pipe.
+ */
+static DWORD WINAPI relayToAllSinks(LPVOID param)
+{
+    FanoutRelay* relay = (FanoutRelay*)param;
+    char* buffer = (char*)malloc(FANOUT_BUFFER_SIZE);
+    int liveSinks = relay->sinkCount;
+
+    while (buffer != NULL && liveSinks > 0)
+    {
+        DWORD readCount = 0;
+        if (!ReadFile(relay->source, buffer, FANOUT_BUFFER_SIZE, &readCount, NULL) ||
+            readCount == 0)
+        {
+            break;
+        }
+
+        for (int sinkI = 0; sinkI < relay->sinkCount; sinkI++)
+        {
+            if (relay->sinks[sinkI] == NULL) continue;
+
+            DWORD writtenTotal = 0;
+            BOOL writeOk = TRUE;
+            while (writeOk && writtenTotal < readCount)
+            {
+                DWORD written = 0;
+                writeOk = WriteFile(relay->sinks[sinkI], buffer + writtenTotal,
+                    readCount - writtenTotal, &written, NULL);
+                writtenTotal += written;
+            }
+            if (!writeOk)
+            {
+                CloseHandle(relay->sinks[sinkI]);
+                relay->sinks[sinkI] = NULL;
+                liveSinks--;
+            }
+        }
+    }
+
+    CloseHandle(relay->source);
+    for (int sinkI = 0; sinkI < relay->sinkCount; sinkI++)
+    {
+        if (relay->sinks[sinkI] != NULL)
+        {
+            CloseHandle(relay->sinks[sinkI]);
+        }
+    }
+    free(buffer);
+
+    releaseFanoutRelay(relay);
+    return 0;
+}
+
+/* Takes ownership of source and sinks; all must be non-inheritable. */
+FanoutRelay* startFanoutRelay(HANDLE source, const HANDLE* sinks, int sinkCount)
+{
+    if (sinkCount < 1 || sinkCount > MAX_FANOUT_SINKS)
+    {
+        fprintf(stderr, "Fan-out needs between 1 and %d consumers\n",
+            MAX_FANOUT_SINKS);
+        return NULL;
+    }
+
+    FanoutRelay* relay = (FanoutRelay*)calloc(1, sizeof(FanoutRelay));
+    if (!relay)
+    {
+        fprintf(stderr, "Memory allocation failed in startFanoutRelay.\n");
+        return NULL;
+    }
+
+    relay->source = source;
+    memcpy(relay->sinks, sinks, sinkCount * sizeof(HANDLE));
+    relay->sinkCount = sinkCount;
+    relay->references = 2;
+
+    relay->thread = CreateThread(NULL, 0, relayToAllSinks, relay, 0, NULL);
+    if (relay->thread == NULL)
+    {
+        fprintf(stderr, "Failed to start fan-out thread\n");
+        free(relay);
+        return NULL;
+    }
+    return relay;
+}
+
+void finishFanoutRelay(FanoutRelay* relay)
+{
+    if (!relay) return;
+
+    WaitForSingleObject(relay->thread, INFINITE);
+    CloseHandle(relay->thread);
+    releaseFanoutRelay(relay);
+}
+
+void detachFanoutRelay(FanoutRelay* relay)
+{
+    if (!relay) return;
+
+    CloseHandle(relay->thread);
+    releaseFanoutRelay(relay);
+}
+
+/* Used on pipeline setup failure, when the stages may never connect. */
+void abandonFanoutRelay(FanoutRelay* relay)
+{
+    if (!relay) return;
+
+    CancelSynchronousIo(relay->thread);
+    detachFanoutRelay(relay);
+}
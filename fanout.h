@@ -0,0 +1,13 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <windows.h>
+
+typedef struct FanoutRelay FanoutRelay;
+
+FanoutRelay* startFanoutRelay(HANDLE source, const HANDLE* sinks, int sinkCount);
+void finishFanoutRelay(FanoutRelay* relay);
+void detachFanoutRelay(FanoutRelay* relay);
+void abandonFanoutRelay(FanoutRelay* relay);
+
+#endif
@@ -0,0 +1,430 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "joblog.h"
+#include "environment.h"
+#include "resource.h"
+#include "allocation.h"
+
+#ifndef JOB_CAPTURE_VARIABLE
+#define JOB_CAPTURE_VARIABLE "XSH_JOB_CAPTURE"
+#endif
+
+#ifndef JOB_CAPTURE_MAX_VARIABLE
+#define JOB_CAPTURE_MAX_VARIABLE "XSH_JOB_CAPTURE_MAX"
+#endif
+
+#ifndef DEFAULT_JOB_CAPTURE_MAX_BYTES
+#define DEFAULT_JOB_CAPTURE_MAX_BYTES (16ULL * 1024 * 1024)
+#endif
+
+#ifndef MAX_JOB_OUTPUT_LOGS
+#define MAX_JOB_OUTPUT_LOGS 64
+#endif
+
+#ifndef JOB_LOG_READ_CHUNK
+#define JOB_LOG_READ_CHUNK 4096
+#endif
+
+/*
+ * The last capacity bytes a background job wrote to stdout and stderr.
+ * Like the fan-out relay it is shared by its drain thread and the shell,
+ * and whichever lets go last frees it. The shell keeps its reference while
+ * the log is listed here, after the job is done too, so "joblog" still
+ * works once "[n]  Done" has been printed.
+ */
+struct JobOutputLog
+{
+    int jobId;
+    unsigned long long sequence;
+    HANDLE readEnd;
+    HANDLE writeEnd;
+    HANDLE thread;
+    CRITICAL_SECTION lock;
+    char* data;
+    size_t capacity;
+    unsigned long long totalBytes;
+    volatile LONG finished;
+    volatile LONG abandoned;
+    volatile LONG references;
+};
+
+static JobOutputLog* jobOutputLogs[MAX_JOB_OUTPUT_LOGS];
+static unsigned long long reservedLogBytes = 0;
+static unsigned long long nextLogSequence = 1;
+
+static void releaseJobOutputLog(JobOutputLog* log)
+{
+    if (InterlockedDecrement(&log->references) == 0)
+    {
+        DeleteCriticalSection(&log->lock);
+        free(log->data);
+        free(log);
+    }
+}
+
+static void appendToJobOutputLog(JobOutputLog* log, const char* bytes, size_t count)
+{
+    EnterCriticalSection(&log->lock);
+    if (count > log->capacity)
+    {
+        log->totalBytes += count - log->capacity;
+        bytes += count - log->capacity;
+        count = log->capacity;
+    }
+    size_t offset = (size_t)(log->totalBytes % log->capacity);
+    size_t firstPart = log->capacity - offset;
+    if (firstPart > count)
+    {
+        firstPart = count;
+    }
+    memcpy(log->data + offset, bytes, firstPart);
+    memcpy(log->data, bytes + firstPart, count - firstPart);
+    log->totalBytes += count;
+    LeaveCriticalSection(&log->lock);
+}
+
+/* Runs until every stage of the job has closed its end of the pipe. */
+static DWORD WINAPI drainJobOutput(LPVOID param)
+{
+    JobOutputLog* log = (JobOutputLog*)param;
+    char chunk[JOB_LOG_READ_CHUNK];
+
+    while (!log->abandoned)
+    {
+        DWORD readCount = 0;
+        if (!ReadFile(log->readEnd, chunk, sizeof(chunk), &readCount, NULL) ||
+            readCount == 0)
+        {
+            break;
+        }
+        appendToJobOutputLog(log, chunk, readCount);
+    }
+
+    CloseHandle(log->readEnd);
+    InterlockedExchange(&log->finished, 1);
+    releaseJobOutputLog(log);
+    return 0;
+}
+
+static void unlistJobOutputLog(JobOutputLog* log)
+{
+    for (int logI = 0; logI < MAX_JOB_OUTPUT_LOGS; logI++)
+    {
+        if (jobOutputLogs[logI] == log)
+        {
+            jobOutputLogs[logI] = NULL;
+            reservedLogBytes -= log->capacity;
+        }
+    }
+}
+
+/*
+ * Drops the logs of finished jobs, oldest first, until capacity more
+ * bytes fit under limit and a slot is free. Logs still being written are
+ * never dropped. Returns the free slot, or -1.
+ */
+static int makeRoomForJobOutputLog(size_t capacity, unsigned long long limit)
+{
+    while (1)
+    {
+        int freeSlot = -1;
+        int oldestFinished = -1;
+        for (int logI = 0; logI < MAX_JOB_OUTPUT_LOGS; logI++)
+        {
+            JobOutputLog* log = jobOutputLogs[logI];
+            if (log == NULL)
+            {
+                freeSlot = logI;
+            }
+            else if (log->finished && log->jobId != 0 && (oldestFinished < 0 ||
+                log->sequence < jobOutputLogs[oldestFinished]->sequence))
+            {
+                oldestFinished = logI;
+            }
+        }
+
+        if (freeSlot >= 0 && reservedLogBytes + capacity <= limit)
+        {
+            return freeSlot;
+        }
+        if (oldestFinished < 0)
+        {
+            return -1;
+        }
+        discardJobOutputLog(jobOutputLogs[oldestFinished]);
+    }
+}
+
+/*
+ * Starts capturing for a background job when XSH_JOB_CAPTURE gives a
+ * per-job size. The caller hands getJobOutputLogWriter to every stage as
+ * stderr, and as stdout where it would otherwise be the terminal. NULL
+ * means the job writes to the terminal as before.
+ */
+JobOutputLog* startJobOutputLog(void)
+{
+    const char* sizeText = getEnvironmentVariableValue(JOB_CAPTURE_VARIABLE);
+    if (sizeText == NULL || sizeText[0] == '\0')
+    {
+        return NULL;
+    }
+
+    unsigned long long capacity = 0;
+    if (!parseSizeWithSuffix(sizeText, &capacity) || capacity == 0)
+    {
+        fprintf(stderr, "%s: invalid size: %s\n", JOB_CAPTURE_VARIABLE, sizeText);
+        return NULL;
+    }
+    unsigned long long limit = DEFAULT_JOB_CAPTURE_MAX_BYTES;
+    const char* limitText = getEnvironmentVariableValue(JOB_CAPTURE_MAX_VARIABLE);
+    if (limitText != NULL && !parseSizeWithSuffix(limitText, &limit))
+    {
+        fprintf(stderr, "%s: invalid size: %s\n", JOB_CAPTURE_MAX_VARIABLE, limitText);
+        return NULL;
+    }
+    if (capacity > limit)
+    {
+        capacity = limit;
+    }
+
+    int slot = capacity > 0 ? makeRoomForJobOutputLog((size_t)capacity, limit) : -1;
+    if (slot < 0)
+    {
+        fprintf(stderr, "%s reached, this job writes to the terminal\n",
+            JOB_CAPTURE_MAX_VARIABLE);
+        return NULL;
+    }
+
+    JobOutputLog* log = (JobOutputLog*)calloc(1, sizeof(JobOutputLog));
+    char* data = (char*)malloc((size_t)capacity);
+    if (!log || !data)
+    {
+        fprintf(stderr, "Memory allocation failed in startJobOutputLog.\n");
+        free(log);
+        free(data);
+        return NULL;
+    }
+    if (!CreatePipe(&log->readEnd, &log->writeEnd, NULL, 0))
+    {
+        fprintf(stderr, "CreatePipe failed\n");
+        free(log);
+        free(data);
+        return NULL;
+    }
+
+    InitializeCriticalSection(&log->lock);
+    log->data = data;
+    log->capacity = (size_t)capacity;
+    log->sequence = nextLogSequence++;
+    log->references = 2;
+
+    log->thread = CreateThread(NULL, 0, drainJobOutput, log, 0, NULL);
+    if (log->thread == NULL)
+    {
+        fprintf(stderr, "Failed to start job output thread\n");
+        CloseHandle(log->readEnd);
+        CloseHandle(log->writeEnd);
+        DeleteCriticalSection(&log->lock);
+        free(data);
+        free(log);
+        return NULL;
+    }
+
+    jobOutputLogs[slot] = log;
+    reservedLogBytes += log->capacity;
+    return log;
+}
+
+HANDLE getJobOutputLogWriter(const JobOutputLog* log)
+{
+    return log->writeEnd;
+}
+
+/* Called once every stage holds its own copy, so the drain sees EOF when they exit. */
+void closeJobOutputLogWriter(JobOutputLog* log)
+{
+    if (log != NULL && log->writeEnd != NULL)
+    {
+        CloseHandle(log->writeEnd);
+        log->writeEnd = NULL;
+    }
+}
+
+/* Job numbers are reused, so a new job replaces whatever log had its number. */
+void attachJobOutputLog(JobOutputLog* log, int jobId)
+{
+    if (log == NULL) return;
+
+    for (int logI = 0; logI < MAX_JOB_OUTPUT_LOGS; logI++)
+    {
+        JobOutputLog* previous = jobOutputLogs[logI];
+        if (previous != NULL && previous != log && previous->jobId == jobId)
+        {
+            discardJobOutputLog(previous);
+        }
+    }
+    log->jobId = jobId;
+}
+
+/*
+ * A job that is still running loses its stdout and stderr here: the drain
+ * stops and the job's next write fails with a broken pipe.
+ */
+void discardJobOutputLog(JobOutputLog* log)
+{
+    if (log == NULL) return;
+
+    unlistJobOutputLog(log);
+    closeJobOutputLogWriter(log);
+    InterlockedExchange(&log->abandoned, 1);
+    CancelSynchronousIo(log->thread);
+    CloseHandle(log->thread);
+    releaseJobOutputLog(log);
+}
+
+void cleanupJobOutputLogs(void)
+{
+    for (int logI = 0; logI < MAX_JOB_OUTPUT_LOGS; logI++)
+    {
+        discardJobOutputLog(jobOutputLogs[logI]);
+    }
+}
+
+static JobOutputLog* findJobOutputLog(int jobId)
+{
+    for (int logI = 0; logI < MAX_JOB_OUTPUT_LOGS; logI++)
+    {
+        if (jobOutputLogs[logI] != NULL && jobOutputLogs[logI]->jobId == jobId)
+        {
+            return jobOutputLogs[logI];
+        }
+    }
+    return NULL;
+}
+
+static int writeToHandle(HANDLE hOut, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        DWORD written = 0;
+        if (!WriteFile(hOut, data, (DWORD)length, &written, NULL) || written == 0)
+        {
+            return 0;
+        }
+        data += written;
+        length -= written;
+    }
+    return 1;
+}
+
+/*
+ * Copies the kept bytes out under the lock and writes them after letting
+ * go, so a slow reader of joblog never stalls the job. Once the ring has
+ * wrapped, the partial first line is skipped.
+ */
+static int printJobOutputLog(JobOutputLog* log, HANDLE hOut)
+{
+    EnterCriticalSection(&log->lock);
+    unsigned long long totalBytes = log->totalBytes;
+    size_t kept = totalBytes < log->capacity ? (size_t)totalBytes : log->capacity;
+    char* snapshot = (char*)malloc(kept + 1);
+    if (snapshot != NULL)
+    {
+        size_t start = (size_t)((totalBytes - kept) % log->capacity);
+        size_t firstPart = log->capacity - start;
+        if (firstPart > kept)
+        {
+            firstPart = kept;
+        }
+        memcpy(snapshot, log->data + start, firstPart);
+        memcpy(snapshot + firstPart, log->data, kept - firstPart);
+    }
+    LeaveCriticalSection(&log->lock);
+
+    if (snapshot == NULL)
+    {
+        fprintf(stderr, "joblog: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t skipped = 0;
+    if (totalBytes > kept)
+    {
+        const char* newline = (const char*)memchr(snapshot, '\n', kept);
+        if (newline != NULL && newline + 1 < snapshot + kept)
+        {
+            skipped = (size_t)(newline - snapshot) + 1;
+        }
+        fprintf(stderr, "joblog: [%d] %llu earlier bytes dropped\n", log->jobId,
+            totalBytes - kept + skipped);
+    }
+
+    int written = writeToHandle(hOut, snapshot + skipped, kept - skipped);
+    free(snapshot);
+    return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void listJobOutputLogs(HANDLE hOut)
+{
+    for (int logI = 0; logI < MAX_JOB_OUTPUT_LOGS; logI++)
+    {
+        JobOutputLog* log = jobOutputLogs[logI];
+        if (log == NULL || log->jobId == 0) continue;
+
+        EnterCriticalSection(&log->lock);
+        unsigned long long totalBytes = log->totalBytes;
+        LeaveCriticalSection(&log->lock);
+
+        char line[160];
+        int length = _snprintf_s(line, sizeof(line), _TRUNCATE,
+            "[%d]  %s\t%llu bytes written, last %llu kept\n", log->jobId,
+            log->finished ? "Done" : "Running", totalBytes,
+            (unsigned long long)log->capacity);
+        if (length > 0)
+        {
+            writeToHandle(hOut, line, (size_t)length);
+        }
+    }
+}
+
+/* "joblog" lists captured jobs; "joblog %N..." prints what each one kept. */
+int runJoblogBuiltin(char** args, HANDLE hIn, HANDLE hOut)
+{
+    (void)hIn;
+    if (args[1] == NULL)
+    {
+        listJobOutputLogs(hOut);
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        const char* jobText = args[i][0] == '%' ? args[i] + 1 : args[i];
+        char* end = NULL;
+        long jobId = strtol(jobText, &end, 10);
+        JobOutputLog* log = NULL;
+        if (end != jobText && *end == '\0' && jobId > 0)
+        {
+            log = findJobOutputLog((int)jobId);
+        }
+        if (log == NULL)
+        {
+            fprintf(stderr, "joblog: %s: no captured output\n", args[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (printJobOutputLog(log, hOut) != EXIT_SUCCESS)
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
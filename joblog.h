@@ -0,0 +1,17 @@
+#ifndef JOBLOG_H
+#define JOBLOG_H
+
+#include <windows.h>
+
+typedef struct JobOutputLog JobOutputLog;
+
+JobOutputLog* startJobOutputLog(void);
+HANDLE getJobOutputLogWriter(const JobOutputLog* log);
+void closeJobOutputLogWriter(JobOutputLog* log);
+void attachJobOutputLog(JobOutputLog* log, int jobId);
+void discardJobOutputLog(JobOutputLog* log);
+void cleanupJobOutputLogs(void);
+
+int runJoblogBuiltin(char** args, HANDLE hIn, HANDLE hOut);
+
+#endif
@@ -0,0 +1,491 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "jobs.h"
+#include "reader.h"
+#include "allocation.h"
+
+#ifndef MAX_BACKGROUND_JOBS
+#define MAX_BACKGROUND_JOBS 64
+#endif
+
+#ifndef MAX_JOB_PROCESSES
+#define MAX_JOB_PROCESSES 20
+#endif
+
+#ifndef MAX_INPUT_LINE_LENGTH
+#define MAX_INPUT_LINE_LENGTH 4096
+#endif
+
+#ifndef JOB_POLL_INTERVAL_MS
+#define JOB_POLL_INTERVAL_MS 250
+#endif
+
+/* How long an end-of-file on stdin is checked against a racing Ctrl-C. */
+#ifndef INTERRUPT_SETTLE_MS
+#define INTERRUPT_SETTLE_MS 50
+#endif
+
+typedef struct BackgroundJob
+{
+    int jobId;
+    char* commandLine;
+    HANDLE processes[MAX_JOB_PROCESSES];
+    int processCount;
+    int liveCount;
+} BackgroundJob;
+
+static BackgroundJob backgroundJobs[MAX_BACKGROUND_JOBS];
+static int nextJobId = 1;
+
+static HANDLE interruptEvent = NULL;
+static volatile LONG foregroundInterrupted = 0;
+static HANDLE lineRequestedEvent = NULL;
+static HANDLE lineReadyEvent = NULL;
+static HANDLE stdinReaderThread = NULL;
+
+static char pendingLine[MAX_INPUT_LINE_LENGTH];
+static int pendingLineAvailable = 0;
+
+/* Where "[N] Done" lines go; NULL means stdout. */
+static FILE* jobNotificationStream = NULL;
+
+static BOOL WINAPI handleConsoleControl(DWORD controlType)
+{
+    if (controlType == CTRL_C_EVENT || controlType == CTRL_BREAK_EVENT)
+    {
+        requestForegroundInterrupt();
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* What Ctrl-C does: stops the foreground wait in progress, if any. */
+void requestForegroundInterrupt(void)
+{
+    SetEvent(interruptEvent);
+}
+
+/*
+ * A line is only read after the main loop asks for one, so the reader
+ * never competes with a foreground child for console input. A file or
+ * pipe on stdin is read without read-ahead, because "read" and the
+ * commands we start share it and must see the lines after this one.
+ */
+static DWORD WINAPI readStdinLines(LPVOID param)
+{
+    (void)param;
+    while (1)
+    {
+        WaitForSingleObject(lineRequestedEvent, INFINITE);
+        HANDLE stdinHandle = GetStdHandle(STD_INPUT_HANDLE);
+        DWORD stdinType = GetFileType(stdinHandle);
+        int gotLine = (stdinType == FILE_TYPE_DISK || stdinType == FILE_TYPE_PIPE) ?
+            readShellInputLine(stdinHandle, pendingLine, sizeof(pendingLine)) :
+            fgets(pendingLine, sizeof(pendingLine), stdin) != NULL;
+        if (gotLine)
+        {
+            pendingLineAvailable = 1;
+        }
+        else
+        {
+            pendingLineAvailable = 0;
+            clearerr(stdin);
+        }
+        SetEvent(lineReadyEvent);
+    }
+    return 0;
+}
+
+int initializeJobControl(void)
+{
+    ZeroMemory(backgroundJobs, sizeof(backgroundJobs));
+
+    interruptEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    lineRequestedEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    lineReadyEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (!interruptEvent || !lineRequestedEvent || !lineReadyEvent)
+    {
+        fprintf(stderr, "Failed to create event loop events.\n");
+        return 0;
+    }
+
+    SetConsoleCtrlHandler(handleConsoleControl, TRUE);
+
+    stdinReaderThread = CreateThread(NULL, 0, readStdinLines, NULL, 0, NULL);
+    if (stdinReaderThread == NULL)
+    {
+        fprintf(stderr, "Failed to start input reader thread.\n");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Background jobs keep running after the shell exits; only our handles to
+ * them are released. The reader thread is left blocked and dies with us.
+ */
+void shutdownJobControl(void)
+{
+    for (int jobI = 0; jobI < MAX_BACKGROUND_JOBS; jobI++)
+    {
+        BackgroundJob* job = &backgroundJobs[jobI];
+        if (job->jobId == 0) continue;
+
+        for (int procI = 0; procI < job->processCount; procI++)
+        {
+            if (job->processes[procI] != NULL)
+            {
+                CloseHandle(job->processes[procI]);
+            }
+        }
+        free(job->commandLine);
+        job->jobId = 0;
+    }
+    cleanupJobOutputLogs();
+    SetConsoleCtrlHandler(handleConsoleControl, FALSE);
+}
+
+static int collectBackgroundHandles(HANDLE* waitHandles, int capacity,
+    int* overflowed)
+{
+    int count = 0;
+    *overflowed = 0;
+    for (int jobI = 0; jobI < MAX_BACKGROUND_JOBS; jobI++)
+    {
+        BackgroundJob* job = &backgroundJobs[jobI];
+        if (job->jobId == 0) continue;
+
+        for (int procI = 0; procI < job->processCount; procI++)
+        {
+            if (job->processes[procI] == NULL) continue;
+            if (count == capacity)
+            {
+                *overflowed = 1;
+                return count;
+            }
+            waitHandles[count++] = job->processes[procI];
+        }
+    }
+    return count;
+}
+
+static FILE* notificationStream(void)
+{
+    return jobNotificationStream != NULL ? jobNotificationStream : stdout;
+}
+
+void setJobNotificationStream(FILE* stream)
+{
+    jobNotificationStream = stream;
+}
+
+int reapFinishedJobs(void)
+{
+    int reported = 0;
+    int anyLeft = 0;
+    for (int jobI = 0; jobI < MAX_BACKGROUND_JOBS; jobI++)
+    {
+        BackgroundJob* job = &backgroundJobs[jobI];
+        if (job->jobId == 0) continue;
+
+        for (int procI = 0; procI < job->processCount; procI++)
+        {
+            if (job->processes[procI] != NULL &&
+                WaitForSingleObject(job->processes[procI], 0) == WAIT_OBJECT_0)
+            {
+                CloseHandle(job->processes[procI]);
+                job->processes[procI] = NULL;
+                job->liveCount--;
+            }
+        }
+
+        if (job->liveCount == 0)
+        {
+            fprintf(notificationStream(), "[%d]  Done\t\t%s\n", job->jobId,
+                job->commandLine);
+            free(job->commandLine);
+            job->jobId = 0;
+            reported++;
+        }
+        else
+        {
+            anyLeft = 1;
+        }
+    }
+
+    if (!anyLeft)
+    {
+        nextJobId = 1;
+    }
+    if (reported > 0)
+    {
+        fflush(notificationStream());
+    }
+    return reported;
+}
+
+int countRunningJobs(void)
+{
+    int running = 0;
+    for (int jobI = 0; jobI < MAX_BACKGROUND_JOBS; jobI++)
+    {
+        if (backgroundJobs[jobI].jobId != 0) running++;
+    }
+    return running;
+}
+
+/*
+ * Takes the job's output log, if any; its writer must already be closed.
+ * The log is kept under the new job number for "joblog".
+ */
+int registerBackgroundJob(HANDLE* processes, int processCount,
+    const char* commandLine, JobOutputLog* outputLog)
+{
+    BackgroundJob* job = NULL;
+    for (int jobI = 0; jobI < MAX_BACKGROUND_JOBS; jobI++)
+    {
+        if (backgroundJobs[jobI].jobId == 0)
+        {
+            job = &backgroundJobs[jobI];
+            break;
+        }
+    }
+
+    if (job == NULL || processCount > MAX_JOB_PROCESSES)
+    {
+        fprintf(stderr, "Too many background jobs, not tracking: %s\n",
+            commandLine);
+        for (int procI = 0; procI < processCount; procI++)
+        {
+            CloseHandle(processes[procI]);
+        }
+        discardJobOutputLog(outputLog);
+        return 0;
+    }
+
+    job->commandLine = _strdup(commandLine ? commandLine : "");
+    if (job->commandLine)
+    {
+        size_t labelLength = strlen(job->commandLine);
+        while (labelLength > 0 &&
+            (job->commandLine[labelLength - 1] == '\n' ||
+            job->commandLine[labelLength - 1] == '\r'))
+        {
+            job->commandLine[--labelLength] = '\0';
+        }
+    }
+    for (int procI = 0; procI < processCount; procI++)
+    {
+        job->processes[procI] = processes[procI];
+    }
+    job->processCount = processCount;
+    job->liveCount = processCount;
+    job->jobId = nextJobId++;
+    attachJobOutputLog(outputLog, job->jobId);
+
+    printf("[%d] %lu\n", job->jobId,
+        (unsigned long)GetProcessId(processes[processCount - 1]));
+    return job->jobId;
+}
+
+/*
+ * Waits for a foreground pipeline while still reaping background jobs and
+ * watching for Ctrl-C. On interrupt the remaining stages are terminated so
+ * control returns to the prompt promptly. Returns 0 if interrupted.
+ */
+int waitForForegroundProcesses(HANDLE* processes, int processCount,
+    DWORD* exitCode)
+{
+    int finished[MAXIMUM_WAIT_OBJECTS];
+    int remaining = processCount;
+    int interrupted = 0;
+
+    ZeroMemory(finished, sizeof(finished));
+    WaitForSingleObject(interruptEvent, 0);
+
+    while (remaining > 0)
+    {
+        HANDLE waitHandles[MAXIMUM_WAIT_OBJECTS];
+        int foregroundSlot[MAXIMUM_WAIT_OBJECTS];
+        DWORD waitCount = 0;
+
+        waitHandles[waitCount++] = interruptEvent;
+        for (int procI = 0; procI < processCount; procI++)
+        {
+            if (!finished[procI])
+            {
+                foregroundSlot[waitCount] = procI;
+                waitHandles[waitCount++] = processes[procI];
+            }
+        }
+        DWORD firstBackground = waitCount;
+
+        int overflowed = 0;
+        waitCount += collectBackgroundHandles(waitHandles + waitCount,
+            MAXIMUM_WAIT_OBJECTS - waitCount, &overflowed);
+
+        DWORD waitResult = WaitForMultipleObjects(waitCount, waitHandles,
+            FALSE, overflowed ? JOB_POLL_INTERVAL_MS : INFINITE);
+
+        if (waitResult == WAIT_OBJECT_0)
+        {
+            InterlockedExchange(&foregroundInterrupted, 1);
+            for (int procI = 0; procI < processCount; procI++)
+            {
+                if (!finished[procI])
+                {
+                    /*
+                     * In-process utility stages are threads: they poll
+                     * isForegroundInterrupted while scanning, and this
+                     * wakes one that is blocked in a read or write.
+                     */
+                    if (!TerminateProcess(processes[procI], INTERRUPTED_EXIT_CODE))
+                    {
+                        CancelSynchronousIo(processes[procI]);
+                    }
+                    WaitForSingleObject(processes[procI], INFINITE);
+                }
+            }
+            printf("\n");
+            interrupted = 1;
+            break;
+        }
+        else if (waitResult > WAIT_OBJECT_0 &&
+            waitResult < WAIT_OBJECT_0 + firstBackground)
+        {
+            finished[foregroundSlot[waitResult - WAIT_OBJECT_0]] = 1;
+            remaining--;
+        }
+        else if (waitResult == WAIT_FAILED)
+        {
+            fprintf(stderr, "Failed to wait for foreground job\n");
+            break;
+        }
+        else
+        {
+            reapFinishedJobs();
+        }
+    }
+
+    if (exitCode != NULL)
+    {
+        *exitCode = EXIT_FAILURE;
+        if (!GetExitCodeProcess(processes[processCount - 1], exitCode))
+        {
+            GetExitCodeThread(processes[processCount - 1], exitCode);
+        }
+    }
+    return !interrupted;
+}
+
+/*
+ * Called before anything on a new line starts, so an interrupt of an
+ * earlier line never stops a stage that has not been waited for yet.
+ */
+void beginForegroundLine(void)
+{
+    InterlockedExchange(&foregroundInterrupted, 0);
+}
+
+/*
+ * Set once Ctrl-C has stopped a foreground wait of the current line, so
+ * in-process utility threads, which cannot be terminated, stop at their
+ * next check.
+ */
+int isForegroundInterrupted(void)
+{
+    return InterlockedCompareExchange(&foregroundInterrupted, 0, 0) != 0;
+}
+
+/*
+ * Shows the prompt and multiplexes the pending input line with Ctrl-C and
+ * background job completion, so finished jobs are reported as soon as they
+ * exit rather than after the next command. Returns 0 at end of input.
+ */
+int waitForInputLine(const char* prompt, char* buffer, int bufferSize)
+{
+    int interruptedAtPrompt = 0;
+
+    printf("%s", prompt);
+    fflush(stdout);
+
+    WaitForSingleObject(interruptEvent, 0);
+    SetEvent(lineRequestedEvent);
+
+    while (1)
+    {
+        HANDLE waitHandles[MAXIMUM_WAIT_OBJECTS];
+        DWORD waitCount = 0;
+        waitHandles[waitCount++] = interruptEvent;
+        waitHandles[waitCount++] = lineReadyEvent;
+
+        int overflowed = 0;
+        waitCount += collectBackgroundHandles(waitHandles + waitCount,
+            MAXIMUM_WAIT_OBJECTS - waitCount, &overflowed);
+
+        DWORD waitResult = WaitForMultipleObjects(waitCount, waitHandles,
+            FALSE, overflowed ? JOB_POLL_INTERVAL_MS : INFINITE);
+
+        if (waitResult == WAIT_OBJECT_0)
+        {
+            printf("\n%s", prompt);
+            fflush(stdout);
+            interruptedAtPrompt = 1;
+        }
+        else if (waitResult == WAIT_OBJECT_0 + 1)
+        {
+            if (pendingLineAvailable)
+            {
+                strncpy_s(buffer, bufferSize, pendingLine, _TRUNCATE);
+                return 1;
+            }
+
+            /* A Ctrl-C at the console also ends the pending read with EOF. */
+            if (!interruptedAtPrompt &&
+                WaitForSingleObject(interruptEvent, INTERRUPT_SETTLE_MS) != WAIT_OBJECT_0)
+            {
+                return 0;
+            }
+            if (!interruptedAtPrompt)
+            {
+                printf("\n%s", prompt);
+                fflush(stdout);
+            }
+            interruptedAtPrompt = 0;
+            SetEvent(lineRequestedEvent);
+        }
+        else if (waitResult == WAIT_FAILED)
+        {
+            fprintf(stderr, "Failed to wait for input\n");
+            return 0;
+        }
+        else if (reapFinishedJobs() > 0)
+        {
+            printf("%s", prompt);
+            fflush(stdout);
+        }
+    }
+}
+
+int runJobsBuiltin(char** args)
+{
+    (void)args;
+    reapFinishedJobs();
+
+    for (int jobI = 0; jobI < MAX_BACKGROUND_JOBS; jobI++)
+    {
+        BackgroundJob* job = &backgroundJobs[jobI];
+        if (job->jobId != 0)
+        {
+            printf("[%d]  Running\t\t%s\n", job->jobId, job->commandLine);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,31 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdio.h>
+#include <windows.h>
+
+#include "joblog.h"
+
+#ifndef INTERRUPTED_EXIT_CODE
+#define INTERRUPTED_EXIT_CODE 130
+#endif
+
+int initializeJobControl(void);
+void shutdownJobControl(void);
+
+int waitForInputLine(const char* prompt, char* buffer, int bufferSize);
+
+int registerBackgroundJob(HANDLE* processes, int processCount,
+    const char* commandLine, JobOutputLog* outputLog);
+int waitForForegroundProcesses(HANDLE* processes, int processCount,
+    DWORD* exitCode);
+void beginForegroundLine(void);
+void requestForegroundInterrupt(void);
+int isForegroundInterrupted(void);
+void setJobNotificationStream(FILE* stream);
+int reapFinishedJobs(void);
+int countRunningJobs(void);
+
+int runJobsBuiltin(char** args);
+
+#endif
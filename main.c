@@ -3,30 +3,625 @@
 #include <string.h>
 #include <ctype.h>
 #include <windows.h>
+#include <psapi.h>
 #include <direct.h>
+#include <io.h>
+#include <fcntl.h>
 
 #include "environment.h"
 #include "command.h"
+#include "resource.h"
+#include "jobs.h"
+#include "daemon.h"
+#include "builtins.h"
+#include "arithmetic.h"
+#include "allocation.h"
+
+#ifndef DEFAULT_DAEMON_SESSIONS
+#define DEFAULT_DAEMON_SESSIONS 4
+#endif
+
+#ifndef DEFAULT_SOAK_LINES
+#define DEFAULT_SOAK_LINES 1000000LL
+#endif
+
+#ifndef SOAK_SAMPLE_COUNT
+#define SOAK_SAMPLE_COUNT 10
+#endif
+
+/* Heap fragmentation may move private bytes a little; a leak moves it a lot. */
+#ifndef SOAK_PRIVATE_BYTES_SLACK
+#define SOAK_PRIVATE_BYTES_SLACK (4 * 1024 * 1024)
+#endif
+
+#ifndef BENCH_TRANSFER_BYTES
+#define BENCH_TRANSFER_BYTES (512ULL * 1024 * 1024)
+#endif
+
+#ifndef BENCH_CHUNK_BYTES
+#define BENCH_CHUNK_BYTES (1024 * 1024)
+#endif
+
+static DWORD WINAPI benchProducerThread(LPVOID param)
+{
+    HANDLE writeEnd = (HANDLE)param;
+    char* chunk = (char*)calloc(1, BENCH_CHUNK_BYTES);
+    if (chunk)
+    {
+        unsigned long long sent = 0;
+        while (sent < BENCH_TRANSFER_BYTES)
+        {
+            DWORD written = 0;
+            if (!WriteFile(writeEnd, chunk, BENCH_CHUNK_BYTES, &written, NULL))
+            {
+                break;
+            }
+            sent += written;
+        }
+        free(chunk);
+    }
+    CloseHandle(writeEnd);
+    return 0;
+}
+
+/*
+ * Measures producer | consumer throughput through an anonymous pipe created
+ * with each requested buffer size ("0" is the system default).
+ */
+static int runPipeBenchmark(int argc, char** argv)
+{
+    static const char* defaultSizes[] = { "0", "64K", "256K", "1M", "4M" };
+    int sizeCount = argc > 2 ? argc - 2 :
+        (int)(sizeof(defaultSizes) / sizeof(defaultSizes[0]));
+
+    char* chunk = (char*)malloc(BENCH_CHUNK_BYTES);
+    if (!chunk)
+    {
+        fprintf(stderr, "Memory allocation failed in runPipeBenchmark.\n");
+        return EXIT_FAILURE;
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    for (int i = 0; i < sizeCount; i++)
+    {
+        const char* sizeText = argc > 2 ? argv[i + 2] : defaultSizes[i];
+        unsigned long long pipeSize = 0;
+        if (!parseSizeWithSuffix(sizeText, &pipeSize))
+        {
+            fprintf(stderr, "Invalid pipe size: %s\n", sizeText);
+            free(chunk);
+            return EXIT_FAILURE;
+        }
+
+        HANDLE readEnd;
+        HANDLE writeEnd;
+        if (!CreatePipe(&readEnd, &writeEnd, NULL, (DWORD)pipeSize))
+        {
+            fprintf(stderr, "CreatePipe failed\n");
+            free(chunk);
+            return EXIT_FAILURE;
+        }
+
+        LARGE_INTEGER startTime;
+        LARGE_INTEGER endTime;
+        QueryPerformanceCounter(&startTime);
+
+        HANDLE producer = CreateThread(NULL, 0, benchProducerThread, writeEnd, 0, NULL);
+        if (producer == NULL)
+        {
+            fprintf(stderr, "CreateThread failed\n");
+            CloseHandle(readEnd);
+            CloseHandle(writeEnd);
+            free(chunk);
+            return EXIT_FAILURE;
+        }
+
+        unsigned long long received = 0;
+        DWORD readCount = 0;
+        while (ReadFile(readEnd, chunk, BENCH_CHUNK_BYTES, &readCount, NULL) &&
+            readCount > 0)
+        {
+            received += readCount;
+        }
+
+        WaitForSingleObject(producer, INFINITE);
+        QueryPerformanceCounter(&endTime);
+        CloseHandle(producer);
+        CloseHandle(readEnd);
+
+        double seconds = (double)(endTime.QuadPart - startTime.QuadPart) /
+            (double)frequency.QuadPart;
+        printf("pipe size %-8s %10.1f MiB/s\n", sizeText,
+            seconds > 0 ? (double)received / (1024.0 * 1024.0) / seconds : 0.0);
+    }
+
+    free(chunk);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Times a command line with the in-process utilities off and then on, so
+ * e.g. "cat big.txt | grep -F x | wc -l" can be compared against the
+ * external binaries found on PATH.
+ */
+static int runUtilityBenchmark(const char* commandLine, int runs)
+{
+    initializeEnvironmentVariables();
+    char** pathList = retrieveSystemPathList();
+    if (pathList == NULL || !initializeJobControl())
+    {
+        fprintf(stderr, "Failed to initialize benchmark state.\n");
+        freePathList(pathList);
+        cleanupEnvironmentVariables();
+        return EXIT_FAILURE;
+    }
+
+    static const char* modes[] = { "0", "1" };
+    static const char* modeNames[] = { "external", "in-process" };
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    for (int modeI = 0; modeI < 2; modeI++)
+    {
+        addEnvironmentVariable("XSH_BUILTIN_UTILS", modes[modeI]);
+
+        LARGE_INTEGER startTime;
+        LARGE_INTEGER endTime;
+        QueryPerformanceCounter(&startTime);
+        for (int runI = 0; runI < runs; runI++)
+        {
+            parseAndExecuteCommandPipeline(commandLine, pathList);
+        }
+        QueryPerformanceCounter(&endTime);
+
+        double seconds = (double)(endTime.QuadPart - startTime.QuadPart) /
+            (double)frequency.QuadPart;
+        fprintf(stderr, "%-10s %8.2f ms per run\n", modeNames[modeI],
+            seconds * 1000.0 / runs);
+    }
+
+    shutdownJobControl();
+    clearResolvedCommandCache();
+    cleanupBuiltinRegistry();
+    freePathList(pathList);
+    cleanupEnvironmentVariables();
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Consumes FILE with one "read -r" per line through the normal command
+ * path, then times the in-process "wc -l < FILE" over the same bytes. The
+ * gap between the two is the per-line cost of parsing and running read.
+ */
+static int runReadBenchmark(const char* filePath)
+{
+    initializeEnvironmentVariables();
+    char** pathList = retrieveSystemPathList();
+    if (pathList == NULL || !initializeJobControl())
+    {
+        fprintf(stderr, "Failed to initialize benchmark state.\n");
+        freePathList(pathList);
+        cleanupEnvironmentVariables();
+        return EXIT_FAILURE;
+    }
+    addEnvironmentVariable("XSH_BUILTIN_UTILS", "1");
+
+    HANDLE file = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Cannot open %s\n", filePath);
+        shutdownJobControl();
+        freePathList(pathList);
+        cleanupEnvironmentVariables();
+        return EXIT_FAILURE;
+    }
+
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER startTime;
+    LARGE_INTEGER endTime;
+    QueryPerformanceFrequency(&frequency);
+
+    HANDLE savedStdin = GetStdHandle(STD_INPUT_HANDLE);
+    SetStdHandle(STD_INPUT_HANDLE, file);
+    long long lineCount = 0;
+    QueryPerformanceCounter(&startTime);
+    while (parseAndExecuteCommandPipeline("read -r XSH_BENCH_LINE", pathList) == EXIT_SUCCESS)
+    {
+        lineCount++;
+    }
+    QueryPerformanceCounter(&endTime);
+    SetStdHandle(STD_INPUT_HANDLE, savedStdin);
+    CloseHandle(file);
+    double readSeconds = (double)(endTime.QuadPart - startTime.QuadPart) /
+        (double)frequency.QuadPart;
+
+    char wcLine[MAX_PATH + 16];
+    _snprintf_s(wcLine, sizeof(wcLine), _TRUNCATE, "wc -l < %s", filePath);
+    QueryPerformanceCounter(&startTime);
+    parseAndExecuteCommandPipeline(wcLine, pathList);
+    QueryPerformanceCounter(&endTime);
+    double wcSeconds = (double)(endTime.QuadPart - startTime.QuadPart) /
+        (double)frequency.QuadPart;
+
+    printf("read -r %10.2f ms for %lld lines\n", readSeconds * 1000.0, lineCount);
+    printf("wc -l   %10.2f ms\n", wcSeconds * 1000.0);
+    if (wcSeconds > 0)
+    {
+        printf("ratio   %10.1fx\n", readSeconds / wcSeconds);
+    }
+
+    shutdownJobControl();
+    clearResolvedCommandCache();
+    cleanupBuiltinRegistry();
+    freePathList(pathList);
+    cleanupEnvironmentVariables();
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Every kind of line the shell handles, including the failure paths: a
+ * missing command at either end of a pipeline, a missing input file and an
+ * unterminated substitution. Each pass leaves the shell in the state it
+ * started in, so samples taken between passes should be identical.
+ */
+static const char* soakLines[] =
+{
+    "set SOAK_VALUE alpha",
+    "echo $SOAK_VALUE beta gamma",
+    "echo $(( SOAK_COUNT += 1 )) $((1 / 0))",
+    "export SOAK_EXPORTED=$SOAK_VALUE",
+    "unset SOAK_EXPORTED",
+    "xsh-soak-missing-command arg | wc -l",
+    "cat NUL | xsh-soak-missing-command",
+    "cat < xsh-soak-missing-file",
+    "wc -l < NUL",
+    "read -r SOAK_LINE < NUL",
+    "[ -e xsh-soak-missing-file -o ( 2 -gt 1 -a -d . ) ]",
+    "cat NUL | head -n 1 | wc -c > NUL",
+    "grep -F needle NUL |+ wc -l |+ cat > NUL",
+    "pin 0 nice -n 5 wc -c NUL",
+    "pipesize 64K cat NUL |% wc -l",
+    "echo <(unterminated",
+    "unset SOAK_COUNT",
+    "unset SOAK_VALUE"
+};
+
+/* Plays the console's part: keeps pressing Ctrl-C until the wait notices. */
+static DWORD WINAPI interruptUntilNoticed(LPVOID param)
+{
+    (void)param;
+    while (!isForegroundInterrupted())
+    {
+        requestForegroundInterrupt();
+        Sleep(10);
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Interrupts one foreground wait, then checks that the next line's
+ * in-process "wc -l" still counts instead of stopping on the old Ctrl-C.
+ */
+static int testUtilityAfterInterrupt(void)
+{
+    const char* inputPath = "xsh-interrupt-test.txt";
+    const char* outputPath = "xsh-interrupt-test.out";
+    FILE* input = fopen(inputPath, "w");
+    if (input == NULL)
+    {
+        return 0;
+    }
+    fputs("one\ntwo\nthree\n", input);
+    fclose(input);
+
+    int passed = 0;
+    HANDLE interrupter = CreateThread(NULL, 0, interruptUntilNoticed, NULL, 0, NULL);
+    if (interrupter != NULL)
+    {
+        DWORD unusedStatus = 0;
+        int interrupted = !waitForForegroundProcesses(&interrupter, 1, &unusedStatus);
+        CloseHandle(interrupter);
+
+        char** testPaths = retrieveSystemPathList();
+        addEnvironmentVariable("XSH_BUILTIN_UTILS", "1");
+        int status = parseAndExecuteCommandPipeline(
+            "wc -l xsh-interrupt-test.txt > xsh-interrupt-test.out", testPaths);
+        removeEnvironmentVariable("XSH_BUILTIN_UTILS");
+        freePathList(testPaths);
+
+        char counted[64] = "";
+        FILE* output = fopen(outputPath, "r");
+        if (output != NULL)
+        {
+            fgets(counted, sizeof(counted), output);
+            fclose(output);
+        }
+        passed = interrupted && status == EXIT_SUCCESS && atoi(counted) == 3;
+    }
+
+    DeleteFileA(inputPath);
+    DeleteFileA(outputPath);
+    return passed;
+}
+
+static SIZE_T currentPrivateBytes(void)
+{
+    PROCESS_MEMORY_COUNTERS_EX counters;
+    ZeroMemory(&counters, sizeof(counters));
+    GetProcessMemoryInfo(GetCurrentProcess(),
+        (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters));
+    return counters.PrivateUsage;
+}
+
+/*
+ * Feeds lineCount lines through the normal parse-and-execute path with
+ * stdout and stderr sent to NUL. The first sample is taken after one tenth
+ * of the run has filled the caches; every later one must match its live
+ * block count and stay within a small slack of its private bytes.
+ */
+static int runSoakTest(long long lineCount)
+{
+    const int linesPerPass = (int)(sizeof(soakLines) / sizeof(soakLines[0]));
+    long long passCount = lineCount / linesPerPass;
+    if (passCount < SOAK_SAMPLE_COUNT)
+    {
+        passCount = SOAK_SAMPLE_COUNT;
+    }
+    long long passesPerSample = passCount / SOAK_SAMPLE_COUNT;
+
+    initializeEnvironmentVariables();
+    char** pathList = retrieveSystemPathList();
+    if (pathList == NULL || !initializeJobControl())
+    {
+        fprintf(stderr, "Failed to initialize soak test state.\n");
+        freePathList(pathList);
+        cleanupEnvironmentVariables();
+        return EXIT_FAILURE;
+    }
+    addEnvironmentVariable("XSH_BUILTIN_UTILS", "1");
+
+    long long sampleLines[SOAK_SAMPLE_COUNT];
+    long long sampleBlocks[SOAK_SAMPLE_COUNT];
+    SIZE_T sampleBytes[SOAK_SAMPLE_COUNT];
+
+    fflush(stdout);
+    fflush(stderr);
+    int savedStdout = _dup(1);
+    int savedStderr = _dup(2);
+    int nullFd = _open("NUL", _O_WRONLY);
+    if (nullFd >= 0)
+    {
+        _dup2(nullFd, 1);
+        _dup2(nullFd, 2);
+        _close(nullFd);
+    }
+    SetStdHandle(STD_OUTPUT_HANDLE, (HANDLE)_get_osfhandle(1));
+    SetStdHandle(STD_ERROR_HANDLE, (HANDLE)_get_osfhandle(2));
+
+    for (int sampleI = 0; sampleI < SOAK_SAMPLE_COUNT; sampleI++)
+    {
+        for (long long passI = 0; passI < passesPerSample; passI++)
+        {
+            for (int lineI = 0; lineI < linesPerPass; lineI++)
+            {
+                parseAndExecuteCommandPipeline(soakLines[lineI], pathList);
+            }
+        }
+        fflush(stdout);
+        fflush(stderr);
+
+        AllocationStats stats;
+        getAllocationStats(&stats);
+        sampleLines[sampleI] = (sampleI + 1) * passesPerSample * linesPerPass;
+        sampleBlocks[sampleI] = stats.liveBlocks;
+        sampleBytes[sampleI] = currentPrivateBytes();
+    }
+
+    _dup2(savedStdout, 1);
+    _dup2(savedStderr, 2);
+    _close(savedStdout);
+    _close(savedStderr);
+    SetStdHandle(STD_OUTPUT_HANDLE, (HANDLE)_get_osfhandle(1));
+    SetStdHandle(STD_ERROR_HANDLE, (HANDLE)_get_osfhandle(2));
+
+    int flat = 1;
+    printf("%12s %12s %14s\n", "lines", "live blocks", "private bytes");
+    for (int sampleI = 0; sampleI < SOAK_SAMPLE_COUNT; sampleI++)
+    {
+        printf("%12lld %12lld %14llu\n", sampleLines[sampleI],
+            sampleBlocks[sampleI], (unsigned long long)sampleBytes[sampleI]);
+        if (sampleI > 0 && (sampleBlocks[sampleI] != sampleBlocks[0] ||
+            sampleBytes[sampleI] > sampleBytes[0] + SOAK_PRIVATE_BYTES_SLACK))
+        {
+            flat = 0;
+        }
+    }
+
+    shutdownJobControl();
+    clearResolvedCommandCache();
+    cleanupBuiltinRegistry();
+    freePathList(pathList);
+    cleanupEnvironmentVariables();
+
+    printf(flat ? "Soak test passed.\n" :
+        "Soak test FAILED: memory grew after warm-up.\n");
+    return flat ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int reportAllocationsOnExit = 0;
+
+static void reportAllocationsAtExit(void)
+{
+    printAllocationStats("xsh allocations at exit");
+}
+
+typedef struct ScriptSource
+{
+    FILE* file;
+    const char* text;
+} ScriptSource;
+
+/*
+ * Fetches the next runnable line from a script file or a -c string, with
+ * surrounding whitespace removed. Blank lines and '#' comments are skipped.
+ */
+static int readScriptLine(ScriptSource* source, char* line, int lineSize)
+{
+    while (1)
+    {
+        if (source->file != NULL)
+        {
+            if (!fgets(line, lineSize, source->file))
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            if (*source->text == '\0')
+            {
+                return 0;
+            }
+            const char* lineEnd = strchr(source->text, '\n');
+            size_t length = lineEnd ? (size_t)(lineEnd - source->text) :
+                strlen(source->text);
+            size_t copied = length < (size_t)lineSize ? length :
+                (size_t)lineSize - 1;
+            memcpy(line, source->text, copied);
+            line[copied] = '\0';
+            source->text += lineEnd ? length + 1 : length;
+        }
+
+        char* start = line;
+        while (isspace((unsigned char)*start)) start++;
+        size_t length = strlen(start);
+        while (length > 0 && isspace((unsigned char)start[length - 1]))
+        {
+            length--;
+        }
+        start[length] = '\0';
+        if (start != line)
+        {
+            memmove(line, start, length + 1);
+        }
+
+        if (line[0] != '\0' && line[0] != '#')
+        {
+            return 1;
+        }
+    }
+}
+
+/*
+ * There is no exec on this platform, so the final command of a
+ * non-interactive run cannot take over the shell's process. The nearest
+ * equivalent is to leave as soon as its status is known: no teardown of
+ * shell state, just the status handed straight to our parent.
+ */
+static void exitWithTailStatus(int status)
+{
+    fflush(stdout);
+    fflush(stderr);
+    ExitProcess((UINT)status);
+}
+
+/*
+ * Runs every line of a script or -c string and returns the status of the
+ * last one. Lines are read one ahead so that the final command is known
+ * before it runs; when it finishes with no background job still attached
+ * the shell exits directly with its status.
+ */
+static int runNonInteractive(ScriptSource* source, char** pathList)
+{
+    char currentLine[4096];
+    char nextLine[4096];
+    int status = EXIT_SUCCESS;
+
+    int haveCurrent = readScriptLine(source, currentLine, sizeof(currentLine));
+    while (haveCurrent)
+    {
+        if (_stricmp(currentLine, "exit") == 0 || _stricmp(currentLine, "quit") == 0)
+        {
+            break;
+        }
+
+        int haveNext = readScriptLine(source, nextLine, sizeof(nextLine));
+        status = parseAndExecuteCommandPipeline(currentLine, pathList);
+        if (!haveNext && countRunningJobs() == 0 && !reportAllocationsOnExit)
+        {
+            exitWithTailStatus(status);
+        }
+
+        if (haveNext)
+        {
+            memcpy(currentLine, nextLine, sizeof(currentLine));
+        }
+        haveCurrent = haveNext;
+    }
+    return status;
+}
 
 int main(int argc, char** argv)
 {
+    /* --stats may precede any other mode; the counts print as we exit. */
+    if (argc > 1 && _stricmp(argv[1], "--stats") == 0)
+    {
+        reportAllocationsOnExit = 1;
+        atexit(reportAllocationsAtExit);
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
     if (argc > 1)
     {
         if (_stricmp(argv[1], "--help") == 0)
         {
             printf("Usage:\n");
             printf("  xsh              - Start the shell interactively.\n");
+            printf("  xsh -c \"LINE\"     - Run LINE and exit with its status.\n");
+            printf("  xsh SCRIPT        - Run each line of SCRIPT and exit with the last status.\n");
             printf("  xsh --help        - Show this help message.\n");
             printf("  xsh --run-tests   - Run unit tests.\n");
+            printf("  xsh --stats MODE...   - Report heap allocation counts on exit.\n");
+            printf("  xsh --soak [LINES]    - Check that memory stays flat over many lines.\n");
+            printf("  xsh --bench-pipe [SIZE...] - Measure pipe throughput per buffer size.\n");
+            printf("  xsh --bench-utils \"LINE\" [RUNS] - Time LINE with external vs in-process utilities.\n");
+            printf("  xsh --bench-read FILE - Time 'read -r' over FILE against 'wc -l'.\n");
+            printf("  xsh --daemon SOCKET [MAX_SESSIONS] - Serve command lines on a Unix socket.\n");
+            printf("  xsh --submit SOCKET [-v NAME=VALUE]... COMMAND... - Run via a daemon.\n");
             printf("\nThis shell supports:\n");
-            printf("  Built-ins: cd, pwd, set, unset, echo.\n");
-            printf("  Variable substitution: $VAR.\n");
+            printf("  Built-ins: cd, pwd, set, export, unset, echo, jobs, ulimit, enable, read,\n");
+            printf("  test, [ and joblog.\n");
+            printf("  'read [-r] [NAME...]' splits one input line into variables (default REPLY).\n");
+            printf("  'enable -f MODULE.dll NAME...' loads builtins exported as xsh_builtin_NAME.\n");
+            printf("  'test EXPR' / '[ EXPR ]' check files (-e -f -d -x -r -w -s -nt -ot),\n");
+            printf("  strings (-z -n = !=) and integers (-eq -lt ...), joined by ! -a -o ( ).\n");
+            printf("  Variable substitution: $VAR; 'export NAME[=VALUE]' passes it to children.\n");
+            printf("  Arithmetic: $(( expr )) with C operators; 'echo $((i += 1))' updates i.\n");
             printf("  Piping with '|', I/O redirection with '<' and '>'\n");
+            printf("  Process substitution: <(cmd) and >(cmd) become named pipe paths.\n");
+            printf("  Metered piping with '|%%' reports bytes, rate and stalls to stderr.\n");
+            printf("  Fan-out with 'producer |+ consumer [> file] |+ consumer ...'.\n");
             printf("  Background execution with '&'.\n");
+            printf("  set XSH_JOB_CAPTURE SIZE to keep the last SIZE bytes of each background\n");
+            printf("  job's output in memory (all jobs: XSH_JOB_CAPTURE_MAX); 'joblog %%N' shows it.\n");
+            printf("  Per-job CPU/memory caps via XSH_JOB_CPU_MAX and XSH_JOB_MEMORY_MAX.\n");
+            printf("  Per-stage prefixes: pin CPUS, nice [-n N], sched idle|batch|normal;\n");
+            printf("  set XSH_STAGE_SPREAD 1 to spread pipeline stages across cores.\n");
+            printf("  Pipe buffer size via XSH_PIPE_SIZE or a leading 'pipesize N'.\n");
+            printf("  set XSH_BUILTIN_UTILS 1 to run cat, head, tail, wc and grep -F in-process.\n");
+            printf("  'cache [--] CMD ...' replays CMD's stdout and status while its inputs are\n");
+            printf("  unchanged; see XSH_CACHE_DIR, XSH_CACHE_MAX, XSH_CACHE_VARS, XSH_CACHE_HASH.\n");
             return EXIT_SUCCESS;
         }
         else if (_stricmp(argv[1], "--run-tests") == 0)
         {
+            AllocationStats statsBefore;
+            getAllocationStats(&statsBefore);
             initializeEnvironmentVariables();
             addEnvironmentVariable("TEST_VAR", "test_value");
             const char* testVal = getEnvironmentVariableValue("TEST_VAR");
@@ -36,11 +631,202 @@ int main(int argc, char** argv)
                 cleanupEnvironmentVariables();
                 return EXIT_FAILURE;
             }
+            if (getChildEnvironmentBlock() != NULL)
+            {
+                fprintf(stderr, "Test FAILED: unexported variable reached child environment.\n");
+                cleanupEnvironmentVariables();
+                return EXIT_FAILURE;
+            }
+            exportEnvironmentVariable("TEST_VAR");
+            const char* childBlock = getChildEnvironmentBlock();
+            int exportFound = 0;
+            for (const char* entry = childBlock; entry && *entry; entry += strlen(entry) + 1)
+            {
+                if (strcmp(entry, "TEST_VAR=test_value") == 0) exportFound = 1;
+            }
+            if (!exportFound || getChildEnvironmentBlock() != childBlock)
+            {
+                fprintf(stderr, "Test FAILED: exported variable missing or block not cached.\n");
+                cleanupEnvironmentVariables();
+                return EXIT_FAILURE;
+            }
             removeEnvironmentVariable("TEST_VAR");
+
+            unsigned long long parsedSize = 0;
+            if (!parseSizeWithSuffix("4M", &parsedSize) ||
+                parsedSize != 4ULL * 1024 * 1024 ||
+                parseSizeWithSuffix("4X", &parsedSize) ||
+                parseSizeWithSuffix("17179869184G", &parsedSize) ||
+                parseSizeWithSuffix("99999999999999999999", &parsedSize))
+            {
+                fprintf(stderr, "Test FAILED: size suffix parsing.\n");
+                cleanupEnvironmentVariables();
+                return EXIT_FAILURE;
+            }
+
+            long long arithmeticResult = 0;
+            int arithmeticPassed =
+                evaluateArithmetic("2 + 3 * (4 - 1) ** 2 >> 1", &arithmeticResult) &&
+                arithmeticResult == 14 &&
+                evaluateArithmetic("TEST_COUNT = 0x10, TEST_COUNT += 2, 0 && TEST_COUNT++",
+                    &arithmeticResult) &&
+                arithmeticResult == 0;
+            testVal = getEnvironmentVariableValue("TEST_COUNT");
+            if (!arithmeticPassed || testVal == NULL || strcmp(testVal, "18") != 0)
+            {
+                fprintf(stderr, "Test FAILED: arithmetic expansion.\n");
+                cleanupEnvironmentVariables();
+                return EXIT_FAILURE;
+            }
+            removeEnvironmentVariable("TEST_COUNT");
+
+            const BuiltinEntry* echoBuiltin = findBuiltin("ECHO");
+            char* enableArgs[] = { "enable", "-f", "xsh-missing-module.dll", "probe", NULL };
+            char* testArgs[] = { "[", "3", "-lt", "10", "-a", "!", "-e", "xsh-missing-file",
+                "-o", "x", "=", "y", "]", NULL };
+            if (echoBuiltin == NULL || isLoadedBuiltin(echoBuiltin) ||
+                findBuiltin("xsh-not-a-builtin") != NULL ||
+                runCoreBuiltin(findBuiltin("enable"), enableArgs) != EXIT_FAILURE ||
+                runCoreBuiltin(findBuiltin("["), testArgs) != EXIT_SUCCESS ||
+                findBuiltin("probe") != NULL)
+            {
+                fprintf(stderr, "Test FAILED: builtin registry lookup, enable -f or test.\n");
+                cleanupBuiltinRegistry();
+                cleanupEnvironmentVariables();
+                return EXIT_FAILURE;
+            }
+            cleanupBuiltinRegistry();
+
+            addEnvironmentVariable("XSH_JOB_MEMORY_MAX", "256M");
+            HANDLE testJob = createJobContainer();
+            removeEnvironmentVariable("XSH_JOB_MEMORY_MAX");
+            if (testJob == NULL)
+            {
+                fprintf(stderr, "Test FAILED: job container was not created.\n");
+                cleanupEnvironmentVariables();
+                return EXIT_FAILURE;
+            }
+            releaseJobContainer(testJob);
+
+            if (!initializeJobControl() || !testUtilityAfterInterrupt())
+            {
+                fprintf(stderr, "Test FAILED: in-process utility after Ctrl-C.\n");
+                shutdownJobControl();
+                cleanupEnvironmentVariables();
+                return EXIT_FAILURE;
+            }
+            shutdownJobControl();
+            clearResolvedCommandCache();
             cleanupEnvironmentVariables();
+
+            AllocationStats statsAfter;
+            getAllocationStats(&statsAfter);
+            if (statsAfter.liveBlocks != statsBefore.liveBlocks)
+            {
+                fprintf(stderr, "Test FAILED: %lld blocks leaked.\n",
+                    statsAfter.liveBlocks - statsBefore.liveBlocks);
+                return EXIT_FAILURE;
+            }
             printf("All tests passed.\n");
             return EXIT_SUCCESS;
         }
+        else if (_stricmp(argv[1], "--soak") == 0)
+        {
+            long long soakLineCount = argc > 2 ? _strtoi64(argv[2], NULL, 10) :
+                DEFAULT_SOAK_LINES;
+            if (soakLineCount <= 0)
+            {
+                fprintf(stderr, "Invalid line count: %s\n", argv[2]);
+                return EXIT_FAILURE;
+            }
+            return runSoakTest(soakLineCount);
+        }
+        else if (_stricmp(argv[1], "--bench-pipe") == 0)
+        {
+            return runPipeBenchmark(argc, argv);
+        }
+        else if (_stricmp(argv[1], "--bench-utils") == 0 && argc > 2)
+        {
+            int runs = argc > 3 ? atoi(argv[3]) : 5;
+            return runUtilityBenchmark(argv[2], runs > 0 ? runs : 5);
+        }
+        else if (_stricmp(argv[1], "--bench-read") == 0 && argc > 2)
+        {
+            return runReadBenchmark(argv[2]);
+        }
+        else if (_stricmp(argv[1], "--submit") == 0 && argc > 2)
+        {
+            return submitToShellDaemon(argv[2], argc - 3, argv + 3);
+        }
+        else if (_stricmp(argv[1], "--daemon") == 0 && argc > 2)
+        {
+            int maxSessions = argc > 3 ? atoi(argv[3]) : DEFAULT_DAEMON_SESSIONS;
+            if (maxSessions <= 0)
+            {
+                fprintf(stderr, "Invalid session limit: %s\n", argv[3]);
+                return EXIT_FAILURE;
+            }
+
+            initializeEnvironmentVariables();
+            char** daemonPathList = retrieveSystemPathList();
+            if (daemonPathList == NULL || !initializeJobControl())
+            {
+                fprintf(stderr, "Failed to initialize daemon state.\n");
+                freePathList(daemonPathList);
+                cleanupEnvironmentVariables();
+                return EXIT_FAILURE;
+            }
+
+            int daemonStatus = runShellDaemon(argv[2], maxSessions, daemonPathList);
+            shutdownJobControl();
+            clearResolvedCommandCache();
+            cleanupBuiltinRegistry();
+            freePathList(daemonPathList);
+            cleanupEnvironmentVariables();
+            return daemonStatus;
+        }
+        else if (strcmp(argv[1], "-c") == 0 || argv[1][0] != '-')
+        {
+            ScriptSource source = { NULL, NULL };
+            if (strcmp(argv[1], "-c") == 0)
+            {
+                if (argc < 3)
+                {
+                    fprintf(stderr, "-c requires a command line.\n");
+                    return EXIT_FAILURE;
+                }
+                source.text = argv[2];
+            }
+            else
+            {
+                source.file = fopen(argv[1], "r");
+                if (source.file == NULL)
+                {
+                    fprintf(stderr, "Cannot open script: %s\n", argv[1]);
+                    return EXIT_FAILURE;
+                }
+            }
+
+            initializeEnvironmentVariables();
+            char** scriptPathList = retrieveSystemPathList();
+            if (scriptPathList == NULL || !initializeJobControl())
+            {
+                fprintf(stderr, "Failed to initialize shell state.\n");
+                if (source.file) fclose(source.file);
+                freePathList(scriptPathList);
+                cleanupEnvironmentVariables();
+                return EXIT_FAILURE;
+            }
+
+            int scriptStatus = runNonInteractive(&source, scriptPathList);
+            if (source.file) fclose(source.file);
+            shutdownJobControl();
+            clearResolvedCommandCache();
+            cleanupBuiltinRegistry();
+            freePathList(scriptPathList);
+            cleanupEnvironmentVariables();
+            return scriptStatus;
+        }
         else
         {
             fprintf(stderr, "Unknown option: %s\n", argv[1]);
@@ -61,13 +847,17 @@ int main(int argc, char** argv)
         return EXIT_FAILURE;
     }
 
-    while(1)
+    if (!initializeJobControl())
     {
-        printf("xsh# ");
-        fflush(stdout);
+        freePathList(pathList);
+        cleanupEnvironmentVariables();
+        return EXIT_FAILURE;
+    }
 
+    while(1)
+    {
         char inputLine[4096];
-        if (fgets(inputLine, sizeof(inputLine), stdin) == NULL)
+        if (!waitForInputLine("xsh# ", inputLine, sizeof(inputLine)))
         {
             break; 
         }
@@ -99,6 +889,9 @@ int main(int argc, char** argv)
         }
     }
 
+    shutdownJobControl();
+    clearResolvedCommandCache();
+    cleanupBuiltinRegistry();
     freePathList(pathList);
     cleanupEnvironmentVariables();
     return EXIT_SUCCESS;
@@ -0,0 +1,177 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "meter.h"
+#include "allocation.h"
+
+#ifndef METER_BUFFER_SIZE
+#define METER_BUFFER_SIZE (64 * 1024)
+#endif
+
+#ifndef METER_NAME_LENGTH
+#define METER_NAME_LENGTH 64
+#endif
+
+/*
+ * The meter is shared by its relay thread and the shell; whichever of the
+ * two lets go last frees it, so background pipelines can be left to report
+ * on their own.
+ */
+struct ThroughputMeter
+{
+    HANDLE source;
+    HANDLE sink;
+    HANDLE thread;
+    volatile LONG references;
+    char upstreamName[METER_NAME_LENGTH];
+    char downstreamName[METER_NAME_LENGTH];
+    unsigned long long bytesMoved;
+    LONGLONG readWaitTicks;
+    LONGLONG writeWaitTicks;
+};
+
+static void releaseMeter(ThroughputMeter* meter)
+{
+    if (InterlockedDecrement(&meter->references) == 0)
+    {
+        free(meter);
+    }
+}
+
+static void reportThroughput(const ThroughputMeter* meter, LONGLONG elapsedTicks)
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    double seconds = (double)elapsedTicks / (double)frequency.QuadPart;
+    double rate = seconds > 0 ?
+        (double)meter->bytesMoved / (1024.0 * 1024.0) / seconds : 0.0;
+
+    fprintf(stderr, "meter %s -> %s: %llu bytes in %.2f s (%.2f MiB/s), "
+        "waited %.2f s on %s, %.2f s on %s\n",
+        meter->upstreamName, meter->downstreamName, meter->bytesMoved,
+        seconds, rate,
+        (double)meter->readWaitTicks / (double)frequency.QuadPart,
+        meter->upstreamName,
+        (double)meter->writeWaitTicks / (double)frequency.QuadPart,
+        meter->downstreamName);
+}
+
+/*
+ * Time blocked in ReadFile is time the upstream stage kept us waiting;
+ * time blocked in WriteFile is backpressure from the downstream stage.
+ */
+static DWORD WINAPI relayAndMeasure(LPVOID param)
+{
+    ThroughputMeter* meter = (ThroughputMeter*)param;
+    char* buffer = (char*)malloc(METER_BUFFER_SIZE);
+
+    LARGE_INTEGER startTime;
+    LARGE_INTEGER beforeIo;
+    LARGE_INTEGER afterIo;
+    QueryPerformanceCounter(&startTime);
+
+    while (buffer != NULL)
+    {
+        DWORD readCount = 0;
+        QueryPerformanceCounter(&beforeIo);
+        BOOL readOk = ReadFile(meter->source, buffer, METER_BUFFER_SIZE,
+            &readCount, NULL);
+        QueryPerformanceCounter(&afterIo);
+        meter->readWaitTicks += afterIo.QuadPart - beforeIo.QuadPart;
+        if (!readOk || readCount == 0)
+        {
+            break;
+        }
+
+        DWORD writtenTotal = 0;
+        BOOL writeOk = TRUE;
+        while (writeOk && writtenTotal < readCount)
+        {
+            DWORD written = 0;
+            writeOk = WriteFile(meter->sink, buffer + writtenTotal,
+                readCount - writtenTotal, &written, NULL);
+            writtenTotal += written;
+        }
+        QueryPerformanceCounter(&beforeIo);
+        meter->writeWaitTicks += beforeIo.QuadPart - afterIo.QuadPart;
+        meter->bytesMoved += writtenTotal;
+        if (!writeOk)
+        {
+            break;
+        }
+    }
+
+    LARGE_INTEGER endTime;
+    QueryPerformanceCounter(&endTime);
+
+    /* Closing both ends passes EOF downstream and a broken pipe upstream. */
+    CloseHandle(meter->source);
+    CloseHandle(meter->sink);
+    free(buffer);
+
+    reportThroughput(meter, endTime.QuadPart - startTime.QuadPart);
+    releaseMeter(meter);
+    return 0;
+}
+
+/* Takes ownership of source and sink; both must be non-inheritable. */
+ThroughputMeter* startThroughputMeter(HANDLE source, HANDLE sink,
+    const char* upstreamName, const char* downstreamName)
+{
+    ThroughputMeter* meter = (ThroughputMeter*)calloc(1, sizeof(ThroughputMeter));
+    if (!meter)
+    {
+        fprintf(stderr, "Memory allocation failed in startThroughputMeter.\n");
+        return NULL;
+    }
+
+    meter->source = source;
+    meter->sink = sink;
+    meter->references = 2;
+    strncpy_s(meter->upstreamName, sizeof(meter->upstreamName),
+        upstreamName, _TRUNCATE);
+    strncpy_s(meter->downstreamName, sizeof(meter->downstreamName),
+        downstreamName, _TRUNCATE);
+
+    meter->thread = CreateThread(NULL, 0, relayAndMeasure, meter, 0, NULL);
+    if (meter->thread == NULL)
+    {
+        fprintf(stderr, "Failed to start meter thread\n");
+        free(meter);
+        return NULL;
+    }
+    return meter;
+}
+
+void finishThroughputMeter(ThroughputMeter* meter)
+{
+    if (!meter) return;
+
+    WaitForSingleObject(meter->thread, INFINITE);
+    CloseHandle(meter->thread);
+    releaseMeter(meter);
+}
+
+void detachThroughputMeter(ThroughputMeter* meter)
+{
+    if (!meter) return;
+
+    CloseHandle(meter->thread);
+    releaseMeter(meter);
+}
+
+/* Used on pipeline setup failure, when the stages may never connect. */
+void abandonThroughputMeter(ThroughputMeter* meter)
+{
+    if (!meter) return;
+
+    CancelSynchronousIo(meter->thread);
+    detachThroughputMeter(meter);
+}
@@ -0,0 +1,14 @@
+#ifndef METER_H
+#define METER_H
+
+#include <windows.h>
+
+typedef struct ThroughputMeter ThroughputMeter;
+
+ThroughputMeter* startThroughputMeter(HANDLE source, HANDLE sink,
+    const char* upstreamName, const char* downstreamName);
+void finishThroughputMeter(ThroughputMeter* meter);
+void detachThroughputMeter(ThroughputMeter* meter);
+void abandonThroughputMeter(ThroughputMeter* meter);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+/*
+ * Interface for builtins loaded at run time with
+ * "enable -f MODULE.dll NAME". The module exports one function per
+ * builtin, named xsh_builtin_NAME, of type XshBuiltinFunction. The
+ * context is only ever extended at the end; check abiVersion or size
+ * before touching a field added after version 1.
+ *
+ * Standard streams are passed as Win32 HANDLEs rather than C runtime
+ * descriptors because a module linked against another runtime cannot use
+ * the shell's descriptors.
+ */
+
+#define XSH_PLUGIN_ABI_VERSION 1
+#define XSH_BUILTIN_SYMBOL_PREFIX "xsh_builtin_"
+
+typedef struct XshPluginContext
+{
+    unsigned int abiVersion;
+    unsigned int size;
+
+    void* stdinHandle;
+    void* stdoutHandle;
+    void* stderrHandle;
+
+    const char* (*getVariable)(const char* name);
+    void (*setVariable)(const char* name, const char* value);
+    void (*unsetVariable)(const char* name);
+    int (*exportVariable)(const char* name);
+} XshPluginContext;
+
+typedef int (__cdecl *XshBuiltinFunction)(int argc, char** argv,
+    const XshPluginContext* context);
+
+#endif
@@ -0,0 +1,423 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "reader.h"
+#include "environment.h"
+#include "allocation.h"
+
+#ifndef READ_BUFFER_SIZE
+#define READ_BUFFER_SIZE (64 * 1024)
+#endif
+
+#ifndef INITIAL_LINE_CAPACITY
+#define INITIAL_LINE_CAPACITY 256
+#endif
+
+#ifndef DEFAULT_READ_VARIABLE
+#define DEFAULT_READ_VARIABLE "REPLY"
+#endif
+
+/*
+ * Read-ahead for a file handle. A file is read a buffer at a time and the
+ * file pointer is put back at the end of each line consumed, so a command
+ * started later on the same handle picks up exactly where read stopped.
+ * The buffer is kept across calls while the handle is the shell's stdin
+ * and nobody else has moved its file pointer.
+ */
+typedef struct ReadCache
+{
+    HANDLE handle;
+    LONGLONG bufferOffset;
+    DWORD start;
+    DWORD end;
+    char buffer[READ_BUFFER_SIZE];
+} ReadCache;
+
+typedef struct LineBuffer
+{
+    char* text;
+    size_t length;
+    size_t capacity;
+} LineBuffer;
+
+static ReadCache readCache;
+static char pipePeekBuffer[READ_BUFFER_SIZE];
+
+static int appendToLine(LineBuffer* line, const char* bytes, size_t count)
+{
+    if (line->length + count + 1 > line->capacity)
+    {
+        size_t newCapacity = line->capacity ? line->capacity : INITIAL_LINE_CAPACITY;
+        while (line->length + count + 1 > newCapacity)
+        {
+            newCapacity *= 2;
+        }
+        char* grown = (char*)realloc(line->text, newCapacity);
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        line->text = grown;
+        line->capacity = newCapacity;
+    }
+    memcpy(line->text + line->length, bytes, count);
+    line->length += count;
+    line->text[line->length] = '\0';
+    return 1;
+}
+
+/* Each reader returns 1 for a line (or a final unterminated one), 0 at end of input, -1 on error. */
+static int readLineFromFile(HANDLE hIn, LineBuffer* line)
+{
+    LARGE_INTEGER zero;
+    LARGE_INTEGER position;
+    zero.QuadPart = 0;
+    if (!SetFilePointerEx(hIn, zero, &position, FILE_CURRENT))
+    {
+        return -1;
+    }
+    if (readCache.handle != hIn ||
+        position.QuadPart != readCache.bufferOffset + (LONGLONG)readCache.start)
+    {
+        readCache.handle = hIn;
+        readCache.bufferOffset = position.QuadPart;
+        readCache.start = 0;
+        readCache.end = 0;
+    }
+
+    LONGLONG filePointer = position.QuadPart;
+    int gotData = 0;
+    for (;;)
+    {
+        if (readCache.start == readCache.end)
+        {
+            readCache.bufferOffset += readCache.end;
+            readCache.start = 0;
+            readCache.end = 0;
+            DWORD bytesRead = 0;
+            LARGE_INTEGER target;
+            target.QuadPart = readCache.bufferOffset;
+            if ((filePointer != target.QuadPart &&
+                !SetFilePointerEx(hIn, target, NULL, FILE_BEGIN)) ||
+                !ReadFile(hIn, readCache.buffer, READ_BUFFER_SIZE, &bytesRead, NULL))
+            {
+                readCache.handle = NULL;
+                return -1;
+            }
+            filePointer = readCache.bufferOffset + bytesRead;
+            if (bytesRead == 0)
+            {
+                break;
+            }
+            readCache.end = bytesRead;
+        }
+
+        char* from = readCache.buffer + readCache.start;
+        DWORD available = readCache.end - readCache.start;
+        char* newline = (char*)memchr(from, '\n', available);
+        DWORD taken = newline ? (DWORD)(newline - from) + 1 : available;
+        if (!appendToLine(line, from, newline ? taken - 1 : taken))
+        {
+            readCache.handle = NULL;
+            return -1;
+        }
+        readCache.start += taken;
+        gotData = 1;
+        if (newline)
+        {
+            break;
+        }
+    }
+
+    LARGE_INTEGER logical;
+    logical.QuadPart = readCache.bufferOffset + (LONGLONG)readCache.start;
+    if (filePointer != logical.QuadPart)
+    {
+        SetFilePointerEx(hIn, logical, NULL, FILE_BEGIN);
+    }
+    return gotData;
+}
+
+/*
+ * A pipe cannot be rewound, so peek at what is already buffered in it and
+ * consume exactly up to the newline; only an empty pipe costs a blocking
+ * one-byte read.
+ */
+static int readLineFromPipe(HANDLE hIn, LineBuffer* line)
+{
+    int gotData = 0;
+    for (;;)
+    {
+        DWORD peeked = 0;
+        if (!PeekNamedPipe(hIn, pipePeekBuffer, READ_BUFFER_SIZE, &peeked, NULL, NULL))
+        {
+            return GetLastError() == ERROR_BROKEN_PIPE ? gotData : -1;
+        }
+
+        if (peeked == 0)
+        {
+            char byte;
+            DWORD bytesRead = 0;
+            if (!ReadFile(hIn, &byte, 1, &bytesRead, NULL))
+            {
+                return GetLastError() == ERROR_BROKEN_PIPE ? gotData : -1;
+            }
+            if (bytesRead == 0)
+            {
+                return gotData;
+            }
+            gotData = 1;
+            if (byte == '\n')
+            {
+                return 1;
+            }
+            if (!appendToLine(line, &byte, 1))
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        char* newline = (char*)memchr(pipePeekBuffer, '\n', peeked);
+        DWORD wanted = newline ? (DWORD)(newline - pipePeekBuffer) + 1 : peeked;
+        DWORD bytesRead = 0;
+        if (!ReadFile(hIn, pipePeekBuffer, wanted, &bytesRead, NULL))
+        {
+            return GetLastError() == ERROR_BROKEN_PIPE ? gotData : -1;
+        }
+        newline = (char*)memchr(pipePeekBuffer, '\n', bytesRead);
+        if (!appendToLine(line, pipePeekBuffer,
+            newline ? (size_t)(newline - pipePeekBuffer) : bytesRead))
+        {
+            return -1;
+        }
+        gotData = 1;
+        if (newline)
+        {
+            return 1;
+        }
+    }
+}
+
+/* Consoles and devices: one byte at a time never reads past the line. */
+static int readLineByBytes(HANDLE hIn, LineBuffer* line)
+{
+    int gotData = 0;
+    char byte;
+    DWORD bytesRead = 0;
+    while (ReadFile(hIn, &byte, 1, &bytesRead, NULL) && bytesRead == 1)
+    {
+        gotData = 1;
+        if (byte == '\n')
+        {
+            return 1;
+        }
+        if (!appendToLine(line, &byte, 1))
+        {
+            return -1;
+        }
+    }
+    return gotData;
+}
+
+static int readRawLine(HANDLE hIn, LineBuffer* line)
+{
+    int status;
+    switch (GetFileType(hIn))
+    {
+    case FILE_TYPE_DISK:
+        status = readLineFromFile(hIn, line);
+        break;
+    case FILE_TYPE_PIPE:
+        status = readLineFromPipe(hIn, line);
+        break;
+    default:
+        status = readLineByBytes(hIn, line);
+        break;
+    }
+
+    if (hIn != GetStdHandle(STD_INPUT_HANDLE))
+    {
+        readCache.handle = NULL;
+    }
+    return status;
+}
+
+/*
+ * The shell's own input when it is a file or a pipe. Lines come through
+ * the same reader as "read", so nothing past the current line sits in a
+ * CRT buffer where read and child commands cannot see it. Keeps fgets'
+ * shape: the line ends in '\n'; a longer one is cut to bufferSize.
+ */
+int readShellInputLine(HANDLE hIn, char* buffer, int bufferSize)
+{
+    LineBuffer line = { NULL, 0, 0 };
+    if (readRawLine(hIn, &line) <= 0)
+    {
+        free(line.text);
+        return 0;
+    }
+
+    size_t copied = line.length < (size_t)bufferSize - 2 ?
+        line.length : (size_t)bufferSize - 2;
+    if (copied > 0)
+    {
+        memcpy(buffer, line.text, copied);
+    }
+    buffer[copied] = '\n';
+    buffer[copied + 1] = '\0';
+    free(line.text);
+    return 1;
+}
+
+static int isFieldSeparator(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/*
+ * Splits text in place into one field per name; the last name takes the
+ * rest of the line. Without -r a backslash makes the next character
+ * literal, so an escaped separator neither splits nor gets trimmed.
+ */
+static void assignFields(char* text, char** names, int raw)
+{
+    char* readPos = text;
+    for (int nameI = 0; names[nameI] != NULL; nameI++)
+    {
+        int isLast = names[nameI + 1] == NULL;
+        while (isFieldSeparator(*readPos))
+        {
+            readPos++;
+        }
+
+        char* value = readPos;
+        char* writePos = readPos;
+        char* keepEnd = readPos;
+        while (*readPos != '\0')
+        {
+            if (!raw && *readPos == '\\' && readPos[1] != '\0')
+            {
+                *writePos++ = readPos[1];
+                readPos += 2;
+                keepEnd = writePos;
+                continue;
+            }
+            if (!isLast && isFieldSeparator(*readPos))
+            {
+                readPos++;
+                break;
+            }
+            *writePos++ = *readPos++;
+        }
+
+        if (isLast)
+        {
+            while (writePos > keepEnd && isFieldSeparator(writePos[-1]))
+            {
+                writePos--;
+            }
+        }
+        *writePos = '\0';
+        addEnvironmentVariable(names[nameI], value);
+    }
+}
+
+static int hasLineContinuation(const LineBuffer* line)
+{
+    size_t backslashes = 0;
+    while (backslashes < line->length &&
+        line->text[line->length - 1 - backslashes] == '\\')
+    {
+        backslashes++;
+    }
+    return backslashes % 2 == 1;
+}
+
+int runReadBuiltin(char** args, HANDLE hIn, HANDLE hOut)
+{
+    (void)hOut;
+    int raw = 0;
+    int firstName = 1;
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0)
+    {
+        raw = 1;
+        firstName = 2;
+    }
+    for (int i = firstName; args[i] != NULL; i++)
+    {
+        if (args[i][0] == '-' || args[i][0] == '\0' || strchr(args[i], '=') != NULL)
+        {
+            fprintf(stderr, "read: usage: read [-r] [NAME...]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    LineBuffer line = { NULL, 0, 0 };
+    int anyData = 0;
+    for (;;)
+    {
+        size_t lineStart = line.length;
+        int status = readRawLine(hIn, &line);
+        if (status < 0)
+        {
+            fprintf(stderr, "read: error reading input (error %lu)\n", GetLastError());
+            free(line.text);
+            return EXIT_FAILURE;
+        }
+        if (status == 0)
+        {
+            break;
+        }
+        anyData = 1;
+        if (line.length > lineStart && line.text[line.length - 1] == '\r')
+        {
+            line.text[--line.length] = '\0';
+        }
+        if (raw || !hasLineContinuation(&line))
+        {
+            break;
+        }
+        line.text[--line.length] = '\0';
+    }
+
+    if (!appendToLine(&line, "", 0))
+    {
+        fprintf(stderr, "read: out of memory\n");
+        free(line.text);
+        return EXIT_FAILURE;
+    }
+
+    if (args[firstName] != NULL)
+    {
+        assignFields(line.text, args + firstName, raw);
+    }
+    else
+    {
+        char* text = line.text;
+        if (!raw)
+        {
+            /* REPLY keeps its whitespace; only the escapes are resolved. */
+            char* writePos = text;
+            for (char* readPos = text; *readPos != '\0'; readPos++)
+            {
+                if (*readPos == '\\' && readPos[1] != '\0')
+                {
+                    readPos++;
+                }
+                *writePos++ = *readPos;
+            }
+            *writePos = '\0';
+        }
+        addEnvironmentVariable(DEFAULT_READ_VARIABLE, text);
+    }
+
+    free(line.text);
+    return anyData ? EXIT_SUCCESS : EXIT_FAILURE;
+}
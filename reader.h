@@ -0,0 +1,9 @@
+#ifndef READER_H
+#define READER_H
+
+#include <windows.h>
+
+int runReadBuiltin(char** args, HANDLE hIn, HANDLE hOut);
+int readShellInputLine(HANDLE hIn, char* buffer, int bufferSize);
+
+#endif
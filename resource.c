@@ -0,0 +1,635 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <windows.h>
+
+#include "resource.h"
+#include "environment.h"
+#include "allocation.h"
+
+#ifndef JOB_CPU_MAX_VARIABLE
+#define JOB_CPU_MAX_VARIABLE "XSH_JOB_CPU_MAX"
+#endif
+
+#ifndef JOB_MEMORY_MAX_VARIABLE
+#define JOB_MEMORY_MAX_VARIABLE "XSH_JOB_MEMORY_MAX"
+#endif
+
+#ifndef STAGE_SPREAD_VARIABLE
+#define STAGE_SPREAD_VARIABLE "XSH_STAGE_SPREAD"
+#endif
+
+#ifndef PIPE_SIZE_VARIABLE
+#define PIPE_SIZE_VARIABLE "XSH_PIPE_SIZE"
+#endif
+
+#ifndef MAX_PIPE_BUFFER_SIZE
+#define MAX_PIPE_BUFFER_SIZE (16ULL * 1024 * 1024)
+#endif
+
+#ifndef MAX_PHYSICAL_CORES
+#define MAX_PHYSICAL_CORES 64
+#endif
+
+#ifndef HUNDRED_NANOSECONDS_PER_SECOND
+#define HUNDRED_NANOSECONDS_PER_SECOND 10000000ULL
+#endif
+
+typedef struct UlimitOption
+{
+    char flag;
+    const char* description;
+    unsigned long long* value;
+    unsigned long long unitScale;
+} UlimitOption;
+
+static ResourceLimits shellResourceLimits = { 0, 0, 0 };
+
+static UlimitOption ulimitOptions[] =
+{
+    { 't', "cpu time (seconds)", &shellResourceLimits.cpuSeconds, 1 },
+    { 'v', "virtual memory (kbytes)", &shellResourceLimits.addressSpaceBytes, 1024 },
+    { 'n', "open files", NULL, 1 },
+    { 'u', "max user processes", &shellResourceLimits.processCount, 1 },
+};
+
+#define ULIMIT_OPTION_COUNT (sizeof(ulimitOptions) / sizeof(ulimitOptions[0]))
+
+int parseSizeWithSuffix(const char* text, unsigned long long* outValue)
+{
+    if (!text || !outValue || !isdigit((unsigned char)text[0])) return 0;
+
+    char* endPos = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(text, &endPos, 10);
+    if (errno == ERANGE) return 0;
+
+    unsigned long long multiplier = 1;
+    switch (toupper((unsigned char)*endPos))
+    {
+    case 'K':
+        multiplier = 1024ULL;
+        endPos++;
+        break;
+    case 'M':
+        multiplier = 1024ULL * 1024ULL;
+        endPos++;
+        break;
+    case 'G':
+        multiplier = 1024ULL * 1024ULL * 1024ULL;
+        endPos++;
+        break;
+    default:
+        break;
+    }
+
+    /* A size that does not fit is rejected rather than wrapped. */
+    if (value > ULLONG_MAX / multiplier) return 0;
+    value *= multiplier;
+
+    if (toupper((unsigned char)*endPos) == 'B')
+    {
+        endPos++;
+    }
+
+    if (*endPos != '\0') return 0;
+
+    *outValue = value;
+    return 1;
+}
+
+static void printUlimitOption(const UlimitOption* option)
+{
+    unsigned long long current = option->value ? *option->value : 0;
+    if (current == 0)
+    {
+        printf("%-28s(-%c) unlimited\n", option->description, option->flag);
+    }
+    else
+    {
+        printf("%-28s(-%c) %llu\n", option->description, option->flag,
+            current / option->unitScale);
+    }
+}
+
+int runUlimitBuiltin(char** args)
+{
+    if (args[1] == NULL || strcmp(args[1], "-a") == 0)
+    {
+        for (size_t i = 0; i < ULIMIT_OPTION_COUNT; i++)
+        {
+            printUlimitOption(&ulimitOptions[i]);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    int i = 1;
+    while (args[i] != NULL)
+    {
+        const UlimitOption* option = NULL;
+        if (args[i][0] == '-' && args[i][1] != '\0' && args[i][2] == '\0')
+        {
+            for (size_t optI = 0; optI < ULIMIT_OPTION_COUNT; optI++)
+            {
+                if (ulimitOptions[optI].flag == args[i][1])
+                {
+                    option = &ulimitOptions[optI];
+                    break;
+                }
+            }
+        }
+
+        if (option == NULL)
+        {
+            fprintf(stderr, "ulimit: usage: ulimit [-a] [-t|-v|-n|-u [VALUE|unlimited]]\n");
+            return EXIT_FAILURE;
+        }
+
+        const char* valueText = args[i + 1];
+        if (valueText == NULL || valueText[0] == '-')
+        {
+            printUlimitOption(option);
+            i++;
+            continue;
+        }
+
+        if (option->value == NULL)
+        {
+            /* Windows has no per-process handle quota that a parent can impose. */
+            fprintf(stderr, "ulimit: -%c: cannot be limited on this platform\n",
+                option->flag);
+            return EXIT_FAILURE;
+        }
+
+        unsigned long long newValue = 0;
+        if (_stricmp(valueText, "unlimited") != 0)
+        {
+            char* endPos = NULL;
+            errno = 0;
+            newValue = strtoull(valueText, &endPos, 10);
+            if (!isdigit((unsigned char)valueText[0]) || *endPos != '\0' ||
+                newValue == 0 || errno == ERANGE ||
+                newValue > ULLONG_MAX / option->unitScale)
+            {
+                fprintf(stderr, "ulimit: %s: invalid limit\n", valueText);
+                return EXIT_FAILURE;
+            }
+            newValue *= option->unitScale;
+        }
+        *option->value = newValue;
+        i += 2;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void saveResourceLimits(ResourceLimits* limits)
+{
+    *limits = shellResourceLimits;
+}
+
+void restoreResourceLimits(const ResourceLimits* limits)
+{
+    shellResourceLimits = *limits;
+}
+
+static int readJobCpuPercent(DWORD* outPercent)
+{
+    const char* cpuMax = getEnvironmentVariableValue(JOB_CPU_MAX_VARIABLE);
+    if (cpuMax == NULL || cpuMax[0] == '\0') return 0;
+
+    char* endPos = NULL;
+    unsigned long percent = strtoul(cpuMax, &endPos, 10);
+    if (*endPos == '%')
+    {
+        endPos++;
+    }
+    if (*endPos != '\0' || percent == 0 || percent > 100)
+    {
+        fprintf(stderr, "%s: expected a percentage between 1 and 100\n",
+            JOB_CPU_MAX_VARIABLE);
+        return 0;
+    }
+
+    *outPercent = (DWORD)percent;
+    return 1;
+}
+
+static int readJobMemoryLimit(unsigned long long* outBytes)
+{
+    const char* memoryMax = getEnvironmentVariableValue(JOB_MEMORY_MAX_VARIABLE);
+    if (memoryMax == NULL || memoryMax[0] == '\0') return 0;
+
+    if (!parseSizeWithSuffix(memoryMax, outBytes) || *outBytes == 0)
+    {
+        fprintf(stderr, "%s: invalid size: %s\n", JOB_MEMORY_MAX_VARIABLE,
+            memoryMax);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Builds a job object carrying the ulimit values as per-process limits and,
+ * when XSH_JOB_CPU_MAX / XSH_JOB_MEMORY_MAX are set, job-wide CPU and memory
+ * caps. Returns NULL when nothing is configured so that the common case
+ * spawns without the extra kernel object.
+ */
+HANDLE createJobContainer(void)
+{
+    DWORD cpuPercent = 0;
+    unsigned long long jobMemoryBytes = 0;
+    int hasCpuCap = readJobCpuPercent(&cpuPercent);
+    int hasMemoryCap = readJobMemoryLimit(&jobMemoryBytes);
+
+    if (!hasCpuCap && !hasMemoryCap &&
+        shellResourceLimits.cpuSeconds == 0 &&
+        shellResourceLimits.addressSpaceBytes == 0 &&
+        shellResourceLimits.processCount == 0)
+    {
+        return NULL;
+    }
+
+    HANDLE job = CreateJobObjectA(NULL, NULL);
+    if (job == NULL)
+    {
+        fprintf(stderr, "Failed to create job object, running without limits\n");
+        return NULL;
+    }
+
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limitInfo;
+    ZeroMemory(&limitInfo, sizeof(limitInfo));
+
+    if (shellResourceLimits.cpuSeconds != 0)
+    {
+        limitInfo.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_TIME;
+        limitInfo.BasicLimitInformation.PerProcessUserTimeLimit.QuadPart =
+            (LONGLONG)(shellResourceLimits.cpuSeconds * HUNDRED_NANOSECONDS_PER_SECOND);
+    }
+    if (shellResourceLimits.addressSpaceBytes != 0)
+    {
+        limitInfo.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_MEMORY;
+        limitInfo.ProcessMemoryLimit = (SIZE_T)shellResourceLimits.addressSpaceBytes;
+    }
+    if (shellResourceLimits.processCount != 0)
+    {
+        limitInfo.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_ACTIVE_PROCESS;
+        limitInfo.BasicLimitInformation.ActiveProcessLimit =
+            (DWORD)shellResourceLimits.processCount;
+    }
+    if (hasMemoryCap)
+    {
+        limitInfo.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+        limitInfo.JobMemoryLimit = (SIZE_T)jobMemoryBytes;
+    }
+
+    if (limitInfo.BasicLimitInformation.LimitFlags != 0 &&
+        !SetInformationJobObject(job, JobObjectExtendedLimitInformation,
+            &limitInfo, sizeof(limitInfo)))
+    {
+        fprintf(stderr, "Failed to apply job limits, running without limits\n");
+        CloseHandle(job);
+        return NULL;
+    }
+
+    if (hasCpuCap)
+    {
+        JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpuInfo;
+        ZeroMemory(&cpuInfo, sizeof(cpuInfo));
+        cpuInfo.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE |
+            JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+        /* CpuRate is expressed in 1/100ths of a percent of all processors. */
+        cpuInfo.CpuRate = cpuPercent * 100;
+        if (!SetInformationJobObject(job, JobObjectCpuRateControlInformation,
+            &cpuInfo, sizeof(cpuInfo)))
+        {
+            fprintf(stderr, "Failed to apply %s, CPU will not be capped\n",
+                JOB_CPU_MAX_VARIABLE);
+        }
+    }
+
+    return job;
+}
+
+/*
+ * Affinity, priority and job limits attach to a process, so a stage that
+ * asks for any of them cannot run as an in-process utility thread.
+ */
+int requiresSeparateProcess(const StagePlacement* placement)
+{
+    if (placement->affinityMask != 0 || placement->priorityClass != 0)
+    {
+        return 1;
+    }
+    if (shellResourceLimits.cpuSeconds != 0 ||
+        shellResourceLimits.addressSpaceBytes != 0 ||
+        shellResourceLimits.processCount != 0)
+    {
+        return 1;
+    }
+
+    const char* cpuMax = getEnvironmentVariableValue(JOB_CPU_MAX_VARIABLE);
+    const char* memoryMax = getEnvironmentVariableValue(JOB_MEMORY_MAX_VARIABLE);
+    return (cpuMax != NULL && cpuMax[0] != '\0') ||
+        (memoryMax != NULL && memoryMax[0] != '\0');
+}
+
+int placeProcessInJob(HANDLE job, HANDLE process)
+{
+    if (job == NULL) return 1;
+
+    if (!AssignProcessToJobObject(job, process))
+    {
+        fprintf(stderr, "Failed to place process in job object\n");
+        return 0;
+    }
+    return 1;
+}
+
+void releaseJobContainer(HANDLE job)
+{
+    if (job != NULL)
+    {
+        CloseHandle(job);
+    }
+}
+
+static void removeLeadingArguments(char** args, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        free(args[i]);
+    }
+
+    int readI = count;
+    int writeI = 0;
+    while (args[readI] != NULL)
+    {
+        args[writeI++] = args[readI++];
+    }
+
+    /* Clear the vacated tail so no pointer is left in two slots. */
+    while (writeI <= readI)
+    {
+        args[writeI++] = NULL;
+    }
+}
+
+static int parseCpuList(const char* text, DWORD_PTR* outMask)
+{
+    const int maxCpu = (int)(sizeof(DWORD_PTR) * 8) - 1;
+    DWORD_PTR mask = 0;
+    const char* parsePos = text;
+
+    while (*parsePos != '\0')
+    {
+        if (!isdigit((unsigned char)*parsePos)) return 0;
+
+        char* endPos = NULL;
+        long first = strtol(parsePos, &endPos, 10);
+        long last = first;
+        if (*endPos == '-')
+        {
+            if (!isdigit((unsigned char)endPos[1])) return 0;
+            last = strtol(endPos + 1, &endPos, 10);
+        }
+        if (first > last || last > maxCpu) return 0;
+
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            mask |= ((DWORD_PTR)1) << cpu;
+        }
+
+        if (*endPos == ',')
+        {
+            endPos++;
+        }
+        else if (*endPos != '\0')
+        {
+            return 0;
+        }
+        parsePos = endPos;
+    }
+
+    if (mask == 0) return 0;
+    *outMask = mask;
+    return 1;
+}
+
+static DWORD niceValueToPriorityClass(long niceValue)
+{
+    if (niceValue >= 15) return IDLE_PRIORITY_CLASS;
+    if (niceValue > 0) return BELOW_NORMAL_PRIORITY_CLASS;
+    if (niceValue == 0) return NORMAL_PRIORITY_CLASS;
+    if (niceValue > -15) return ABOVE_NORMAL_PRIORITY_CLASS;
+    return HIGH_PRIORITY_CLASS;
+}
+
+/*
+ * Strips any leading "pin CPUS", "nice [-n N]" and "sched POLICY" words from
+ * args and records them in placement. Prefixes may be combined in any order.
+ * Returns 0 (after printing a message) on a malformed prefix.
+ */
+int consumePlacementPrefixes(char** args, StagePlacement* placement)
+{
+    placement->affinityMask = 0;
+    placement->priorityClass = 0;
+
+    while (args[0] != NULL)
+    {
+        if (_stricmp(args[0], "pin") == 0)
+        {
+            if (args[1] == NULL || !parseCpuList(args[1], &placement->affinityMask))
+            {
+                fprintf(stderr, "pin: usage: pin CPU[-CPU][,CPU...] COMMAND\n");
+                return 0;
+            }
+            removeLeadingArguments(args, 2);
+        }
+        else if (_stricmp(args[0], "nice") == 0)
+        {
+            long niceValue = 10;
+            int consumed = 1;
+            if (args[1] != NULL && strcmp(args[1], "-n") == 0)
+            {
+                char* endPos = NULL;
+                if (args[2] == NULL)
+                {
+                    fprintf(stderr, "nice: usage: nice [-n N] COMMAND\n");
+                    return 0;
+                }
+                niceValue = strtol(args[2], &endPos, 10);
+                if (*endPos != '\0')
+                {
+                    fprintf(stderr, "nice: %s: invalid adjustment\n", args[2]);
+                    return 0;
+                }
+                consumed = 3;
+            }
+            placement->priorityClass = niceValueToPriorityClass(niceValue);
+            removeLeadingArguments(args, consumed);
+        }
+        else if (_stricmp(args[0], "sched") == 0)
+        {
+            if (args[1] == NULL)
+            {
+                fprintf(stderr, "sched: usage: sched idle|batch|normal COMMAND\n");
+                return 0;
+            }
+            /* Windows has no SCHED_BATCH; below-normal is its closest analogue. */
+            if (_stricmp(args[1], "idle") == 0)
+            {
+                placement->priorityClass = IDLE_PRIORITY_CLASS;
+            }
+            else if (_stricmp(args[1], "batch") == 0)
+            {
+                placement->priorityClass = BELOW_NORMAL_PRIORITY_CLASS;
+            }
+            else if (_stricmp(args[1], "normal") == 0)
+            {
+                placement->priorityClass = NORMAL_PRIORITY_CLASS;
+            }
+            else
+            {
+                fprintf(stderr, "sched: unknown policy: %s\n", args[1]);
+                return 0;
+            }
+            removeLeadingArguments(args, 2);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return 1;
+}
+
+static int collectPhysicalCoreMasks(DWORD_PTR* coreMasks, int maxCores)
+{
+    DWORD bufferLength = 0;
+    GetLogicalProcessorInformation(NULL, &bufferLength);
+    if (bufferLength == 0) return 0;
+
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION* info =
+        (SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)malloc(bufferLength);
+    if (!info) return 0;
+
+    int coreCount = 0;
+    if (GetLogicalProcessorInformation(info, &bufferLength))
+    {
+        DWORD entryCount = bufferLength / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
+        for (DWORD i = 0; i < entryCount && coreCount < maxCores; i++)
+        {
+            if (info[i].Relationship == RelationProcessorCore)
+            {
+                coreMasks[coreCount++] = info[i].ProcessorMask;
+            }
+        }
+    }
+
+    free(info);
+    return coreCount;
+}
+
+/*
+ * With XSH_STAGE_SPREAD set, gives every stage that was not pinned explicitly
+ * its own physical core (all SMT siblings of it), wrapping around when the
+ * pipeline is longer than the machine is wide.
+ */
+void assignAutomaticPlacement(StagePlacement* placements, int stageCount)
+{
+    static DWORD_PTR coreMasks[MAX_PHYSICAL_CORES];
+    static int coreCount = -1;
+
+    const char* spread = getEnvironmentVariableValue(STAGE_SPREAD_VARIABLE);
+    if (spread == NULL || spread[0] == '\0' || strcmp(spread, "0") == 0) return;
+
+    if (coreCount < 0)
+    {
+        coreCount = collectPhysicalCoreMasks(coreMasks, MAX_PHYSICAL_CORES);
+    }
+    if (coreCount <= 1) return;
+
+    for (int i = 0; i < stageCount; i++)
+    {
+        if (placements[i].affinityMask == 0)
+        {
+            placements[i].affinityMask = coreMasks[i % coreCount];
+        }
+    }
+}
+
+int applyStagePlacement(HANDLE process, const StagePlacement* placement)
+{
+    if (placement == NULL) return 1;
+
+    if (placement->affinityMask != 0 &&
+        !SetProcessAffinityMask(process, placement->affinityMask))
+    {
+        fprintf(stderr, "pin: CPU set is not available on this machine\n");
+        return 0;
+    }
+    if (placement->priorityClass != 0 &&
+        !SetPriorityClass(process, placement->priorityClass))
+    {
+        fprintf(stderr, "Failed to set scheduling class\n");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Pipe buffers come out of the nonpaged pool, so requests are clamped to
+ * MAX_PIPE_BUFFER_SIZE the same way Linux clamps to pipe-max-size.
+ */
+static int parsePipeSize(const char* source, const char* text, DWORD* outSize)
+{
+    unsigned long long requested = 0;
+    if (!parseSizeWithSuffix(text, &requested))
+    {
+        fprintf(stderr, "%s: invalid size: %s\n", source, text);
+        return 0;
+    }
+    if (requested > MAX_PIPE_BUFFER_SIZE)
+    {
+        fprintf(stderr, "%s: %s exceeds the maximum, using %llu bytes\n",
+            source, text, MAX_PIPE_BUFFER_SIZE);
+        requested = MAX_PIPE_BUFFER_SIZE;
+    }
+    *outSize = (DWORD)requested;
+    return 1;
+}
+
+DWORD getConfiguredPipeSize(void)
+{
+    const char* sizeText = getEnvironmentVariableValue(PIPE_SIZE_VARIABLE);
+    DWORD pipeSize = 0;
+    if (sizeText == NULL || sizeText[0] == '\0' ||
+        !parsePipeSize(PIPE_SIZE_VARIABLE, sizeText, &pipeSize))
+    {
+        return 0;
+    }
+    return pipeSize;
+}
+
+/* Strips a leading "pipesize N", the per-pipeline override of XSH_PIPE_SIZE. */
+int consumePipeSizePrefix(char** args, DWORD* pipeSize)
+{
+    if (args[0] == NULL || _stricmp(args[0], "pipesize") != 0) return 1;
+
+    if (args[1] == NULL || !parsePipeSize("pipesize", args[1], pipeSize))
+    {
+        fprintf(stderr, "pipesize: usage: pipesize SIZE COMMAND | ...\n");
+        return 0;
+    }
+    removeLeadingArguments(args, 2);
+    return 1;
+}
@@ -0,0 +1,38 @@
+#ifndef RESOURCE_H
+#define RESOURCE_H
+
+#include <windows.h>
+
+typedef struct StagePlacement
+{
+    DWORD_PTR affinityMask;
+    DWORD priorityClass;
+} StagePlacement;
+
+/* A value of 0 means "unlimited" for every field. */
+typedef struct ResourceLimits
+{
+    unsigned long long cpuSeconds;
+    unsigned long long addressSpaceBytes;
+    unsigned long long processCount;
+} ResourceLimits;
+
+int parseSizeWithSuffix(const char* text, unsigned long long* outValue);
+
+int runUlimitBuiltin(char** args);
+void saveResourceLimits(ResourceLimits* limits);
+void restoreResourceLimits(const ResourceLimits* limits);
+
+HANDLE createJobContainer(void);
+int requiresSeparateProcess(const StagePlacement* placement);
+int placeProcessInJob(HANDLE job, HANDLE process);
+void releaseJobContainer(HANDLE job);
+
+int consumePlacementPrefixes(char** args, StagePlacement* placement);
+void assignAutomaticPlacement(StagePlacement* placements, int stageCount);
+int applyStagePlacement(HANDLE process, const StagePlacement* placement);
+
+DWORD getConfiguredPipeSize(void);
+int consumePipeSizePrefix(char** args, DWORD* pipeSize);
+
+#endif
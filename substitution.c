@@ -0,0 +1,293 @@
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "substitution.h"
+#include "command.h"
+#include "environment.h"
+#include "resource.h"
+#include "jobs.h"
+#include "allocation.h"
+
+#ifndef MAX_PROCESS_SUBSTITUTIONS
+#define MAX_PROCESS_SUBSTITUTIONS 16
+#endif
+
+#ifndef SUBSTITUTION_PIPE_NAME_LENGTH
+#define SUBSTITUTION_PIPE_NAME_LENGTH 64
+#endif
+
+typedef enum SubstitutionDirection
+{
+    SUBSTITUTE_INPUT,
+    SUBSTITUTE_OUTPUT
+} SubstitutionDirection;
+
+/*
+ * One <(cmd) or >(cmd) argument. The outer command sees pipeName where the
+ * argument was and opens it like a file; the inner command runs on the
+ * server end of that named pipe, so data goes straight from one process to
+ * the other without touching the disk.
+ */
+typedef struct ProcessSubstitution
+{
+    SubstitutionDirection direction;
+    char* commandText;
+    char pipeName[SUBSTITUTION_PIPE_NAME_LENGTH];
+    char* environmentBlock;
+    HANDLE serverEnd;
+    HANDLE connectThread;
+    HANDLE process;
+    volatile LONG abandoned;
+} ProcessSubstitution;
+
+struct SubstitutionSet
+{
+    ProcessSubstitution entries[MAX_PROCESS_SUBSTITUTIONS];
+    int count;
+};
+
+static volatile LONG nextPipeSerial = 0;
+
+static int isSubstitutionToken(const char* token)
+{
+    size_t length = strlen(token);
+    return length >= 3 && (token[0] == '<' || token[0] == '>') &&
+        token[1] == '(' && token[length - 1] == ')';
+}
+
+/*
+ * The shell's cached block is rebuilt whenever an exported variable
+ * changes, which can happen while the outer command's arguments are still
+ * being expanded, so each substitution keeps its own copy. NULL (inherit
+ * the shell's environment) is passed through.
+ */
+static int copyEnvironmentBlock(const char* block, char** copy)
+{
+    *copy = NULL;
+    if (block == NULL)
+    {
+        return 1;
+    }
+
+    size_t length = 0;
+    while (block[length] != '\0')
+    {
+        length += strlen(block + length) + 1;
+    }
+    *copy = (char*)malloc(length + 1);
+    if (!*copy)
+    {
+        return 0;
+    }
+    memcpy(*copy, block, length + 1);
+    return 1;
+}
+
+/*
+ * A server end cannot be written to or read from until a client has
+ * connected, so the inner command is only started once the outer command
+ * has opened its path. From then on both run side by side.
+ */
+static DWORD WINAPI connectSubstitution(LPVOID param)
+{
+    ProcessSubstitution* sub = (ProcessSubstitution*)param;
+
+    BOOL connected = ConnectNamedPipe(sub->serverEnd, NULL) ||
+        GetLastError() == ERROR_PIPE_CONNECTED;
+
+    if (connected && InterlockedCompareExchange(&sub->abandoned, 0, 0) == 0)
+    {
+        HANDLE hIn = sub->direction == SUBSTITUTE_INPUT ?
+            GetStdHandle(STD_INPUT_HANDLE) : sub->serverEnd;
+        HANDLE hOut = sub->direction == SUBSTITUTE_INPUT ?
+            sub->serverEnd : GetStdHandle(STD_OUTPUT_HANDLE);
+        int spawned = spawnShellSubcommand(sub->commandText, hIn, hOut,
+            sub->environmentBlock, &sub->process);
+        if (spawned < 0)
+        {
+            fprintf(stderr, "Process substitution too long (max %d bytes quoted): %s\n",
+                MAX_SUBCOMMAND_LINE_LENGTH, sub->commandText);
+        }
+        else if (!spawned)
+        {
+            fprintf(stderr, "Failed to run process substitution: %s\n",
+                sub->commandText);
+        }
+    }
+
+    CloseHandle(sub->serverEnd);
+    sub->serverEnd = NULL;
+    return 0;
+}
+
+static int openSubstitutionPipe(ProcessSubstitution* sub)
+{
+    snprintf(sub->pipeName, sizeof(sub->pipeName), "\\\\.\\pipe\\xsh-%lu-%ld",
+        GetCurrentProcessId(), InterlockedIncrement(&nextPipeSerial));
+
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.lpSecurityDescriptor = NULL;
+    sa.bInheritHandle = TRUE;
+
+    DWORD openMode = (sub->direction == SUBSTITUTE_INPUT ?
+        PIPE_ACCESS_OUTBOUND : PIPE_ACCESS_INBOUND) | FILE_FLAG_FIRST_PIPE_INSTANCE;
+    DWORD bufferSize = getConfiguredPipeSize();
+
+    sub->serverEnd = CreateNamedPipeA(sub->pipeName, openMode,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1, bufferSize, bufferSize, 0, &sa);
+    if (sub->serverEnd == INVALID_HANDLE_VALUE)
+    {
+        sub->serverEnd = NULL;
+        fprintf(stderr, "Failed to create pipe for process substitution (error %lu)\n",
+            GetLastError());
+        return 0;
+    }
+
+    sub->connectThread = CreateThread(NULL, 0, connectSubstitution, sub, 0, NULL);
+    if (sub->connectThread == NULL)
+    {
+        fprintf(stderr, "Failed to start process substitution: %s\n",
+            sub->commandText);
+        CloseHandle(sub->serverEnd);
+        sub->serverEnd = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Replaces every "<(cmd)" and ">(cmd)" token with the path of a fresh named
+ * pipe whose inner command starts as soon as the path is opened. *started is
+ * left NULL when the line has no substitutions.
+ */
+int startProcessSubstitutions(char** tokens, SubstitutionSet** started)
+{
+    *started = NULL;
+
+    SubstitutionSet* set = NULL;
+    for (int tokenI = 0; tokens[tokenI] != NULL; tokenI++)
+    {
+        if (!isSubstitutionToken(tokens[tokenI]))
+        {
+            continue;
+        }
+
+        if (set == NULL)
+        {
+            set = (SubstitutionSet*)calloc(1, sizeof(SubstitutionSet));
+            if (!set)
+            {
+                fprintf(stderr, "Memory allocation failed in startProcessSubstitutions.\n");
+                return 0;
+            }
+        }
+        if (set->count == MAX_PROCESS_SUBSTITUTIONS)
+        {
+            fprintf(stderr, "Too many process substitutions (max %d)\n",
+                MAX_PROCESS_SUBSTITUTIONS);
+            finishProcessSubstitutions(set);
+            return 0;
+        }
+
+        char* token = tokens[tokenI];
+        size_t innerLength = strlen(token) - 3;
+        ProcessSubstitution* sub = &set->entries[set->count];
+        sub->direction = token[0] == '<' ? SUBSTITUTE_INPUT : SUBSTITUTE_OUTPUT;
+        sub->commandText = (char*)malloc(innerLength + 1);
+        if (!sub->commandText ||
+            !copyEnvironmentBlock(getChildEnvironmentBlock(), &sub->environmentBlock))
+        {
+            free(sub->commandText);
+            sub->commandText = NULL;
+            fprintf(stderr, "Memory allocation failed in startProcessSubstitutions.\n");
+            finishProcessSubstitutions(set);
+            return 0;
+        }
+        memcpy(sub->commandText, token + 2, innerLength);
+        sub->commandText[innerLength] = '\0';
+
+        if (!openSubstitutionPipe(sub))
+        {
+            free(sub->commandText);
+            sub->commandText = NULL;
+            free(sub->environmentBlock);
+            sub->environmentBlock = NULL;
+            finishProcessSubstitutions(set);
+            return 0;
+        }
+        set->count++;
+
+        char* path = _strdup(sub->pipeName);
+        if (!path)
+        {
+            fprintf(stderr, "Memory allocation failed in startProcessSubstitutions.\n");
+            finishProcessSubstitutions(set);
+            return 0;
+        }
+        free(tokens[tokenI]);
+        tokens[tokenI] = path;
+    }
+
+    *started = set;
+    return 1;
+}
+
+/*
+ * Called once the outer command has finished. Pipes it never opened are
+ * connected here so their threads wake up without starting anything, then
+ * the inner commands that did start are waited for.
+ */
+void finishProcessSubstitutions(SubstitutionSet* set)
+{
+    if (set == NULL)
+    {
+        return;
+    }
+
+    HANDLE processes[MAX_PROCESS_SUBSTITUTIONS];
+    int processCount = 0;
+
+    for (int subI = 0; subI < set->count; subI++)
+    {
+        ProcessSubstitution* sub = &set->entries[subI];
+        if (WaitForSingleObject(sub->connectThread, 0) != WAIT_OBJECT_0)
+        {
+            InterlockedExchange(&sub->abandoned, 1);
+            HANDLE client = CreateFileA(sub->pipeName,
+                sub->direction == SUBSTITUTE_INPUT ? GENERIC_READ : GENERIC_WRITE,
+                0, NULL, OPEN_EXISTING, 0, NULL);
+            WaitForSingleObject(sub->connectThread, INFINITE);
+            if (client != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(client);
+            }
+        }
+        CloseHandle(sub->connectThread);
+
+        if (sub->process != NULL)
+        {
+            processes[processCount++] = sub->process;
+        }
+        free(sub->commandText);
+        free(sub->environmentBlock);
+    }
+
+    if (processCount > 0)
+    {
+        DWORD exitCode = 0;
+        waitForForegroundProcesses(processes, processCount, &exitCode);
+        for (int procI = 0; procI < processCount; procI++)
+        {
+            CloseHandle(processes[procI]);
+        }
+    }
+    free(set);
+}
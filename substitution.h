@@ -0,0 +1,9 @@
+#ifndef SUBSTITUTION_H
+#define SUBSTITUTION_H
+
+typedef struct SubstitutionSet SubstitutionSet;
+
+int startProcessSubstitutions(char** tokens, SubstitutionSet** started);
+void finishProcessSubstitutions(SubstitutionSet* set);
+
+#endif
@@ -0,0 +1,932 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <windows.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define HAVE_SSE2_SCAN 1
+#endif
+
+#include "utilities.h"
+#include "environment.h"
+#include "jobs.h"
+#include "allocation.h"
+
+#ifndef BUILTIN_UTILS_VARIABLE
+#define BUILTIN_UTILS_VARIABLE "XSH_BUILTIN_UTILS"
+#endif
+
+#ifndef UTILITY_READ_SIZE
+#define UTILITY_READ_SIZE (256 * 1024)
+#endif
+
+/* Mapped files are scanned in slices this big, checking for Ctrl-C between them. */
+#ifndef UTILITY_MAP_SLICE_SIZE
+#define UTILITY_MAP_SLICE_SIZE (4 * 1024 * 1024)
+#endif
+
+#ifndef UTILITY_WRITE_SIZE
+#define UTILITY_WRITE_SIZE (64 * 1024)
+#endif
+
+#ifndef MAX_SINGLE_WRITE
+#define MAX_SINGLE_WRITE (1UL << 30)
+#endif
+
+#ifndef DEFAULT_LINE_COUNT
+#define DEFAULT_LINE_COUNT 10
+#endif
+
+#define WC_COUNT_LINES 1
+#define WC_COUNT_WORDS 2
+#define WC_COUNT_BYTES 4
+
+typedef enum UtilityKind
+{
+    UTILITY_CAT,
+    UTILITY_HEAD,
+    UTILITY_TAIL,
+    UTILITY_WC,
+    UTILITY_GREP
+} UtilityKind;
+
+/*
+ * A parsed in-process replacement for one pipeline stage. The string fields
+ * point into the stage's argument vector, which outlives the foreground
+ * pipeline these stages are limited to.
+ */
+struct UtilityStage
+{
+    UtilityKind kind;
+    const char* name;
+    long long lineCount;
+    int wcFields;
+    int invertMatch;
+    int countOnly;
+    const char* pattern;
+    size_t patternLength;
+    char** files;
+    int fileCount;
+    HANDLE input;
+    HANDLE output;
+};
+
+typedef struct OutputBuffer
+{
+    HANDLE handle;
+    char* data;
+    size_t used;
+    int failed;
+} OutputBuffer;
+
+typedef int (*ChunkHandler)(void* state, const char* data, size_t length);
+
+static int utilitiesEnabled(void)
+{
+    const char* enabled = getEnvironmentVariableValue(BUILTIN_UTILS_VARIABLE);
+    return enabled != NULL && enabled[0] != '\0' && strcmp(enabled, "0") != 0;
+}
+
+static size_t countByteOccurrences(const char* data, size_t length, char target)
+{
+    size_t count = 0;
+    size_t i = 0;
+
+#ifdef HAVE_SSE2_SCAN
+    const __m128i needle = _mm_set1_epi8(target);
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        while (mask != 0)
+        {
+            count++;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i < length; i++)
+    {
+        if (data[i] == target)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+static const char* findLastByte(const char* data, size_t length, char target)
+{
+    while (length > 0)
+    {
+        length--;
+        if (data[length] == target)
+        {
+            return data + length;
+        }
+    }
+    return NULL;
+}
+
+/* memchr is vectorized by the CRT, so candidates are found a block at a time. */
+static const char* findFixedString(const char* haystack, size_t length,
+    const char* pattern, size_t patternLength)
+{
+    if (patternLength == 0) return haystack;
+    if (patternLength > length) return NULL;
+
+    const char* last = haystack + (length - patternLength);
+    const char* cursor = haystack;
+    while (cursor <= last)
+    {
+        cursor = (const char*)memchr(cursor, pattern[0], (size_t)(last - cursor) + 1);
+        if (cursor == NULL) return NULL;
+        if (memcmp(cursor, pattern, patternLength) == 0) return cursor;
+        cursor++;
+    }
+    return NULL;
+}
+
+static int writeAll(OutputBuffer* out, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        DWORD chunk = length > MAX_SINGLE_WRITE ? MAX_SINGLE_WRITE : (DWORD)length;
+        DWORD written = 0;
+        if (!WriteFile(out->handle, data, chunk, &written, NULL) || written == 0)
+        {
+            out->failed = 1;
+            return 0;
+        }
+        data += written;
+        length -= written;
+    }
+    return 1;
+}
+
+static int flushOutput(OutputBuffer* out)
+{
+    if (out->failed) return 0;
+
+    int ok = writeAll(out, out->data, out->used);
+    out->used = 0;
+    return ok;
+}
+
+static int emitOutput(OutputBuffer* out, const char* data, size_t length)
+{
+    if (out->failed) return 0;
+
+    if (out->used + length > UTILITY_WRITE_SIZE && !flushOutput(out))
+    {
+        return 0;
+    }
+    if (length >= UTILITY_WRITE_SIZE)
+    {
+        return writeAll(out, data, length);
+    }
+    memcpy(out->data + out->used, data, length);
+    out->used += length;
+    return 1;
+}
+
+static void streamChunks(HANDLE source, ChunkHandler handler, void* state)
+{
+    char* buffer = (char*)malloc(UTILITY_READ_SIZE);
+    if (!buffer) return;
+
+    DWORD readCount = 0;
+    while (!isForegroundInterrupted() &&
+        ReadFile(source, buffer, UTILITY_READ_SIZE, &readCount, NULL) &&
+        readCount > 0)
+    {
+        if (!handler(state, buffer, readCount))
+        {
+            break;
+        }
+    }
+    free(buffer);
+}
+
+static void sliceMappedView(const char* view, size_t length,
+    ChunkHandler handler, void* state)
+{
+    size_t offset = 0;
+    while (offset < length && !isForegroundInterrupted())
+    {
+        size_t slice = length - offset;
+        if (slice > UTILITY_MAP_SLICE_SIZE)
+        {
+            slice = UTILITY_MAP_SLICE_SIZE;
+        }
+        if (!handler(state, view + offset, slice))
+        {
+            break;
+        }
+        offset += slice;
+    }
+}
+
+/*
+ * Feeds one input to handler: regular files are mapped and handed over in
+ * UTILITY_MAP_SLICE_SIZE slices, while stdin, pipes and unmappable files
+ * are read in UTILITY_READ_SIZE chunks. Both stop early on Ctrl-C. Returns
+ * 0 if the file could not be opened or the scan was interrupted.
+ */
+static int forEachChunk(const UtilityStage* stage, const char* path,
+    ChunkHandler handler, void* state)
+{
+    if (path == NULL || strcmp(path, "-") == 0)
+    {
+        streamChunks(stage->input, handler, state);
+        return !isForegroundInterrupted();
+    }
+
+    HANDLE file = CreateFileA(path, GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "%s: %s: cannot open file\n", stage->name, path);
+        return 0;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &fileSize) &&
+        fileSize.QuadPart > 0 &&
+        (unsigned long long)fileSize.QuadPart <= (unsigned long long)(SIZE_T)-1)
+    {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        const char* view = mapping ?
+            (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (view != NULL)
+        {
+            sliceMappedView(view, (size_t)fileSize.QuadPart, handler, state);
+            UnmapViewOfFile(view);
+            CloseHandle(mapping);
+            CloseHandle(file);
+            return !isForegroundInterrupted();
+        }
+        if (mapping != NULL)
+        {
+            CloseHandle(mapping);
+        }
+    }
+
+    streamChunks(file, handler, state);
+    CloseHandle(file);
+    return !isForegroundInterrupted();
+}
+
+static int catChunk(void* state, const char* data, size_t length)
+{
+    return emitOutput((OutputBuffer*)state, data, length);
+}
+
+static DWORD runCat(const UtilityStage* stage, OutputBuffer* out)
+{
+    DWORD status = EXIT_SUCCESS;
+    int fileI = 0;
+    do
+    {
+        const char* path = stage->fileCount ? stage->files[fileI] : NULL;
+        if (!forEachChunk(stage, path, catChunk, out))
+        {
+            status = EXIT_FAILURE;
+        }
+    } while (++fileI < stage->fileCount && !out->failed);
+    return status;
+}
+
+typedef struct HeadState
+{
+    OutputBuffer* out;
+    long long remaining;
+} HeadState;
+
+static int headChunk(void* param, const char* data, size_t length)
+{
+    HeadState* state = (HeadState*)param;
+    size_t end = 0;
+    while (state->remaining > 0 && end < length)
+    {
+        const char* newline = (const char*)memchr(data + end, '\n', length - end);
+        if (newline == NULL)
+        {
+            end = length;
+            break;
+        }
+        end = (size_t)(newline - data) + 1;
+        state->remaining--;
+    }
+
+    if (!emitOutput(state->out, data, end)) return 0;
+    return state->remaining > 0;
+}
+
+static DWORD runHead(const UtilityStage* stage, OutputBuffer* out)
+{
+    HeadState state = { out, stage->lineCount };
+    if (state.remaining == 0) return EXIT_SUCCESS;
+
+    const char* path = stage->fileCount ? stage->files[0] : NULL;
+    return forEachChunk(stage, path, headChunk, &state) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+typedef struct TailState
+{
+    char* data;
+    size_t length;
+    size_t capacity;
+    long long lines;
+    int failed;
+} TailState;
+
+/*
+ * Offset at which the last `lines` lines of data begin, or (size_t)-1 when
+ * data holds fewer lines than that. An unterminated last line counts.
+ */
+static size_t findTailStart(const char* data, size_t length, long long lines)
+{
+    if (lines == 0) return length;
+
+    size_t pos = length;
+    if (pos > 0 && data[pos - 1] == '\n')
+    {
+        pos--;
+    }
+    while (pos > 0)
+    {
+        if (data[pos - 1] == '\n' && --lines == 0)
+        {
+            return pos;
+        }
+        pos--;
+    }
+    return (size_t)-1;
+}
+
+/*
+ * Keeps only the last `lines` lines seen so far. When a chunk alone holds
+ * enough lines, older data is dropped before copying, so only the tail of
+ * each mapped slice is copied.
+ */
+static int tailChunk(void* param, const char* data, size_t length)
+{
+    TailState* state = (TailState*)param;
+
+    size_t chunkStart = findTailStart(data, length, state->lines);
+    if (chunkStart != (size_t)-1)
+    {
+        state->length = 0;
+        data += chunkStart;
+        length -= chunkStart;
+    }
+
+    if (state->length + length > state->capacity)
+    {
+        size_t newCapacity = (state->length + length) * 2;
+        char* grown = (char*)realloc(state->data, newCapacity);
+        if (!grown)
+        {
+            state->failed = 1;
+            return 0;
+        }
+        state->data = grown;
+        state->capacity = newCapacity;
+    }
+    memcpy(state->data + state->length, data, length);
+    state->length += length;
+
+    size_t trimStart = findTailStart(state->data, state->length, state->lines);
+    if (trimStart != (size_t)-1 && trimStart > 0)
+    {
+        memmove(state->data, state->data + trimStart, state->length - trimStart);
+        state->length -= trimStart;
+    }
+    return 1;
+}
+
+static DWORD runTail(const UtilityStage* stage, OutputBuffer* out)
+{
+    TailState state = { NULL, 0, 0, stage->lineCount, 0 };
+    const char* path = stage->fileCount ? stage->files[0] : NULL;
+
+    DWORD status = EXIT_SUCCESS;
+    if (!forEachChunk(stage, path, tailChunk, &state) || state.failed)
+    {
+        if (state.failed)
+        {
+            fprintf(stderr, "%s: out of memory\n", stage->name);
+        }
+        status = EXIT_FAILURE;
+    }
+    else
+    {
+        emitOutput(out, state.data, state.length);
+    }
+    free(state.data);
+    return status;
+}
+
+typedef struct WordCountState
+{
+    unsigned long long lines;
+    unsigned long long words;
+    unsigned long long bytes;
+    int inWord;
+    int countWords;
+} WordCountState;
+
+static int wordCountChunk(void* param, const char* data, size_t length)
+{
+    WordCountState* state = (WordCountState*)param;
+
+    state->lines += countByteOccurrences(data, length, '\n');
+    state->bytes += length;
+
+    if (state->countWords)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            if (isspace((unsigned char)data[i]))
+            {
+                state->inWord = 0;
+            }
+            else if (!state->inWord)
+            {
+                state->inWord = 1;
+                state->words++;
+            }
+        }
+    }
+    return 1;
+}
+
+static void emitWordCounts(OutputBuffer* out, int fields,
+    const WordCountState* counts, const char* label)
+{
+    char line[256];
+    line[0] = '\0';
+    char field[32];
+
+    if (fields & WC_COUNT_LINES)
+    {
+        _snprintf_s(field, sizeof(field), _TRUNCATE, " %7llu", counts->lines);
+        strncat_s(line, sizeof(line), field, _TRUNCATE);
+    }
+    if (fields & WC_COUNT_WORDS)
+    {
+        _snprintf_s(field, sizeof(field), _TRUNCATE, " %7llu", counts->words);
+        strncat_s(line, sizeof(line), field, _TRUNCATE);
+    }
+    if (fields & WC_COUNT_BYTES)
+    {
+        _snprintf_s(field, sizeof(field), _TRUNCATE, " %7llu", counts->bytes);
+        strncat_s(line, sizeof(line), field, _TRUNCATE);
+    }
+    if (label != NULL)
+    {
+        strncat_s(line, sizeof(line), " ", _TRUNCATE);
+        strncat_s(line, sizeof(line), label, _TRUNCATE);
+    }
+    strncat_s(line, sizeof(line), "\n", _TRUNCATE);
+
+    emitOutput(out, line + 1, strlen(line + 1));
+}
+
+static DWORD runWordCount(const UtilityStage* stage, OutputBuffer* out)
+{
+    int fields = stage->wcFields ? stage->wcFields :
+        (WC_COUNT_LINES | WC_COUNT_WORDS | WC_COUNT_BYTES);
+    WordCountState total;
+    ZeroMemory(&total, sizeof(total));
+    DWORD status = EXIT_SUCCESS;
+
+    int fileI = 0;
+    do
+    {
+        const char* path = stage->fileCount ? stage->files[fileI] : NULL;
+        WordCountState counts;
+        ZeroMemory(&counts, sizeof(counts));
+        counts.countWords = (fields & WC_COUNT_WORDS) != 0;
+
+        if (!forEachChunk(stage, path, wordCountChunk, &counts))
+        {
+            status = EXIT_FAILURE;
+            continue;
+        }
+        emitWordCounts(out, fields, &counts, path);
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+    } while (++fileI < stage->fileCount);
+
+    if (stage->fileCount > 1)
+    {
+        emitWordCounts(out, fields, &total, "total");
+    }
+    return status;
+}
+
+typedef struct GrepState
+{
+    OutputBuffer* out;
+    const char* pattern;
+    size_t patternLength;
+    int invertMatch;
+    int countOnly;
+    unsigned long long matches;
+    char* carry;
+    size_t carryLength;
+    size_t carryCapacity;
+    int failed;
+} GrepState;
+
+static int emitMatchingLine(GrepState* state, const char* line, size_t length)
+{
+    state->matches++;
+    if (state->countOnly) return 1;
+
+    if (!emitOutput(state->out, line, length)) return 0;
+    if (length == 0 || line[length - 1] != '\n')
+    {
+        return emitOutput(state->out, "\n", 1);
+    }
+    return 1;
+}
+
+/*
+ * region holds whole lines. Without -v the pattern is searched across the
+ * region and only matching lines are delimited, so non-matching stretches
+ * cost one scan; -v has to walk every line.
+ */
+static int grepLines(GrepState* state, const char* region, size_t length)
+{
+    if (!state->invertMatch)
+    {
+        size_t searchFrom = 0;
+        while (searchFrom < length)
+        {
+            const char* match = findFixedString(region + searchFrom,
+                length - searchFrom, state->pattern, state->patternLength);
+            if (match == NULL) break;
+
+            size_t matchOffset = (size_t)(match - region);
+            size_t lineStart = matchOffset;
+            while (lineStart > searchFrom && region[lineStart - 1] != '\n')
+            {
+                lineStart--;
+            }
+            const char* newline = (const char*)memchr(match, '\n', length - matchOffset);
+            size_t lineEnd = newline ? (size_t)(newline - region) + 1 : length;
+
+            if (!emitMatchingLine(state, region + lineStart, lineEnd - lineStart))
+            {
+                return 0;
+            }
+            searchFrom = lineEnd;
+        }
+        return 1;
+    }
+
+    size_t lineStart = 0;
+    while (lineStart < length)
+    {
+        const char* newline = (const char*)memchr(region + lineStart, '\n',
+            length - lineStart);
+        size_t lineEnd = newline ? (size_t)(newline - region) + 1 : length;
+        size_t contentLength = (newline ? lineEnd - 1 : lineEnd) - lineStart;
+
+        if (findFixedString(region + lineStart, contentLength,
+            state->pattern, state->patternLength) == NULL &&
+            !emitMatchingLine(state, region + lineStart, lineEnd - lineStart))
+        {
+            return 0;
+        }
+        lineStart = lineEnd;
+    }
+    return 1;
+}
+
+static int appendCarry(GrepState* state, const char* data, size_t length)
+{
+    if (state->carryLength + length > state->carryCapacity)
+    {
+        size_t newCapacity = (state->carryLength + length) * 2;
+        char* grown = (char*)realloc(state->carry, newCapacity);
+        if (!grown)
+        {
+            state->failed = 1;
+            return 0;
+        }
+        state->carry = grown;
+        state->carryCapacity = newCapacity;
+    }
+    memcpy(state->carry + state->carryLength, data, length);
+    state->carryLength += length;
+    return 1;
+}
+
+/* Lines split across chunk boundaries are completed in the carry buffer. */
+static int grepChunk(void* param, const char* data, size_t length)
+{
+    GrepState* state = (GrepState*)param;
+
+    if (state->carryLength > 0)
+    {
+        const char* firstNewline = (const char*)memchr(data, '\n', length);
+        if (firstNewline == NULL)
+        {
+            return appendCarry(state, data, length);
+        }
+
+        size_t headLength = (size_t)(firstNewline - data) + 1;
+        if (!appendCarry(state, data, headLength) ||
+            !grepLines(state, state->carry, state->carryLength))
+        {
+            return 0;
+        }
+        state->carryLength = 0;
+        data += headLength;
+        length -= headLength;
+    }
+
+    const char* lastNewline = findLastByte(data, length, '\n');
+    size_t completeLength = lastNewline ? (size_t)(lastNewline - data) + 1 : 0;
+    if (completeLength > 0 && !grepLines(state, data, completeLength))
+    {
+        return 0;
+    }
+    return appendCarry(state, data + completeLength, length - completeLength);
+}
+
+static DWORD runGrep(const UtilityStage* stage, OutputBuffer* out)
+{
+    GrepState state;
+    ZeroMemory(&state, sizeof(state));
+    state.out = out;
+    state.pattern = stage->pattern;
+    state.patternLength = stage->patternLength;
+    state.invertMatch = stage->invertMatch;
+    state.countOnly = stage->countOnly;
+
+    const char* path = stage->fileCount ? stage->files[0] : NULL;
+    int opened = forEachChunk(stage, path, grepChunk, &state);
+    if (opened && state.carryLength > 0 && !state.failed)
+    {
+        grepLines(&state, state.carry, state.carryLength);
+    }
+    free(state.carry);
+
+    if (!opened || state.failed)
+    {
+        return 2;
+    }
+    if (state.countOnly)
+    {
+        char countLine[32];
+        _snprintf_s(countLine, sizeof(countLine), _TRUNCATE, "%llu\n", state.matches);
+        emitOutput(out, countLine, strlen(countLine));
+    }
+    return state.matches > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static DWORD WINAPI runUtilityStage(LPVOID param)
+{
+    UtilityStage* stage = (UtilityStage*)param;
+    DWORD status = EXIT_FAILURE;
+
+    OutputBuffer out;
+    out.handle = stage->output;
+    out.data = (char*)malloc(UTILITY_WRITE_SIZE);
+    out.used = 0;
+    out.failed = 0;
+
+    if (out.data != NULL)
+    {
+        switch (stage->kind)
+        {
+        case UTILITY_CAT:
+            status = runCat(stage, &out);
+            break;
+        case UTILITY_HEAD:
+            status = runHead(stage, &out);
+            break;
+        case UTILITY_TAIL:
+            status = runTail(stage, &out);
+            break;
+        case UTILITY_WC:
+            status = runWordCount(stage, &out);
+            break;
+        case UTILITY_GREP:
+            status = runGrep(stage, &out);
+            break;
+        }
+        flushOutput(&out);
+        free(out.data);
+    }
+    if (isForegroundInterrupted())
+    {
+        status = INTERRUPTED_EXIT_CODE;
+    }
+
+    /* Closing our ends is what tells the neighbouring stages we are done. */
+    if (stage->input != NULL)
+    {
+        CloseHandle(stage->input);
+    }
+    if (stage->output != NULL)
+    {
+        CloseHandle(stage->output);
+    }
+    free(stage);
+    return status;
+}
+
+/* Accepts "-n N", "-nN" and "-N". Returns -1 on a malformed count. */
+static int parseLineCountOption(char** args, int* argI, long long* lineCount)
+{
+    const char* option = args[*argI];
+    const char* countText = NULL;
+
+    if (strcmp(option, "-n") == 0)
+    {
+        countText = args[*argI + 1];
+        (*argI)++;
+    }
+    else if (option[1] == 'n')
+    {
+        countText = option + 2;
+    }
+    else
+    {
+        countText = option + 1;
+    }
+
+    if (countText == NULL || !isdigit((unsigned char)countText[0])) return -1;
+
+    char* endPos = NULL;
+    *lineCount = strtoll(countText, &endPos, 10);
+    return *endPos == '\0' ? 1 : -1;
+}
+
+static int parseUtilityOption(UtilityStage* stage, char** args, int* argI,
+    int* fixedStrings)
+{
+    const char* option = args[*argI];
+
+    switch (stage->kind)
+    {
+    case UTILITY_HEAD:
+    case UTILITY_TAIL:
+        return parseLineCountOption(args, argI, &stage->lineCount) == 1;
+    case UTILITY_WC:
+        for (const char* flag = option + 1; *flag; flag++)
+        {
+            if (*flag == 'l') stage->wcFields |= WC_COUNT_LINES;
+            else if (*flag == 'w') stage->wcFields |= WC_COUNT_WORDS;
+            else if (*flag == 'c') stage->wcFields |= WC_COUNT_BYTES;
+            else return 0;
+        }
+        return 1;
+    case UTILITY_GREP:
+        for (const char* flag = option + 1; *flag; flag++)
+        {
+            if (*flag == 'F') *fixedStrings = 1;
+            else if (*flag == 'v') stage->invertMatch = 1;
+            else if (*flag == 'c') stage->countOnly = 1;
+            else return 0;
+        }
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Returns an in-process replacement for args when XSH_BUILTIN_UTILS is set
+ * and every option is one we implement; otherwise NULL, and the external
+ * binary runs as usual.
+ */
+UtilityStage* prepareUtilityStage(char** args)
+{
+    static const struct
+    {
+        const char* name;
+        UtilityKind kind;
+    } utilityNames[] =
+    {
+        { "cat", UTILITY_CAT },
+        { "head", UTILITY_HEAD },
+        { "tail", UTILITY_TAIL },
+        { "wc", UTILITY_WC },
+        { "grep", UTILITY_GREP },
+    };
+
+    if (!args || !args[0] || !utilitiesEnabled()) return NULL;
+
+    UtilityStage* stage = NULL;
+    for (size_t i = 0; i < sizeof(utilityNames) / sizeof(utilityNames[0]); i++)
+    {
+        if (_stricmp(args[0], utilityNames[i].name) == 0)
+        {
+            stage = (UtilityStage*)calloc(1, sizeof(UtilityStage));
+            if (!stage) return NULL;
+            stage->kind = utilityNames[i].kind;
+            break;
+        }
+    }
+    if (stage == NULL) return NULL;
+
+    stage->name = args[0];
+    stage->lineCount = DEFAULT_LINE_COUNT;
+
+    int fixedStrings = 0;
+    int argI = 1;
+    while (args[argI] != NULL && args[argI][0] == '-' && args[argI][1] != '\0')
+    {
+        if (strcmp(args[argI], "--") == 0)
+        {
+            argI++;
+            break;
+        }
+        if (!parseUtilityOption(stage, args, &argI, &fixedStrings))
+        {
+            free(stage);
+            return NULL;
+        }
+        argI++;
+    }
+
+    if (stage->kind == UTILITY_GREP)
+    {
+        if (args[argI] == NULL ||
+            (!fixedStrings && strpbrk(args[argI], ".[]*^$\\+?(){}|") != NULL))
+        {
+            free(stage);
+            return NULL;
+        }
+        stage->pattern = args[argI];
+        stage->patternLength = strlen(args[argI]);
+        argI++;
+    }
+
+    stage->files = &args[argI];
+    while (args[argI] != NULL)
+    {
+        /* Options after operands are legal for GNU tools; leave those to them. */
+        if (args[argI][0] == '-' && args[argI][1] != '\0')
+        {
+            free(stage);
+            return NULL;
+        }
+        stage->fileCount++;
+        argI++;
+    }
+
+    if (stage->fileCount > 1 && stage->kind != UTILITY_CAT &&
+        stage->kind != UTILITY_WC)
+    {
+        free(stage);
+        return NULL;
+    }
+    return stage;
+}
+
+/*
+ * Runs stage on its own thread. hIn and hOut are duplicated, so the caller
+ * closes its copies exactly as it would after spawning a process. Returns
+ * the thread handle, whose exit code is the utility's status.
+ */
+HANDLE startUtilityStage(UtilityStage* stage, HANDLE hIn, HANDLE hOut)
+{
+    HANDLE self = GetCurrentProcess();
+    if (!DuplicateHandle(self, hIn, self, &stage->input, 0, FALSE,
+        DUPLICATE_SAME_ACCESS))
+    {
+        stage->input = NULL;
+    }
+    if (!DuplicateHandle(self, hOut, self, &stage->output, 0, FALSE,
+        DUPLICATE_SAME_ACCESS))
+    {
+        stage->output = NULL;
+    }
+
+    HANDLE thread = CreateThread(NULL, 0, runUtilityStage, stage, 0, NULL);
+    if (thread == NULL)
+    {
+        if (stage->input != NULL) CloseHandle(stage->input);
+        if (stage->output != NULL) CloseHandle(stage->output);
+        free(stage);
+    }
+    return thread;
+}
+
+void discardUtilityStage(UtilityStage* stage)
+{
+    free(stage);
+}
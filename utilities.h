@@ -0,0 +1,12 @@
+#ifndef UTILITIES_H
+#define UTILITIES_H
+
+#include <windows.h>
+
+typedef struct UtilityStage UtilityStage;
+
+UtilityStage* prepareUtilityStage(char** args);
+HANDLE startUtilityStage(UtilityStage* stage, HANDLE hIn, HANDLE hOut);
+void discardUtilityStage(UtilityStage* stage);
+
+#endif